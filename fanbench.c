@@ -0,0 +1,120 @@
+/*
+ * fanbench.c - Measures the throughput of the shell's |> fan-out
+ *
+ * usage: fanbench [-s shell] [-m MB] [-r runs]
+ * For 1 to 4 outputs, pipes MB megabytes (default 1024) from head to
+ * that many /dev/null files and then to that many cat consumers, once
+ * through the shell's |> relay and once through | tee, and prints the
+ * best GB/s of runs tries (default 3) of each.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+char *shell = "./tsh";
+char script[] = "/tmp/fanbenchXXXXXX";
+
+/* runscript - Run cmdline in the shell; return the seconds it took */
+double runscript(char *cmdline)
+{
+    struct timespec t0, t1;
+    FILE *fp;
+    pid_t pid;
+    int status;
+
+    if ((fp = fopen(script, "w")) == NULL) {
+	perror(script);
+	exit(1);
+    }
+    fprintf(fp, "%s\n", cmdline);
+    fclose(fp);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((pid = fork()) == 0) {
+	execl(shell, shell, script, (char *)NULL);
+	perror(shell);
+	_exit(127);
+    }
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	fprintf(stderr, "fanbench: failed: %s\n", cmdline);
+	exit(1);
+    }
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/* best - Best throughput in GB/s of runs runs of cmdline moving mb MB */
+double best(char *cmdline, long mb, int runs)
+{
+    double secs, min = 0;
+    int i;
+
+    for (i = 0; i < runs; i++) {
+	secs = runscript(cmdline);
+	if (i == 0 || secs < min)
+	    min = secs;
+    }
+    return mb / 1024.0 / min;
+}
+
+int main(int argc, char **argv)
+{
+    char relay[1024], tee[1024];
+    long mb = 1024;
+    int runs = 3, n, i, c, fd;
+    int pipes;
+
+    while ((c = getopt(argc, argv, "s:m:r:")) != EOF) {
+	switch (c) {
+	case 's':
+	    shell = optarg;
+	    break;
+	case 'm':
+	    mb = atol(optarg);
+	    break;
+	case 'r':
+	    runs = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "Usage: %s [-s shell] [-m MB] [-r runs]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if (mb <= 0 || runs <= 0) {
+	fprintf(stderr, "Usage: %s [-s shell] [-m MB] [-r runs]\n", argv[0]);
+	exit(1);
+    }
+    if ((fd = mkstemp(script)) < 0) {
+	perror("mkstemp");
+	exit(1);
+    }
+    close(fd);
+
+    printf("%-8s %-7s %10s %10s\n", "outputs", "to", "|> GB/s", "tee GB/s");
+    for (pipes = 0; pipes <= 1; pipes++) {
+	for (n = 1; n <= 4; n++) {
+	    /* head -c ... |> out |> out ...   vs   head -c ... | tee out ... */
+	    sprintf(relay, "head -c %ldM /dev/zero", mb);
+	    sprintf(tee, "head -c %ldM /dev/zero | tee", mb);
+	    for (i = 0; i < n; i++) {
+		strcat(relay, pipes ? " |> cat > /dev/null" : " |> > /dev/null");
+		if (i < n - 1)
+		    strcat(tee, pipes ? " >(cat > /dev/null)" : " /dev/null");
+	    }
+	    strcat(tee, pipes ? " | cat > /dev/null" : " > /dev/null");
+
+	    printf("%-8d %-7s", n, pipes ? "cat" : "file");
+	    fflush(stdout);
+	    printf(" %10.2f", best(relay, mb, runs));
+	    fflush(stdout);
+	    printf(" %10.2f\n", best(tee, mb, runs));
+	}
+    }
+    unlink(script);
+    exit(0);
+}
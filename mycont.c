@@ -0,0 +1,72 @@
+/* 
+ * mycont.c - Stop and continue storm for stress testing your tiny shell
+ * 
+ * usage: mycont <n>
+ * Stops itself with SIGSTOP <n> times in a row. A child it forks
+ * continues it with SIGCONT each time, as soon as it sees it stopped,
+ * so its parent (the shell) sees <n> stops and <n> continues.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/* stopped - Is process pid stopped? (state T in /proc/pid/stat) */
+int stopped(int fd)
+{
+    char buf[512], *p;
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0)
+	return -1;
+    buf[n] = '\0';
+    p = strrchr(buf, ')');
+    return p && p[2] == 'T';
+}
+
+int main(int argc, char **argv) 
+{
+    struct timespec t0, t1;
+    char path[64];
+    pid_t pid, self = getpid();
+    int i, n, fd, s;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    n = atoi(argv[1]);
+
+    sprintf(path, "/proc/%d/stat", (int)self);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	perror(path);
+	exit(1);
+    }
+    if ((pid = fork()) == 0) { /* child: continue the parent whenever it stops */
+	while ((s = stopped(fd)) >= 0) {
+	    if (s)
+		kill(self, SIGCONT);
+	    else
+		sched_yield();
+	}
+	exit(0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < n; i++)
+	kill(self, SIGSTOP);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    printf("mycont: %d stops in %.0f ms\n", n,
+	   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    exit(0);
+}
@@ -0,0 +1,65 @@
+/* 
+ * myfork.c - Child churn for stress testing your tiny shell
+ * 
+ * usage: myfork <n> <ms> [file]
+ * Forks <n> children that all exit at the same moment, <ms> milliseconds
+ * after the start, and exits as soon as they are forked, so that they
+ * outlive it. Their new parent (a subreaper shell) gets a burst of <n>
+ * exits. With <ms> 0 it is a fork bomb of short-lived children.
+ * With <file>, it writes there how many children it forked and their
+ * exit time (CLOCK_MONOTONIC, in ms), for myzombies to time the reaping.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) 
+{
+    struct timespec t0, t1, deadline;
+    int i, n, ms;
+    FILE *fp;
+
+    if (argc != 3 && argc != 4) {
+	fprintf(stderr, "Usage: %s <n> <ms> [file]\n", argv[0]);
+	exit(0);
+    }
+    n = atoi(argv[1]);
+    ms = atoi(argv[2]);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    deadline.tv_sec = t0.tv_sec + ms / 1000;
+    deadline.tv_nsec = t0.tv_nsec + (ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (i = 0; i < n; i++) {
+	pid_t pid = fork();
+
+	if (pid == 0) { /* child */
+	    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+	    _exit(0);
+	}
+	if (pid < 0) {
+	    perror("myfork: fork");
+	    break;
+	}
+    }
+
+    if (argc == 4) {
+	if ((fp = fopen(argv[3], "w")) == NULL) {
+	    perror(argv[3]);
+	    exit(1);
+	}
+	fprintf(fp, "%d %.3f\n", i, deadline.tv_sec * 1e3 + deadline.tv_nsec / 1e6);
+	fclose(fp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("myfork: %d children forked in %.0f ms\n", i,
+	   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    exit(0);
+}
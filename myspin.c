@@ -1,24 +1,28 @@
 /* 
  * myspin.c - A handy program for testing your tiny shell 
  * 
- * usage: myspin <n>
+ * usage: myspin <n>[ms]
  * Sleeps for <n> seconds in 1-second chunks.
+ * With the ms suffix (as in 250ms), <n> is in milliseconds.
  *
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 int main(int argc, char **argv) 
 {
-    int i, secs;
+    int ms;
 
     if (argc != 2) {
-	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	fprintf(stderr, "Usage: %s <n>[ms]\n", argv[0]);
 	exit(0);
     }
-    secs = atoi(argv[1]);
-    for (i=0; i < secs; i++)
-	sleep(1);
+    ms = atoi(argv[1]);
+    if (strstr(argv[1], "ms") == NULL) /* seconds */
+	ms *= 1000;
+    for (; ms > 0; ms -= 1000)
+	usleep((ms < 1000 ? ms : 1000) * 1000);
     exit(0);
 }
@@ -1,30 +1,34 @@
 /* 
  * mystop.c - Another handy routine for testing your tiny shell
  * 
- * usage: mystop <n>
+ * usage: mystop <n>[ms]
  * Sleeps for <n> seconds and sends SIGTSTP to itself.
+ * With the ms suffix (as in 250ms), <n> is in milliseconds.
  *
  */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <signal.h>
 
 int main(int argc, char **argv) 
 {
-    int i, secs;
+    int ms;
     pid_t pid; 
 
     if (argc != 2) {
-	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	fprintf(stderr, "Usage: %s <n>[ms]\n", argv[0]);
 	exit(0);
     }
-    secs = atoi(argv[1]);
+    ms = atoi(argv[1]);
+    if (strstr(argv[1], "ms") == NULL) /* seconds */
+	ms *= 1000;
 
-    for (i=0; i < secs; i++)
-       sleep(1);
+    for (; ms > 0; ms -= 1000)
+       usleep((ms < 1000 ? ms : 1000) * 1000);
 	
     pid = getpid(); 
 
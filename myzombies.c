@@ -0,0 +1,99 @@
+/* 
+ * myzombies.c - Checks that your tiny shell reaps all its children
+ * 
+ * usage: myzombies <name> <ms> [file]
+ * Waits up to <ms> milliseconds until its parent (the shell) has no
+ * children called <name>, running or zombie, and prints how many are
+ * left and how many of those are zombies. With the <file> myfork wrote,
+ * which says how many children exit and when, it also prints how long
+ * after that moment the last of them was reaped, and the rate.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* count - Count the children of ppid called name, and the zombies among them */
+int count(pid_t ppid, const char *name, int *zombies)
+{
+    char path[300], buf[512], *p, state;
+    struct dirent *de;
+    int fd, n = 0, parent;
+    ssize_t len;
+    DIR *dir = opendir("/proc");
+
+    *zombies = 0;
+    while ((de = readdir(dir)) != NULL) {
+	if (de->d_name[0] < '0' || de->d_name[0] > '9')
+	    continue;
+	sprintf(path, "/proc/%s/stat", de->d_name);
+	if ((fd = open(path, O_RDONLY)) < 0)
+	    continue;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+	    continue;
+	buf[len] = '\0';
+	/* pid (comm) state ppid ... */
+	if ((p = strrchr(buf, ')')) == NULL || sscanf(p + 2, "%c %d", &state, &parent) != 2 ||
+	    parent != ppid)
+	    continue;
+	*p = '\0';
+	if (strcmp(strchr(buf, '(') + 1, name) != 0)
+	    continue;
+	n++;
+	if (state == 'Z')
+	    (*zombies)++;
+    }
+    closedir(dir);
+    return n;
+}
+
+int main(int argc, char **argv) 
+{
+    double start, exited = 0, end;
+    int n, forked = 0, zombies, ms;
+    FILE *fp;
+
+    if (argc != 3 && argc != 4) {
+	fprintf(stderr, "Usage: %s <name> <ms> [file]\n", argv[0]);
+	exit(0);
+    }
+    ms = atoi(argv[2]);
+    if (argc == 4) {
+	if ((fp = fopen(argv[3], "r")) == NULL || fscanf(fp, "%d %lf", &forked, &exited) != 2) {
+	    fprintf(stderr, "myzombies: %s: no exit time\n", argv[3]);
+	    exit(1);
+	}
+	fclose(fp);
+    }
+
+    start = now();
+    n = count(getppid(), argv[1], &zombies);
+    while (n > 0 && now() - start < ms) {
+	usleep(1000);
+	n = count(getppid(), argv[1], &zombies);
+    }
+    end = now();
+
+    printf("myzombies: %d left, %d zombies\n", n, zombies);
+    /* One scan of /proc can outlast a whole burst, so the reaping is
+       timed from when the children exited, not from when it was seen */
+    if (n == 0 && forked > 0 && end > exited)
+	printf("myzombies: %d %s reaped %.0f ms after they exited (%.0f/s)\n", forked, argv[1],
+	       end - exited, forked / ((end - exited) / 1e3));
+    exit(0);
+}
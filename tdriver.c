@@ -0,0 +1,451 @@
+/*
+ * tdriver.c - Shell driver in C, for fast and timed runs of the traces
+ *
+ * usage: tdriver [-hlv] [-j jobs] -s shell [-a args] trace...
+ * Runs the shell on each trace as sdriver.pl does and prints the same
+ * output: the trace's comment lines, then everything the shell wrote.
+ * Up to jobs traces (default all of them) run at once, each in its own
+ * temporary working directory holding links to the executables in the
+ * current one, and their outputs are printed in order.
+ *
+ * Besides the TSTP, INT, QUIT, KILL, CLOSE, WAIT and SLEEP <n> of
+ * sdriver.pl, a trace may use:
+ *     MSLEEP <n>         Sleep for <n> milliseconds
+ *     EXPECT <text>      Wait until the shell's output since the last
+ *                        EXPECT contains text; the trace fails if it
+ *                        takes more than 5 seconds
+ *     TIMESTAMP [label]  Once the last command is done, note the time
+ *                        since the trace started, and the commands per
+ *                        second since the last TIMESTAMP
+ *
+ * A command's round trip lasts from sending it until the shell is
+ * blocked reading stdin again with nothing left in the pipe, as
+ * /proc/PID/syscall tells. The driver waits for that (up to 10 seconds)
+ * before sending the next command, but not before a signal or a sleep,
+ * so traces keep their timing. With -l each trace's output is followed
+ * by the round trip of each command, the time from the last command to
+ * each EXPECT, and the TIMESTAMPs, all in milliseconds.
+ */
+#define _GNU_SOURCE /* ppoll, nftw */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define MAXLINE 1024
+#define MAXTRACES 256
+#define MAXSHELLARGS 16
+#define IDLEWAIT 10.0   /* most seconds to wait for a command's round trip */
+#define EXPECTWAIT 5.0  /* most seconds to wait for an EXPECT */
+
+char *shellargv[MAXSHELLARGS + 2];
+int verbose = 0, latency = 0;
+
+/* The trace a worker runs */
+pid_t pid;                  /* its shell */
+int pidfd = -1;             /* readable once the shell has exited */
+int writer = -1, reader = -1; /* the shell's stdin and stdout */
+int sysfd = -1;             /* /proc/PID/syscall of the shell */
+int exited = 0;             /* the shell has exited */
+char *head = NULL, *body = NULL, *report = NULL; /* comments, shell output, latencies */
+size_t headlen = 0, bodylen = 0, reportlen = 0, mark = 0; /* mark: where EXPECT looks from */
+char pending[MAXLINE];      /* command whose round trip is not over yet */
+double sent = 0, start;     /* when the last command was sent, and the trace started */
+int ncmds = 0, stampcmds = 0; /* commands sent, by the last TIMESTAMP */
+double stamped = 0;         /* time of the last TIMESTAMP */
+int failed = 0;
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* append - Add n bytes to a growing buffer */
+void append(char **buf, size_t *len, const char *s, size_t n)
+{
+    if ((*buf = realloc(*buf, *len + n + 1)) == NULL) {
+	perror("realloc");
+	exit(1);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+    (*buf)[*len] = '\0';
+}
+
+/* note - Add a formatted line to the latency report */
+void note(double ms, const char *what, const char *text)
+{
+    char line[2 * MAXLINE + 64];
+
+    snprintf(line, sizeof(line), "%12.3f  %s%s\n", ms, what, text);
+    append(&report, &reportlen, line, strlen(line));
+}
+
+/*
+ * idle - Is the shell blocked reading its stdin with nothing to read
+ * (or gone)? A shell that is running shows "running" in its syscall file.
+ */
+int idle(void)
+{
+    char buf[128];
+    long nr, fd;
+    int n;
+    ssize_t len;
+
+    if (exited)
+	return 1;
+    if (writer >= 0 && (ioctl(writer, FIONREAD, &n) < 0 || n > 0))
+	return 0;
+    if ((len = pread(sysfd, buf, sizeof(buf) - 1, 0)) <= 0)
+	return 1;
+    buf[len] = '\0';
+    return sscanf(buf, "%ld %lx", &nr, &fd) == 2 && nr == SYS_read && fd == 0;
+}
+
+/*
+ * pump - Collect the shell's output until the time until, or until
+ * the round trip of the pending command is over (forcmd), the output
+ * since mark contains want, or the shell has exited (forexit),
+ * whichever of those was asked for. Return 1 if it was, else 0 (also
+ * when the shell has exited and its output is all read).
+ */
+int pump(double until, int forcmd, const char *want, int forexit)
+{
+    struct pollfd pfd[2];
+    struct timespec ts;
+    double t, step = 20e-6; // Polling interval for the round trip, doubling up to 1 ms
+    char buf[8192];
+    ssize_t n;
+
+    while (1) {
+	if (pending[0] && idle()) {
+	    note((now() - sent) * 1e3, "", pending);
+	    pending[0] = '\0';
+	}
+	if ((forcmd && !pending[0]) || (want && strstr(body ? body + mark : "", want)) ||
+	    (forexit && exited))
+	    return 1;
+	if ((t = now()) >= until || (exited && reader < 0))
+	    return 0;
+
+	t = until - t;
+	if (pending[0] && step < t)
+	    t = step;
+	step = step < 1e-3 ? step * 2 : step;
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+	pfd[0].fd = reader;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = exited ? -1 : pidfd;
+	pfd[1].events = POLLIN;
+	if (ppoll(pfd, 2, &ts, NULL) < 0 && errno != EINTR) {
+	    perror("ppoll");
+	    exit(1);
+	}
+	if (pfd[0].revents) {
+	    if ((n = read(reader, buf, sizeof(buf))) > 0)
+		append(&body, &bodylen, buf, n);
+	    else {
+		close(reader); // Only a negative fd is skipped by ppoll
+		reader = -1;
+	    }
+	}
+	if (pfd[1].revents && waitpid(pid, NULL, WNOHANG) == pid)
+	    exited = 1;
+    }
+}
+
+/* sendline - Send a command to the shell once the last one is done */
+void sendline(const char *line)
+{
+    char buf[MAXLINE + 1];
+
+    if (writer < 0) {
+	fprintf(stderr, "tdriver: %s: sent after CLOSE\n", line);
+	return;
+    }
+    pump(now() + IDLEWAIT, 1, NULL, 0);
+    if (pending[0]) {
+	note((now() - sent) * 1e3, "unfinished: ", pending);
+	pending[0] = '\0';
+    }
+    snprintf(buf, sizeof(buf), "%s\n", line);
+    sent = now(); // Before the write, which may run the shell at once
+    ncmds++;
+    if (write(writer, buf, strlen(buf)) < 0)
+	perror("write");
+    strncpy(pending, line, sizeof(pending) - 1);
+}
+
+/* startshell - Run the shell with its stdin and stdout on pipes */
+void startshell(void)
+{
+    int in[2], out[2];
+    char path[64];
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((pid = fork()) == 0) {
+	dup2(in[0], STDIN_FILENO);
+	dup2(out[1], STDOUT_FILENO);
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	execv(shellargv[0], shellargv);
+	perror(shellargv[0]);
+	_exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    writer = in[1];
+    reader = out[0];
+    fcntl(writer, F_SETFD, FD_CLOEXEC);
+    fcntl(reader, F_SETFD, FD_CLOEXEC);
+    sprintf(path, "/proc/%d/syscall", (int)pid);
+    if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0 || (sysfd = open(path, O_RDONLY)) < 0) {
+	perror(path);
+	exit(1);
+    }
+}
+
+/*
+ * runtrace - Drive the shell through the trace in fp, and write what
+ * sdriver.pl would print (then the report, with -l) to out. Return 0,
+ * or 1 if an EXPECT failed.
+ */
+int runtrace(FILE *fp, const char *name, FILE *out)
+{
+    char line[MAXLINE], msg[MAXLINE + 64], *arg;
+    size_t len;
+
+    startshell();
+    start = now();
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	len = strlen(line);
+	if (len > 0 && line[len - 1] == '\n')
+	    line[--len] = '\0';
+	arg = line + strcspn(line, " ");
+	arg += strspn(arg, " ");
+	if (verbose)
+	    fprintf(stderr, "tdriver: %s: %s\n", name, line);
+
+	if (line[0] == '#') {
+	    append(&head, &headlen, line, len);
+	    append(&head, &headlen, "\n", 1);
+	}
+	else if (line[strspn(line, " \t")] == '\0')
+	    continue;
+	else if (strcmp(line, "TSTP") == 0)
+	    kill(pid, SIGTSTP);
+	else if (strcmp(line, "INT") == 0)
+	    kill(pid, SIGINT);
+	else if (strcmp(line, "QUIT") == 0)
+	    kill(pid, SIGQUIT);
+	else if (strcmp(line, "KILL") == 0)
+	    kill(pid, SIGKILL);
+	else if (strcmp(line, "CLOSE") == 0) {
+	    close(writer);
+	    writer = -1;
+	}
+	else if (strcmp(line, "WAIT") == 0)
+	    pump(now() + 1e9, 0, NULL, 1);
+	else if (strncmp(line, "SLEEP ", 6) == 0)
+	    pump(now() + atoi(arg), 0, NULL, 0);
+	else if (strncmp(line, "MSLEEP ", 7) == 0)
+	    pump(now() + atoi(arg) / 1e3, 0, NULL, 0);
+	else if (strncmp(line, "EXPECT ", 7) == 0) {
+	    if (pump(now() + EXPECTWAIT, 0, arg, 0)) {
+		note((now() - sent) * 1e3, "EXPECT ", arg);
+		mark = strstr(body + mark, arg) - body + strlen(arg);
+	    }
+	    else {
+		snprintf(msg, sizeof(msg), "tdriver: EXPECT %s: not seen\n", arg);
+		append(&body, &bodylen, msg, strlen(msg));
+		failed = 1;
+	    }
+	}
+	else if (strcmp(line, "TIMESTAMP") == 0 || strncmp(line, "TIMESTAMP ", 10) == 0) {
+	    double t;
+
+	    pump(now() + IDLEWAIT, 1, NULL, 0);
+	    t = now();
+	    snprintf(msg, sizeof(msg), ncmds > stampcmds ? "%s (%d commands, %.0f/s)" : "%s", arg,
+		     ncmds - stampcmds, (ncmds - stampcmds) / (t - (stamped ? stamped : start)));
+	    note((t - start) * 1e3, "TIMESTAMP ", msg);
+	    stamped = t;
+	    stampcmds = ncmds;
+	}
+	else
+	    sendline(line);
+    }
+
+    /* Let the last command finish, then read all there is */
+    pump(now() + IDLEWAIT, 1, NULL, 0);
+    if (writer >= 0)
+	close(writer);
+    writer = -1;
+    pump(now() + 1e9, 0, NULL, 0);
+
+    if (head)
+	fputs(head, out);
+    if (body)
+	fputs(body, out);
+    if (latency && report)
+	fprintf(out, "tdriver: %s: milliseconds\n%s", name, report);
+    return failed;
+}
+
+/* linkexecs - Link the executables of directory from into the current one */
+void linkexecs(const char *from)
+{
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+
+    if ((dir = opendir(from)) == NULL)
+	return;
+    while ((de = readdir(dir)) != NULL) {
+	snprintf(path, sizeof(path), "%s/%s", from, de->d_name);
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IXUSR))
+	    symlink(path, de->d_name);
+    }
+    closedir(dir);
+}
+
+int removefile(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    return remove(path);
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hlv] [-j jobs] -s shell [-a args] trace...\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -h          Print this message\n");
+    fprintf(stderr, "  -l          Report each command's latency\n");
+    fprintf(stderr, "  -v          Be more verbose\n");
+    fprintf(stderr, "  -j <jobs>   Traces run at once (default all)\n");
+    fprintf(stderr, "  -s <shell>  Shell program to test\n");
+    fprintf(stderr, "  -a <args>   Shell arguments\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char cwd[PATH_MAX], root[] = "/tmp/tdriverXXXXXX", path[PATH_MAX + 32];
+    char shell[PATH_MAX], *shellargs = "", *arg, buf[8192];
+    pid_t workers[MAXTRACES];
+    int jobs = MAXTRACES, running = 0, status = 0, ntraces, i, c, fd, nargs = 1;
+    FILE *fp;
+    ssize_t n;
+
+    shell[0] = '\0';
+    while ((c = getopt(argc, argv, "hlvj:s:a:")) != EOF) {
+	switch (c) {
+	case 'l':
+	    latency = 1;
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'j':
+	    jobs = atoi(optarg);
+	    break;
+	case 's':
+	    if (realpath(optarg, shell) == NULL) {
+		perror(optarg);
+		exit(1);
+	    }
+	    break;
+	case 'a':
+	    shellargs = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    ntraces = argc - optind;
+    if (shell[0] == '\0' || ntraces < 1 || ntraces > MAXTRACES || jobs < 1)
+	usage(argv[0]);
+    shellargv[0] = shell;
+    for (arg = strtok(shellargs, " "); arg && nargs < MAXSHELLARGS; arg = strtok(NULL, " "))
+	shellargv[nargs++] = arg;
+    shellargv[nargs] = NULL;
+    if (getcwd(cwd, sizeof(cwd)) == NULL || mkdtemp(root) == NULL) {
+	perror("tdriver");
+	exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Trace i runs in root/i and leaves its output in root/i.out */
+    for (i = 0; i < ntraces; i++) {
+	if (running == jobs) {
+	    int wstatus;
+
+	    if (wait(&wstatus) > 0 && (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0))
+		status = 1;
+	    running--;
+	}
+	if ((fp = fopen(argv[optind + i], "r")) == NULL) {
+	    perror(argv[optind + i]);
+	    exit(1);
+	}
+	sprintf(path, "%s/%d", root, i);
+	if ((workers[i] = fork()) == 0) {
+	    FILE *out;
+
+	    if (mkdir(path, 0700) < 0 || chdir(path) < 0) {
+		perror(path);
+		exit(1);
+	    }
+	    linkexecs(cwd);
+	    strcat(path, ".out");
+	    if ((out = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	    }
+	    status = runtrace(fp, argv[optind + i], out);
+	    fclose(out);
+	    exit(status);
+	}
+	fclose(fp);
+	running++;
+    }
+
+    for (i = 0; i < ntraces; i++) {
+	int wstatus;
+
+	if (waitpid(workers[i], &wstatus, 0) == workers[i] && (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0))
+	    status = 1;
+	sprintf(path, "%s/%d.out", root, i);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+	    fflush(stdout);
+	    while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (write(STDOUT_FILENO, buf, n) < 0)
+		    break;
+	    close(fd);
+	}
+    }
+    nftw(root, removefile, 16, FTW_DEPTH | FTW_PHYS);
+    exit(status);
+}
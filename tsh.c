@@ -3,6 +3,7 @@
  *
  * Spencer Iannantuono
  */
+#define _GNU_SOURCE /* sched_setaffinity, prlimit */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,12 +15,62 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 
 /* Misc manifest constants */
 #define MAXLINE 1024   /* max line size */
 #define MAXARGS 128    /* max args on a command line */
 #define MAXJOBS 16     /* max jobs at any point in time */
-#define MAXJID 1 << 16 /* max job ID */
+#define MAXJID (1 << 18) /* job IDs are below this */
+#define MAXRLIMITS 8   /* max ulimit settings per command */
+#define MAXPROCS 32    /* max processes in one job (pipeline stages) */
+#define MAXNODES 256   /* max nodes in a dag graph */
+#define MAXDEPS 32     /* max dependencies of one dag node */
+#define MAXHEREDOCS 16 /* max here-documents on a command line */
+#define MAXSUBST 8     /* max process substitutions in a pipeline stage */
+#define RELAYCHUNK (1 << 20) /* pipe size and most bytes moved per round by a fan-out relay */
+#define MAXDIRLISTS 64 /* max directory listings cached for pathname expansion */
+#define GLOBBUFSIZE (256 * 1024) /* getdents64 buffer for reading directories */
+#define VARBUCKETS 256 /* hash chains of the shell variable table */
+#define ENVSPARE 64    /* free envp slots for variables one command adds */
+#define MAXPATHDIRS 64 /* max PATH directories watched by command completion */
+#define MAXLISTED 100  /* max completions listed at once */
+#define MAXSERVED 64   /* max jobs whose output the job server keeps */
+#define OUTBACKLOG (64 * 1024) /* output of a served job kept for clients that ask later */
+#define MAXCLIENTOUT (64 << 20) /* replies a job server client may leave unread */
+#define SERVEEVENTS 64 /* epoll events taken per wakeup of the job server */
+#define NDONE (2 * MAXJOBS) /* ended jobs queued by the SIGCHLD handler for the job server */
+#define MAXDONE 64     /* completed jobs remembered for jobs -a and wait */
+#define MAXJOBLOGS (2 * MAXJOBS) /* max background job output logs kept */
+#define ZYGOTEMSG (128 * 1024) /* largest command the spawn helper is sent */
+#define RECMAGIC "tshrec1\n" /* first bytes of a session log (tsh -R) */
+#define MEMOMAGIC "tshmemo1" /* first bytes of a result cache entry */
+#define MEMOKEY (64 * 1024) /* largest key of a memo command */
+
+/* Job server epoll events (the high half of their data) */
+#define SV_LISTEN 0 /* the listening socket */
+#define SV_CLIENT 1 /* a client connection, by index */
+#define SV_OUTPUT 2 /* a job's output pipe, by index */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -27,6 +78,29 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Builtin kinds (see isbuiltin) */
+#define BI_SHELL 1 /* runs inside the shell (see builtin_cmd) */
+#define BI_JOB 2   /* runs as a job of its own (see jobbuiltin) */
+
+/* Command group kinds (see parsegroup) */
+#define GROUP_NONE 0     /* a simple command */
+#define GROUP_SUBSHELL 1 /* ( list ): run in a forked subshell */
+#define GROUP_BRACE 2    /* { list; }: run in the shell itself */
+
+/* List connectors (see parselist) */
+#define OP_END 0 /* end of the line */
+#define OP_SEQ 1 /* ; */
+#define OP_BG 2  /* & */
+#define OP_AND 3 /* && */
+#define OP_OR 4  /* || */
+
+/* DAG node states */
+#define DAG_WAIT 0 /* waiting for its dependencies */
+#define DAG_RUN 1  /* running */
+#define DAG_OK 2   /* exited with status 0 */
+#define DAG_FAIL 3 /* exited with a nonzero status */
+#define DAG_SKIP 4 /* will not run: a dependency failed */
+
 /*
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -41,17 +115,277 @@
 extern char **environ;   /* defined in libc */
 char prompt[] = "tsh> "; /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;         /* if true, print additional output */
-int nextjid = 1;         /* next job ID to allocate */
+/*
+ * Job IDs in use, as a bitmap with two levels of summary above it so
+ * the largest used ID and the smallest free one are three word
+ * lookups away. ID 0 is never handed out and stays marked used.
+ */
+#define JIDWORDS (MAXJID / 64)
+uint64_t jidused[JIDWORDS];       /* bit j % 64 of word j / 64: ID j in use */
+uint64_t jidany[JIDWORDS / 64];   /* bit w % 64 of word w / 64: jidused[w] != 0 */
+uint64_t jidanysum;               /* bit v: jidany[v] != 0 */
+uint64_t jidroom[JIDWORDS / 64];  /* bit w % 64 of word w / 64: jidused[w] not full */
+uint64_t jidroomsum;              /* bit v: jidroom[v] != 0 */
 char sbuf[MAXLINE];      /* for composing sprintf messages */
+int emit_prompt = 1;     /* emit prompt (default) */
+FILE *input;             /* where command lines are read: stdin or a script */
+int herefds[MAXHEREDOCS]; /* here-document bodies of the current line */
+int nherefds = 0;
+double jobtimeout = 0;   /* default deadline for every job, 0 if none */
+double jobgrace = 5;     /* seconds between timeout signal and SIGKILL */
+int last_status = 0;     /* exit status of the last command */
+int job_control = 1;     /* false in subshells: children share our process group */
+volatile int fg_status;  /* status of the foreground job when it ended or stopped */
+volatile sig_atomic_t fg_sigint = 0; /* the foreground job was killed by SIGINT */
+
+/* Shared between the wait builtin and the signal handlers */
+volatile sig_atomic_t sigint_seen = 0; /* ctrl-c typed with no foreground job */
+volatile pid_t wait_target = 0;        /* capture this pid's status, -1 for any job */
+volatile int wait_status = 0;          /* status captured for wait_target */
 
 struct job_t
 {                          /* The job struct */
-    pid_t pid;             /* job PID */
+    pid_t pid;             /* job PID (first process, leads the process group) */
     int jid;               /* job ID [1, 2, ...] */
     int state;             /* UNDEF, BG, FG, or ST */
     char cmdline[MAXLINE]; /* command line */
+    pid_t procs[MAXPROCS]; /* pipeline processes, 0 once reaped */
+    int nprocs;            /* number of processes started */
+    int nlive;             /* number of processes not yet reaped */
+    int status;            /* exit status of the last process */
+    int signaled;          /* termination by a signal already reported */
+    double deadline;       /* monotonic time of next timeout action, 0 if none */
+    double grace;          /* seconds from timeout signal to SIGKILL, 0 for none */
+    int timeout_sig;       /* signal sent when the timeout expires */
+    int timedout;          /* timeout signal already sent */
+    int pidfd;             /* pidfd of the leader, -1 if none */
+    double started;        /* monotonic time the job was added */
+    int how;               /* wait status of the last process once reaped */
+    struct rusage ru;      /* resources used by its reaped processes */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct donejob_t
+{                          /* A completed job, as jobs -a shows it */
+    pid_t pid;
+    int jid;
+    char cmdline[MAXLINE];
+    int status;            /* exit status, as wait returns it */
+    int how;               /* wait status of the last process */
+    double started;        /* monotonic times it was added and reaped */
+    double ended;
+    time_t endtime;        /* wall clock time it was reaped */
+    struct rusage ru;      /* resources used by all its processes */
+};
+struct donejob_t donejobs[MAXDONE]; /* ring of the last MAXDONE completed jobs */
+unsigned long ndonejobs = 0;        /* jobs completed so far, the next goes in donejobs[ndonejobs % MAXDONE] */
+
+struct cmdmods_t
+{                        /* Precommand modifiers (nice, ionice, ...) */
+    int count;           /* number of modifiers seen */
+    int nwords;          /* words they took, moved after argv's NULL (see freemods) */
+    int nice_set;        /* nice: adjust the scheduling priority */
+    int nice;            /* niceness increment */
+    int ioprio_set;      /* ionice: set the I/O scheduling class */
+    int ioprio;          /* IOPRIO_PRIO_VALUE(class, level) */
+    int affinity_set;    /* taskset: restrict the CPU affinity */
+    cpu_set_t cpus;      /* allowed CPUs */
+    int nrlimits;        /* ulimit: number of resource limits */
+    int rlimit_res[MAXRLIMITS];
+    struct rlimit rlimits[MAXRLIMITS];
+    int env_clear;       /* env -i: start from an empty environment */
+    char *env[MAXARGS];  /* env: NAME=VALUE to set, or NAME to unset */
+    int nenv;
+    double timeout;      /* timeout: seconds until the signal, 0 if none */
+    double grace;        /* timeout -k: seconds until SIGKILL, -1 for default */
+    int timeout_sig;     /* timeout -s: signal to send, 0 for SIGTERM */
+    int memo;            /* memo: answer from the result cache */
+};
+
+struct subst_t
+{                       /* A process substitution, <(list) or >(list) */
+    char list[MAXLINE]; /* command list it runs */
+    int output;         /* >(list): the list reads what the command writes */
+    int fd;             /* the command's end of the pipe, named /dev/fd/N */
+    int childfd;        /* the list's end of the pipe */
+};
+
+struct dirlist_t
+{                          /* A directory listing cached for pathname expansion */
+    char *path;            /* directory, "" for the current one */
+    struct timespec mtime; /* its mtime when read; a change invalidates it */
+    char *names;           /* entry names, each NUL-terminated */
+    size_t used, size;     /* bytes of names used and allocated */
+    int *offs;             /* offset of each entry's name in names */
+    unsigned char *types;  /* d_type of each entry, DT_UNKNOWN if not known */
+    int count, cap;        /* entries read and allocated */
+    int busy;              /* expansions walking it: not to be reread or evicted */
+};
+struct dirlist_t dirlists[MAXDIRLISTS]; /* listings read for the current command line */
+int ndirlists = 0;
+int dirlistnext = 0; /* where readdirlist looks for one to evict when full */
+char globword[MAXARGS]; /* is argv[i] from the last parseline a pattern? */
+
+struct var_t
+{                       /* A shell variable */
+    char *entry;        /* NAME=VALUE as it goes in the environment, or NAME if unset */
+    int exported;       /* passed on to commands */
+    int envidx;         /* its slot in envbuf, when exported */
+    struct var_t *next; /* next in its hash chain */
+};
+struct var_t *vartab[VARBUCKETS]; /* shell variables, by hash of name */
+char **envbuf = NULL;   /* ENVSPARE free slots, then the exported variables */
+int envcap = 0;         /* room in envbuf */
+int envlen = 0;         /* exported variables in envbuf */
+int envdirty = 1;       /* an export changed since envbuf was built */
+
+int histlogfd = -1;        /* history log, -1 if there is no history */
+int histidxfd = -1;        /* offsets of its lines */
+const char *histlog;       /* the log, mapped */
+size_t histloglen;
+const uint64_t *histidx;   /* the index, mapped */
+long histcount;            /* entries in the index */
+int histheld = 0;          /* nested holds of the index's lock (see histhold) */
+
+struct trie_t
+{                /* A node of the trie of command names for completion */
+    char c;      /* the character it adds to its parent's prefix */
+    char end;    /* a name ends here */
+    int child;   /* first child, in character order, 0 if none */
+    int sibling; /* next child of the same parent, 0 if none */
+    int count;   /* names ending here or below */
+};
+struct trie_t *trie = NULL; /* node 0 is the root */
+int ntrie = 0, triecap = 0;
+char triepath[MAXLINE];     /* PATH it was built from */
+struct timespec triemtimes[MAXPATHDIRS]; /* mtimes of the PATH directories then */
+int lineedit = 0;           /* read command lines with the line editor */
+int interactive = 0;        /* command lines come from a terminal: ! is expanded */
+struct builtin_t
+{                     /* A builtin command */
+    const char *name;
+    int kind;         /* BI_SHELL or BI_JOB */
+};
+const struct builtin_t builtins[] = {
+    {"quit", BI_SHELL},  {"jobs", BI_SHELL},    {"bg", BI_SHELL},     {"fg", BI_SHELL},
+    {"wait", BI_SHELL},  {"set", BI_SHELL},     {"echo", BI_SHELL},   {"export", BI_SHELL},
+    {"unset", BI_SHELL}, {"history", BI_SHELL}, {"joblog", BI_SHELL}, {"dag", BI_JOB},
+    {NULL, 0}};
+
+struct arglist_t
+{               /* An argument list that grows as needed */
+    char **argv; /* NULL-terminated, each argument malloc'd */
+    int argc;
+    int cap;     /* room in argv, counting the NULL */
+};
+
+struct dagnode_t
+{                           /* A node of the graph run by the dag builtin */
+    char name[64];          /* node name */
+    char cmdline[MAXLINE];  /* command line to run */
+    int deps[MAXDEPS];      /* indices of the nodes it depends on */
+    char *depnames[MAXDEPS]; /* their names, while parsing */
+    int ndeps;
+    int state;              /* DAG_WAIT, DAG_RUN, DAG_OK, DAG_FAIL, DAG_SKIP */
+    int reported;           /* completion already noticed by do_dag */
+    pid_t pid;              /* process running the command line */
+    int status;             /* its exit status */
+    double start, end;      /* monotonic start and end times */
+};
+struct dagnode_t *dagnodes;     /* graph being run, in a dag job */
+int ndagnodes = 0;              /* number of nodes in the graph */
+volatile int dag_running = 0;   /* nodes started but not yet reaped */
+
+int serving = 0;       /* running as a job server (--serve) */
+int jobmsgs = 1;       /* print job messages: not in the job server, nor while output goes to a log */
+pid_t lastbg = 0;      /* pid of the last background job started ($!) */
+int lastbgjid = 0;     /* and its job ID */
+struct served_t
+{                      /* A job started by the job server */
+    pid_t pid;         /* its pid, 0 if the entry is free */
+    int jid;           /* its job ID */
+    long seq;          /* order started: the newest of a job ID is the one meant */
+    int done;          /* it has ended */
+    int status;        /* and its exit status then */
+    int outfd;         /* read end of its output pipe, -1 once at end of file */
+    char *backlog;     /* the last OUTBACKLOG bytes of its output, a ring */
+    size_t outlen;     /* bytes of output so far */
+    int watchers;      /* first client streaming its output, -1 if none */
+};
+struct served_t served[MAXSERVED];
+long servedseq = 0;
+struct client_t
+{                      /* A connection to the job server */
+    int fd;            /* -1 if the slot is free */
+    char *in, *out;    /* requests received and replies not yet sent */
+    size_t inlen, incap, outlen, outcap;
+    int stalled;       /* its next request is a run waiting for a job slot */
+    int watching;      /* served job whose output it streams, -1 if none */
+    int nextwatch;     /* next client streaming the same job */
+    unsigned events;   /* what epoll watches it for */
+};
+struct client_t *clients = NULL;
+int nclients = 0;
+int epfd = -1;         /* the job server's epoll instance */
+int nullfd = -1;       /* /dev/null, stdin of served jobs */
+int servefds[3];       /* the server's own stdin, stdout and stderr */
+volatile sig_atomic_t serve_quit = 0;
+volatile pid_t donepids[NDONE]; /* queued by serve_reaped for serve_drain */
+volatile int donestatus[NDONE];
+volatile int donehead = 0;
+int donetail = 0;
+
+int joblog = 0;                 /* capture background job output (set joblog on) */
+long joblogsize = 64 * 1024;    /* bytes of a job's output kept in memory */
+long joblogmem = 1024 * 1024;   /* most memory for the logs of all jobs */
+long joblogused = 0;            /* memory they have now */
+struct joblog_t
+{                      /* Output captured from a background job */
+    pid_t pid;         /* the job's pid, 0 if the entry is free */
+    int jid;           /* its job ID */
+    long seq;          /* order started: the newest of a job ID is the one meant */
+    int fd;            /* read end of its output pipe, -1 once at end of file */
+    char *ring;        /* its newest output, NULL if memory was short */
+    size_t size;       /* size of ring */
+    size_t start, len; /* where the oldest byte in ring is, and how many there are */
+    int spillfd;       /* older output, -1 until there is some */
+    size_t spilled;    /* bytes in the spill file */
+};
+struct joblog_t joblogs[MAXJOBLOGS];
+long joblogseq = 0;
+
+int zygote = 1;        /* start simple commands through the spawn helper (set zygote) */
+int zygotefd = -1;     /* the shell's end of its socket, -1 if there is no helper */
+struct spawnmsg_t
+{                      /* A request to the spawn helper, its strings following */
+    pid_t pgid;        /* process group to join, 0 for a new one */
+    int append_out;    /* >> rather than > */
+    int redirs;        /* bits 0-2: an infile, outfile, errfile string comes first */
+    int nargs, nenv;   /* then this many arguments and environment entries */
+    struct cmdmods_t mods; /* its precommand modifiers, but not env */
+};
+
+int recfd = -1;        /* session log being written (tsh -R), -1 if none */
+long reclast;          /* monotonic microseconds of its last event */
+
+char *memodir = NULL;  /* result cache of memo (set memodir), NULL for the default */
+long memosize = 256L << 20; /* bytes it keeps, least recently used evicted (set memosize) */
+char memoenv[MAXLINE] = "PATH HOME LANG LC_ALL"; /* variables in a memo key (set memoenv) */
+char memokey[MEMOKEY]; /* key of the memo command at hand */
+struct memohdr_t
+{                      /* A result cache entry, its key and output following */
+    char magic[8];     /* MEMOMAGIC */
+    int status;        /* exit status of the command */
+    uint32_t keylen;   /* bytes of key, then */
+    uint64_t outlen;   /* bytes of stdout, then */
+    uint64_t errlen;   /* bytes of stderr */
+};
+struct memoent_t
+{                      /* A result cache entry, as memo_evict sees it */
+    struct timespec used; /* its mtime: when it was made or last hit */
+    off_t size;
+    char name[17];
+};
 /* End global variables */
 
 /* Function prototypes */
@@ -67,19 +401,158 @@ void sigint_handler(int sig);
 void sigtstp_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
+int parselist(const char *cmdline, char **elems, int *ops);
+int parsepipe(const char *cmdline, char **commands);
+void listcmdline(char *buf, char **elems, int *ops, int start, int end);
+void runsequence(char **elems, int *ops, int start, int end, char *jobcmd);
+void runlistjob(char **elems, int *ops, int start, int end, char *jobcmd);
+void runpipeline(char *text, int bg, char *jobcmd);
+int redirfd(const char *name, int fd);
+int redirect(char *infile, char *outfile, char *errfile, int append_out);
+int saveredirs(int saved[3], char *infile, char *outfile, char *errfile, int append_out);
+void restorefds(int saved[3]);
+int nestdelta(const char *line, const char *p);
+int herefd(const char *body, size_t len);
+int readheredocs(char *cmdline);
+void closeheredocs(void);
+int parsegroup(const char *text, char *inner, char *rest);
+int procsubst(const char *text, char *out, struct subst_t *subs, int mkpipes);
+void relay(int in, int *outs, int nout);
+int hasglob(const char *s, size_t len);
+void unescape(char *dst, const char *s, size_t len);
+struct dirlist_t *readdirlist(const char *path);
+void cleardirlists(void);
+void addarg(struct arglist_t *args, const char *s);
+int cmpstr(const void *a, const void *b);
+void globdir(char *path, size_t plen, const char *pattern, struct arglist_t *args);
+char **globargv(char **argv);
+void freeargv(char **argv);
+size_t namelen(const char *s);
+struct var_t **varbucket(const char *name, size_t len);
+struct var_t *findvar(const char *name, size_t len);
+char *getvar(const char *name, size_t len);
+void setvar(const char *entry, int export);
+void unsetvar(const char *name);
+char **buildenv(void);
+char **childenv(char **assigns, int nassign, struct cmdmods_t *mods);
+int assignments(char **argv);
+void do_export(char **argv);
+void do_unset(char **argv);
+int expandvar(const char **bufp, char *dst, char *end);
+int expandref(const char **bufp, char *dst, char *end);
+int expandtext(const char *s, char *dst, char *end);
+void histopen(void);
+long histmap(void);
+void histhold(void);
+void histrelease(void);
+const char *histentry(long n, size_t *len);
+long histfind(const char *text, long before, int prefix);
+void histadd(const char *cmdline);
+int histexpand(char *cmdline);
+void do_history(char **argv);
+char *readcmdline(char *buf, const char *prompt);
+void rawmode(int on);
+void cookedmode(void);
+void refresh(const char *prompt, const char *buf, size_t len, size_t pos);
+void trieadd(const char *name);
+void triefresh(void);
+void triecollect(int n, char *prefix, size_t len, struct arglist_t *args, int max);
+int complete(char *buf, size_t *len, size_t *pos);
+int editline(const char *prompt, char *buf);
+void joinjob(pid_t pid, pid_t *pgid, struct job_t **job, int bg, char *jobcmd);
+void subshell(void);
+void freemods(char **argv, struct cmdmods_t *mods);
+void initmods(struct cmdmods_t *mods);
 int parseline(const char *cmdline, char **argv, char **infile, char **outfile, char **errfile, int *append_out);
+int parsemods(char **argv, struct cmdmods_t *mods);
+void applymods(struct cmdmods_t *mods);
+int parse_duration(const char *s, double *secs);
+int parse_long(const char *s, long *val);
+int parse_size(const char *s, long *bytes);
+int parse_cpulist(const char *s, int is_list, cpu_set_t *cpus);
+int parse_signal(const char *s);
+void settimeout(struct job_t *job, struct cmdmods_t *mods);
+void do_set(char **argv);
+void do_echo(char **argv);
+int isbuiltin(const char *name);
+int do_wait(char **argv);
+int exitcode(int status);
+int jobbuiltin(char **argv);
+int do_dag(char **argv);
+void dag_reaped(pid_t pid, int status);
+int dag_find(const char *name);
+int dag_parse(FILE *fp, const char *src);
+void dag_freenames(int n);
+int dag_cyclic(int i, char *color);
+void dag_launch(int i, sigset_t *prev);
+void dag_report(double t0, double t1);
+int joblog_begin(int saved[2]);
+void joblog_attach(int fd, int saved[2], pid_t prevbg, char *jobcmd);
+void joblog_append(struct joblog_t *l, const char *buf, size_t n);
+void joblog_drain(struct joblog_t *l);
+void joblog_spill(struct joblog_t *l);
+size_t joblog_read(struct joblog_t *l, size_t pos, char *buf, size_t max);
+void do_joblog(char **argv);
+void sigio_handler(int sig);
+void serve(const char *path);
+void serve_stop(int sig);
+void serve_reaped(struct job_t *job);
+int serve_drain(void);
+void serve_resume(void);
+void serve_accept(int fd);
+void serve_close(int c);
+void zygote_start(void);
+void zygote_main(int sock);
+void zygote_exec(char *msg, size_t n, int fds[3]);
+pid_t zygote_spawn(char **argv, int fds[3], pid_t pgid, struct cmdmods_t *mods,
+                   char *infile, char *outfile, char *errfile, int append_out);
+void record_start(const char *path);
+void record(int kind, const char *text, size_t len);
+const char *memo_path(void);
+const char *memo_dir(void);
+size_t memo_key(char **args, int nassign, struct cmdmods_t *mods, char *infile, char *path);
+char *memo_keyadd(char *p, const void *data, size_t n, struct stat *st);
+int memo_hit(char **args, int nassign, struct cmdmods_t *mods, char *infile, char *outfile, char *errfile,
+             int append_out);
+void memo_fork(char **args, int nassign, struct cmdmods_t *mods, char *infile);
+int memo_copy(int to, int from, off_t off, size_t len);
+void memo_evict(const char *dir);
+int cmpmemoent(const void *a, const void *b);
+void serve_read(int c);
+void serve_input(int c);
+int serve_request(int c, char *req);
+int serve_run(int c, char *cmdline);
+void serve_output(int s);
+void serve_watch(int c, int s);
+void serve_end(int s);
+void serve_printf(int c, const char *fmt, ...);
+void serve_frame(int c, const char *head, size_t hlen, const char *data, size_t len);
+void serve_flush(int c);
 void sigquit_handler(int sig);
+void sigalrm_handler(int sig);
+void timer_rearm(void);
+double monotime(void);
 
 void clearjob(struct job_t *job);
 void initjobs(struct job_t *jobs);
-int maxjid(struct job_t *jobs);
+void jid_reset(void);
+int jid_max(void);
+int jid_alloc(void);
+void jid_free(int jid);
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
+int addproc(struct job_t *job, pid_t pid);
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *idx);
+int signaljob(struct job_t *job, int sig);
 int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid);
 int pid2jid(pid_t pid);
 void listjobs(struct job_t *jobs);
+void addrusage(struct rusage *sum, const struct rusage *ru);
+void donejob(struct job_t *job);
+struct donejob_t *getdone(int jid, pid_t pid);
+void listdone(void);
 
 void usage(void);
 void unix_error(char *msg);
@@ -94,14 +567,23 @@ int main(int argc, char **argv)
 {
     char c;
     char cmdline[MAXLINE];
-    int emit_prompt = 1; /* emit prompt (default) */
+    char *servepath = NULL;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
+    /* tsh --serve SOCKET runs as a job server (see serve) */
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0)
+    {
+        servepath = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF)
+    while ((c = getopt(argc, argv, "hvpR:")) != EOF)
     {
         switch (c)
         {
@@ -114,11 +596,34 @@ int main(int argc, char **argv)
         case 'p':            /* don't print a prompt */
             emit_prompt = 0; /* handy for automatic testing */
             break;
+        case 'R': /* record the session for tshreplay */
+            record_start(optarg);
+            break;
         default:
             usage();
         }
     }
 
+    /* A script named on the command line is run without prompts */
+    input = stdin;
+    if (optind < argc)
+    {
+        if ((input = fopen(argv[optind], "r")) == NULL)
+        {
+            printf("%s: %s\n", argv[optind], strerror(errno));
+            exit(127);
+        }
+        emit_prompt = 0;
+    }
+    interactive = isatty(fileno(input));
+    lineedit = emit_prompt && interactive && isatty(STDOUT_FILENO);
+
+    /* Fork the spawn helper while the shell is still small */
+    zygote_start();
+
+    /* Orphans left by jobs come to the shell to be reaped, not to init */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
@@ -129,29 +634,44 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler);
 
+    /* Delivers job deadlines set by timeout and jobtimeout */
+    Signal(SIGALRM, sigalrm_handler);
+
+    /* Drains the output of background jobs into their logs (set joblog on) */
+    Signal(SIGIO, sigio_handler);
+
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* Start with the environment we were given, all of it exported */
+    for (char **ep = environ; *ep; ep++)
+        if (namelen(*ep) > 0 && (*ep)[namelen(*ep)] == '=')
+            setvar(*ep, 1);
+    if (servepath != NULL)
+        serve(servepath); // Does not return
+    histopen();
+
     /* Execute the shell's read/eval loop */
     while (1)
     {
 
         /* Read command line */
-        if (emit_prompt)
-        {
-            printf("%s", prompt);
-            fflush(stdout);
-        }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin))
+        if (readcmdline(cmdline, prompt) == NULL)
         { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
 
-        /* Evaluate the command line */
-        eval(cmdline);
+        /* Expand history references (!n, !prefix) and record the line */
+        if (interactive && histexpand(cmdline) < 0)
+            continue;
+        histadd(cmdline);
+
+        /* Evaluate the command line, after reading any here-documents */
+        if (readheredocs(cmdline) == 0)
+            eval(cmdline);
+        closeheredocs();
+        cleardirlists();
         fflush(stdout);
         fflush(stdout);
     }
@@ -159,427 +679,5961 @@ int main(int argc, char **argv)
     exit(0); /* control never reaches here */
 }
 
-// for pipes
-int parsepipe(const char *cmdline, char **commands)
+/*
+ * herefd - Put the body of a here-document or here-string where a
+ *    command can read it: a pipe when it fits in the pipe's atomic
+ *    write size, else a memfd, so it never touches the disk. Return a
+ *    close-on-exec descriptor open for reading, or -1 on error.
+ */
+int herefd(const char *body, size_t len)
 {
-    char *cmd = strdup(cmdline); // Copy cmdline to a modifiable string
-    char *next = strtok(cmd, "|");
-    int count = 0;
+    int fds[2], fd;
 
-    while (next != NULL)
+    if (len <= PIPE_BUF)
     {
-        commands[count++] = strdup(next); // Store each command
-        next = strtok(NULL, "|");
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            return -1;
+        if (len > 0 && write(fds[1], body, len) != (ssize_t)len)
+        {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
     }
 
-    commands[count] = NULL; // Null-terminate the array
-    free(cmd);
-    return count; // Return the number of commands in the pipeline
+    if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC)) < 0)
+        return -1;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, body, len);
+        if (n < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        body += n;
+        len -= n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
 }
 
 /*
- * eval - Evaluate the command line that the user has just typed in
- *
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.
+ * readheredocs - Rewrite each here-document (<<WORD or <<-WORD) and
+ *    here-string (<<< WORD) in a command line just read into an input
+ *    redirection from a descriptor (<&N) holding its body. The body of
+ *    a here-document is read from the input lines that follow, up to a
+ *    line holding just WORD; <<- strips leading tabs from each of them.
+ *    Variables are expanded in a here-string (outside single quotes) and
+ *    in a body whose WORD is unquoted; a quoted WORD keeps it literal.
+ *    Return 0, or -1 after printing an error.
  */
-void eval(char *cmdline)
+int readheredocs(char *cmdline)
 {
-    char *commands[MAXARGS];               // Store pipeline commands
-    char buf[MAXLINE];                     // Holds modified command line
-    char *argv[MAXARGS];                   // Argument list for execve()
-    char *infile, *outfile, *errfile;      // File names for redirection
-    int append_out = 0;                    // Append mode flag
-    int num_commands;                      // Number of pipeline commands
-    int bg;                                // Should the job run in bg or fg?
-    pid_t pid;                             // Process id
-    int pipefds[2 * MAXARGS];              // Pipe file descriptors
-    sigset_t mask_all, mask_one, prev_one; // Signal masks for blocking/unblocking signals
+    char out[MAXLINE];  // Rewritten command line
+    char word[MAXLINE]; // Delimiter or here-string
+    char line[MAXLINE]; // One line of a here-document body
+    char text[MAXLINE]; // The line with its variables expanded
+    char *p, *w, quote = 0;
+    int len = 0;
 
-    strcpy(buf, cmdline);
-    num_commands = parsepipe(buf, commands); // Split the command into pipeline components
-
-    if (num_commands == 1) // Single command, no pipe
+    for (p = cmdline; *p; p++)
     {
-        bg = parseline(buf, argv, &infile, &outfile, &errfile, &append_out);
-        if (argv[0] == NULL)
-            return; // Ignore empty lines
-
-        if (!builtin_cmd(argv)) // Check for built-in commands first
+        if (quote || *p == '\'' || *p == '"' || strncmp(p, "<<", 2) != 0)
         {
-            sigfillset(&mask_all);
-            sigemptyset(&mask_one);
-            sigaddset(&mask_one, SIGCHLD);
-            sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
-
-            if ((pid = fork()) == 0) // Child process
-            {
-                sigprocmask(SIG_SETMASK, &prev_one, NULL);
-                setpgid(0, 0);
-
-                // Handle input redirection
-                if (infile)
-                {
-                    int fd = open(infile, O_RDONLY);
-                    if (fd < 0)
-                    {
-                        perror("open error for input redirection");
-                        exit(1);
-                    }
-                    dup2(fd, STDIN_FILENO);
-                    close(fd);
-                }
-
-                // Handle output redirection
-                if (outfile)
-                {
-                    int fd = open(outfile, O_WRONLY | O_CREAT | (append_out ? O_APPEND : O_TRUNC), 0644);
-                    if (fd < 0)
-                    {
-                        perror("open error for output redirection");
-                        exit(1);
-                    }
-                    dup2(fd, STDOUT_FILENO);
-                    close(fd);
-                }
+            if (quote && *p == quote)
+                quote = 0;
+            else if (!quote && (*p == '\'' || *p == '"'))
+                quote = *p;
+            if (len < MAXLINE - 1)
+                out[len++] = *p;
+            continue;
+        }
 
-                // Handle error redirection
-                if (errfile)
-                {
-                    int fd = open(errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (fd < 0)
-                    {
-                        perror("open error for error redirection");
-                        exit(1);
-                    }
-                    dup2(fd, STDERR_FILENO);
-                    close(fd);
-                }
+        int herestring = p[2] == '<';
+        int striptabs = !herestring && p[2] == '-';
+        int quoted = 0; // Was any of the word quoted?
+        char *wend = word + sizeof(word) - 2; // Room for the here-string's newline
+        char *body = NULL;
+        size_t bodylen = 0, bodycap = 0;
+        int fd;
 
-                // Execute the command
-                if (execvp(argv[0], argv) < 0)
+        // Read the word, dropping its quotes
+        p += herestring ? 3 : striptabs ? 3 : 2;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        for (w = word; *p && !strchr(" \t\n;&|<>()", *p) && w < wend; p++)
+        {
+            if (*p == '\'' || *p == '"')
+            {
+                char q = *p++;
+                quoted = 1;
+                while (*p && *p != q && w < wend)
                 {
-                    perror("Command execution error");
-                    exit(1);
+                    if (herestring && q == '"' && *p == '$')
+                        w += expandref((const char **)&p, w, wend);
+                    else
+                        *w++ = *p++;
                 }
+                if (*p == '\0')
+                    break;
             }
-
-            addjob(jobs, pid, bg ? BG : FG, cmdline);
-            sigprocmask(SIG_SETMASK, &prev_one, NULL);
-
-            if (!bg)
+            else if (herestring && *p == '$')
             {
-                waitfg(pid); // Wait for foreground job to finish
+                w += expandref((const char **)&p, w, wend);
+                p--;
             }
             else
-            {
-                printf("[%d] (%d) %s", pid2jid(pid), pid, cmdline); // Print background job details
-            }
+                *w++ = *p;
         }
-    }
-    else // Handle pipelines
-    {
-        int i, status;
-
-        // Create pipes
-        for (i = 0; i < num_commands - 1; i++)
+        *w = '\0';
+        p--;
+        if (word[0] == '\0')
         {
-            if (pipe(pipefds + i * 2) < 0)
-            {
-                perror("pipe error");
-                exit(1);
-            }
+            printf("syntax error: missing %s\n", herestring ? "here-string" : "here-document delimiter");
+            return -1;
         }
 
-        for (i = 0; i < num_commands; i++)
+        if (herestring)
         {
-            bg = parseline(commands[i], argv, &infile, &outfile, &errfile, &append_out);
-
-            if ((pid = fork()) == 0) // Child process
+            strcat(word, "\n");
+            fd = herefd(word, strlen(word));
+        }
+        else
+        {
+            while (1)
             {
-                // Set up pipes
-                if (i > 0) // Not the first command; get input from the previous pipe
-                {
-                    dup2(pipefds[(i - 1) * 2], STDIN_FILENO);
-                }
-                if (i < num_commands - 1) // Not the last command; output to the next pipe
-                {
-                    dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
-                }
-
-                // Close all pipe file descriptors
-                for (int j = 0; j < 2 * (num_commands - 1); j++)
-                {
-                    close(pipefds[j]);
-                }
-
-                // Handle input redirection for the first command
-                if (i == 0 && infile)
-                {
-                    int fd = open(infile, O_RDONLY);
-                    if (fd < 0)
-                    {
-                        perror("open error for input redirection");
-                        exit(1);
-                    }
-                    dup2(fd, STDIN_FILENO);
-                    close(fd);
-                }
-
-                // Handle output redirection for the last command
-                if (i == num_commands - 1 && outfile)
+                if (readcmdline(line, "> ") == NULL)
                 {
-                    int fd = open(outfile, O_WRONLY | O_CREAT | (append_out ? O_APPEND : O_TRUNC), 0644);
-                    if (fd < 0)
-                    {
-                        perror("open error for output redirection");
-                        exit(1);
-                    }
-                    dup2(fd, STDOUT_FILENO);
-                    close(fd);
+                    printf("warning: here-document delimited by end-of-file (wanted `%s')\n", word);
+                    break;
                 }
+                char *start = line;
+                if (striptabs)
+                    start += strspn(line, "\t");
+                if (strncmp(start, word, strlen(word)) == 0 && strcmp(start + strlen(word), "\n") == 0)
+                    break;
 
-                // Execute the command
-                if (execvp(argv[0], argv) < 0)
+                size_t n = quoted ? strlen(start) : (size_t)expandtext(start, text, text + sizeof(text));
+                if (bodylen + n > bodycap)
                 {
-                    perror("Command execution error");
-                    exit(1);
+                    bodycap = 2 * (bodylen + n);
+                    body = realloc(body, bodycap);
                 }
+                memcpy(body + bodylen, quoted ? start : text, n);
+                bodylen += n;
             }
+            fd = herefd(body ? body : "", bodylen);
+            free(body);
         }
 
-        // Close all pipe file descriptors in the parent
-        for (i = 0; i < 2 * (num_commands - 1); i++)
+        if (fd < 0 || nherefds == MAXHEREDOCS)
         {
-            close(pipefds[i]);
+            printf(fd < 0 ? "here-document: %s\n" : "here-document: too many\n", strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
         }
-
-        // Wait for all child processes to finish
-        for (i = 0; i < num_commands; i++)
+        herefds[nherefds++] = fd;
+        len += snprintf(out + len, MAXLINE - len, "<&%d", fd);
+        if (len >= MAXLINE - 1)
         {
-            wait(&status);
+            printf("here-document: command line too long\n");
+            return -1;
         }
     }
+
+    out[len] = '\0';
+    strcpy(cmdline, out);
+    return 0;
 }
 
 /*
- * parseline - Parse the command line and build the argv array.
- *
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.
+ * closeheredocs - Close the descriptors made by readheredocs once the
+ *    command line has been run (every child holds its own copy).
  */
-int parseline(const char *cmdline, char **argv, char **infile, char **outfile, char **errfile, int *append_out)
+void closeheredocs(void)
 {
-    static char array[MAXLINE]; // Holds local copy of command line
-    char *buf = array;          // Pointer that traverses command line
-    char *delim;                // Points to first delimiter
-    int argc;                   // Number of args
-    int bg;                     // Background job?
+    while (nherefds > 0)
+        close(herefds[--nherefds]);
+}
 
-    *infile = NULL;
-    *outfile = NULL;
-    *errfile = NULL;
-    *append_out = 0; // Initialize to 0 (overwrite mode)
+/*
+ * nestdelta - Return +1 if p opens a command group within line, -1 if it
+ *    closes one, else 0. Parentheses always count; braces only as whole
+ *    words, so that { and } inside an argument are left alone.
+ */
+int nestdelta(const char *line, const char *p)
+{
+    char prev = p > line ? p[-1] : ' ';
+    char next = p[1];
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf) - 1] = ' ';   // Replace trailing '\n' with space
-    while (*buf && (*buf == ' ')) // Ignore leading spaces
-        buf++;
+    if (*p == '(')
+        return 1;
+    if (*p == ')')
+        return -1;
+    if (*p == '{' && strchr(" \t;&|(", prev) && (next == ' ' || next == '\t' || next == '\n'))
+        return 1;
+    if (*p == '}' && strchr(" \t;", prev) && (next == '\0' || strchr(" \t\n;&|)<>", next)))
+        return -1;
+    return 0;
+}
 
-    argc = 0;
+/*
+ * parsegroup - If a pipeline stage is a command group, ( list ) or
+ *    { list; }, copy the list into inner and the text after the group
+ *    (its redirections) into rest, both newline-terminated. Return the
+ *    group kind, GROUP_NONE for a simple command, or -1 after printing
+ *    a syntax error.
+ */
+int parsegroup(const char *text, char *inner, char *rest)
+{
+    const char *p = text, *open;
+    char quote = 0;
+    int kind, depth = 0;
 
-    while (*buf)
-    {
-        // Skip over spaces
-        while (*buf == ' ')
-            buf++;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '(')
+        kind = GROUP_SUBSHELL;
+    else if (*p == '{' && nestdelta(text, p) > 0)
+        kind = GROUP_BRACE;
+    else
+        return GROUP_NONE;
 
-        if (*buf == '\0')
+    // Find the matching close
+    for (open = p; *p; p++)
+    {
+        if (quote)
+        {
+            if (*p == quote)
+                quote = 0;
+        }
+        else if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if ((depth += nestdelta(text, p)) == 0)
             break;
+    }
+    if (*p == '\0' || (*p == ')') != (kind == GROUP_SUBSHELL))
+    {
+        printf("syntax error: unterminated %s\n", kind == GROUP_SUBSHELL ? "( group" : "{ group");
+        return -1;
+    }
 
-        if (strncmp(buf, "2>", 2) == 0)
+    sprintf(inner, "%.*s\n", (int)(p - open - 1), open + 1);
+    strcpy(rest, p + 1);
+    if (strspn(inner, " \t\n;") == strlen(inner))
+    {
+        printf("syntax error near unexpected token `%c'\n", *p);
+        return -1;
+    }
+    return kind;
+}
+
+/*
+ * procsubst - Copy a pipeline stage into out with each process
+ *    substitution, <(list) or >(list) at the start of an unquoted word
+ *    outside any group, replaced by the /dev/fd/N path of a pipe to the
+ *    list, which is recorded in subs[]. When mkpipes is 0 (checking
+ *    syntax only) no pipes are made and /dev/null stands in. Return the
+ *    number of substitutions, or -1 after printing an error.
+ */
+int procsubst(const char *text, char *out, struct subst_t *subs, int mkpipes)
+{
+    const char *p, *open;
+    char quote = 0;
+    int depth = 0, n = 0, len = 0, k;
+
+    for (p = text; *p; p++)
+    {
+        char prev = p > text ? p[-1] : ' ';
+
+        if (quote || *p == '\'' || *p == '"' || depth > 0 || (*p != '<' && *p != '>') || p[1] != '(' ||
+            !strchr(" \t", prev))
         {
-            buf += 2;
-            while (*buf == ' ')
-                buf++;
-            delim = strchr(buf, ' ');
-            if (delim)
-                *delim = '\0';
-            *errfile = buf;
-            if (delim)
-                buf = delim + 1;
-            else
-                buf += strlen(buf);
+            if (quote && *p == quote)
+                quote = 0;
+            else if (!quote && (*p == '\'' || *p == '"'))
+                quote = *p;
+            else if (!quote)
+                depth += nestdelta(text, p);
+            if (len < MAXLINE - 2)
+                out[len++] = *p;
+            continue;
         }
-        else if (*buf == '<')
+
+        // Find the matching close paren
+        int nest = 0;
+        char q = 0;
+        for (open = ++p; *p; p++)
         {
-            buf++;
-            while (*buf == ' ')
-                buf++;
-            delim = strchr(buf, ' ');
-            if (delim)
-                *delim = '\0';
-            *infile = buf;
-            if (delim)
-                buf = delim + 1;
-            else
-                buf += strlen(buf);
+            if (q)
+            {
+                if (*p == q)
+                    q = 0;
+            }
+            else if (*p == '\'' || *p == '"')
+                q = *p;
+            else if ((nest += nestdelta(text, p)) == 0)
+                break;
         }
-        else if (*buf == '>')
+        if (*p == '\0')
         {
-            buf++;
-            if (*buf == '>')
+            printf("syntax error: unterminated process substitution\n");
+            goto error;
+        }
+        if (n == MAXSUBST)
+        {
+            printf("Too many process substitutions\n");
+            goto error;
+        }
+
+        struct subst_t *s = &subs[n];
+        int fds[2];
+        sprintf(s->list, "%.*s\n", (int)(p - open - 1), open + 1);
+        s->output = open[-1] == '>';
+        s->fd = s->childfd = -1;
+        if (mkpipes)
+        {
+            if (pipe2(fds, O_CLOEXEC) < 0)
             {
-                buf++;
-                *append_out = 1; // Set append mode
+                printf("pipe error: %s\n", strerror(errno));
+                goto error;
             }
-            while (*buf == ' ')
-                buf++;
-            delim = strchr(buf, ' ');
-            if (delim)
-                *delim = '\0';
-            *outfile = buf;
-            if (delim)
-                buf = delim + 1;
-            else
-                buf += strlen(buf);
+            s->fd = fds[s->output ? 1 : 0];
+            s->childfd = fds[s->output ? 0 : 1];
         }
+        n++;
+        if (s->fd >= 0)
+            len += snprintf(out + len, MAXLINE - len, "/dev/fd/%d", s->fd);
         else
+            len += snprintf(out + len, MAXLINE - len, "/dev/null");
+        if (len >= MAXLINE - 2)
+        {
+            printf("Command line too long\n");
+            goto error;
+        }
+    }
+    out[len] = '\0';
+    return n;
+
+error:
+    for (k = 0; k < n; k++)
+        if (subs[k].fd >= 0)
+        {
+            close(subs[k].fd);
+            close(subs[k].childfd);
+        }
+    return -1;
+}
+
+/*
+ * parselist - Split a command line into pipelines separated by the
+ *    connectors ;, &, && and || (quoted text and command groups are
+ *    left alone). Each
+ *    element is malloc'd into elems[], newline-terminated like a command
+ *    line, and ops[i] holds the connector that follows elems[i]. Return
+ *    the number of elements, or -1 after printing a syntax error.
+ */
+int parselist(const char *cmdline, char **elems, int *ops)
+{
+    const char *p, *start = cmdline; // Scan position, start of element
+    char quote = 0;                  // Quote character we are inside
+    int depth = 0;                   // Nesting of ( ) and { } groups
+    int n = 0, i;
+
+    for (p = cmdline;; p++)
+    {
+        int op = -1, len = 1;
+
+        if (quote)
         {
-            // Regular argument
-            argv[argc++] = buf;
-            delim = strchr(buf, ' ');
-            if (delim)
+            if (*p == quote)
+                quote = 0;
+            else if (*p == '\0')
             {
-                *delim = '\0';
-                buf = delim + 1;
+                printf("syntax error: unterminated quote\n");
+                goto error;
             }
-            else
+            continue;
+        }
+
+        if (*p == '\'' || *p == '"')
+            quote = *p;
+        else if (*p != '\0' && *p != '\n' && (depth += nestdelta(cmdline, p)) > 0)
+            continue; // Connectors inside a group belong to it
+        else if (*p == '\0' || *p == '\n')
+        {
+            if (depth > 0)
             {
-                buf += strlen(buf);
+                printf("syntax error: unterminated group\n");
+                goto error;
             }
+            op = OP_END;
+        }
+        else if (*p == ';')
+            op = OP_SEQ;
+        else if (p[0] == '&' && p[1] == '&')
+            op = OP_AND, len = 2;
+        else if (p[0] == '|' && p[1] == '|')
+            op = OP_OR, len = 2;
+        else if (*p == '&' && p > cmdline && (p[-1] == '<' || p[-1] == '>'))
+            continue; // Descriptor redirection (<&N), not a connector
+        else if (*p == '&')
+            op = OP_BG;
+        if (op < 0)
+            continue;
+
+        // An element must contain something besides blanks
+        const char *q = start;
+        while (q < p && (*q == ' ' || *q == '\t'))
+            q++;
+        if (q == p)
+        {
+            if (op == OP_END && (n == 0 || ops[n - 1] == OP_SEQ || ops[n - 1] == OP_BG))
+                break; // Blank line, or a trailing ; or &
+            if (op == OP_END)
+                printf("syntax error: unexpected end of line\n");
+            else
+                printf("syntax error near unexpected token `%.*s'\n", len, p);
+            goto error;
         }
+        if (n == MAXARGS - 1)
+        {
+            printf("syntax error: too many commands\n");
+            goto error;
+        }
+
+        elems[n] = malloc(p - start + 2);
+        memcpy(elems[n], start, p - start);
+        strcpy(elems[n] + (p - start), "\n");
+        ops[n++] = op;
+        if (op == OP_END)
+            break;
+        p += len - 1;
+        start = p + 1;
+    }
+    return n;
+
+error:
+    for (i = 0; i < n; i++)
+        free(elems[i]);
+    return -1;
+}
+
+/*
+ * parsepipe - Split one list element into the stages of a pipeline
+ *    (quoted text and command groups are left alone). Each stage is malloc'd, newline-
+ *    terminated like a command line. Return the number of stages, or -1
+ *    after printing a syntax error.
+ */
+int parsepipe(const char *cmdline, char **commands)
+{
+    const char *p, *start = cmdline; // Scan position, start of stage
+    char quote = 0;                  // Quote character we are inside
+    int depth = 0;                   // Nesting of ( ) and { } groups
+    int count = 0, i;
+
+    for (p = cmdline;; p++)
+    {
+        if (quote)
+        {
+            if (*p == quote)
+                quote = 0;
+            continue;
+        }
+        if (*p == '\'' || *p == '"')
+        {
+            quote = *p;
+            continue;
+        }
+        if (*p != '\n' && *p != '\0' && (depth += nestdelta(cmdline, p)) > 0)
+            continue;
+        if (*p != '|' && *p != '\n' && *p != '\0')
+            continue;
+
+        const char *q = start;
+        while (q < p && (*q == ' ' || *q == '\t'))
+            q++;
+        if (q == p || count == MAXPROCS)
+        {
+            printf(q == p ? "syntax error near unexpected token `|'\n" : "Too many pipeline stages\n");
+            for (i = 0; i < count; i++)
+                free(commands[i]);
+            return -1;
+        }
+        commands[count] = malloc(p - start + 2);
+        memcpy(commands[count], start, p - start);
+        strcpy(commands[count] + (p - start), "\n");
+        count++;
+        if (*p != '|')
+            break;
+        start = p + 1;
     }
 
-    argv[argc] = NULL;
+    commands[count] = NULL; // Null-terminate the array
+    return count;           // Return the number of commands in the pipeline
+}
+
+/*
+ * eval - Evaluate the command line that the user has just typed in
+ *
+ * If the user has requested a built-in command (quit, jobs, bg or fg)
+ * then execute it immediately. Otherwise, fork a child process and
+ * run the job in the context of the child. If the job is running in
+ * the foreground, wait for it to terminate and then return.  Note:
+ * each child process must have a unique process group ID so that our
+ * background children don't receive SIGINT (SIGTSTP) from the kernel
+ * when we type ctrl-c (ctrl-z) at the keyboard.
+ *
+ * The line is parsed once into a list of pipelines joined by ;, && and
+ * ||, which run in order with short-circuit evaluation on last_status.
+ * A pipeline followed by & runs as a background job; a whole list
+ * followed by & runs as one background job in a subshell.
+ */
+void eval(char *cmdline)
+{
+    char *elems[MAXARGS];  // Pipelines of the list
+    int ops[MAXARGS];      // Connector following each pipeline
+    char jobcmd[MAXLINE];  // Command line recorded for a job
+    int n, i, start;
+
+    if ((n = parselist(cmdline, elems, ops)) < 0)
+    {
+        last_status = 2; // Syntax error
+        return;
+    }
+
+    for (start = 0; start < n; start = i + 1)
+    {
+        // Everything up to a '&' (or the end of the line) runs as a unit
+        for (i = start; i < n - 1 && ops[i] != OP_BG; i++)
+            ;
+
+        if (n == 1)
+            strcpy(jobcmd, cmdline);
+        else
+            listcmdline(jobcmd, elems, ops, start, i);
+
+        if (ops[i] != OP_BG)
+        {
+            runsequence(elems, ops, start, i, n == 1 ? jobcmd : NULL);
+            continue;
+        }
+
+        // With set joblog on, its output goes to a log
+        pid_t prevbg = lastbg;
+        int saved[2], logfd = joblog && job_control ? joblog_begin(saved) : -1;
+
+        if (i == start)
+            runpipeline(elems[i], 1, jobcmd);
+        else
+            runlistjob(elems, ops, start, i, jobcmd);
+        if (logfd >= 0)
+            joblog_attach(logfd, saved, prevbg, jobcmd);
+    }
+
+    for (i = 0; i < n; i++)
+        free(elems[i]);
+}
+
+/*
+ * listcmdline - Rebuild the text of list elements start..end, as
+ *    recorded in the job list, into buf.
+ */
+void listcmdline(char *buf, char **elems, int *ops, int start, int end)
+{
+    static const char *opnames[] = {"", ";", "&", "&&", "||"};
+    int k, len = 0;
+
+    buf[0] = '\0';
+    for (k = start; k <= end; k++)
+    {
+        int elen = strlen(elems[k]) - 1; // Without the newline
+        len += snprintf(buf + len, len < MAXLINE ? MAXLINE - len : 0, "%.*s%s", elen, elems[k], opnames[ops[k]]);
+        if (len >= MAXLINE - 1)
+            break;
+    }
+    if (len > MAXLINE - 2)
+        len = MAXLINE - 2;
+    strcpy(buf + len, "\n");
+}
+
+/*
+ * runsequence - Run list elements start..end in the foreground, one
+ *    after another. An element after && runs only if the previous one
+ *    succeeded, and one after || only if it failed. A ctrl-c that
+ *    kills an element, or interrupts a builtin (wait), abandons the
+ *    rest of the list; an element that merely exits with 130 does not.
+ */
+void runsequence(char **elems, int *ops, int start, int end, char *jobcmd)
+{
+    int k;
+
+    for (k = start; k <= end; k++)
+    {
+        if (k > start && ((ops[k - 1] == OP_AND && last_status != 0) || (ops[k - 1] == OP_OR && last_status == 0)))
+            continue;
+        fg_sigint = sigint_seen = 0;
+        runpipeline(elems[k], 0, jobcmd ? jobcmd : elems[k]);
+        if (fg_sigint || sigint_seen)
+            break;
+    }
+}
+
+/*
+ * runlistjob - Run list elements start..end as one background job: a
+ *    forked subshell with its own process group runs the list, so the
+ *    job list, fg, bg and signals treat the whole list as a unit.
+ */
+void runlistjob(char **elems, int *ops, int start, int end, char *jobcmd)
+{
+    sigset_t mask_one, prev_one;
+    struct cmdmods_t nomods;
+    pid_t pid;
+
+    sigemptyset(&mask_one);
+    sigaddset(&mask_one, SIGCHLD);
+    sigaddset(&mask_one, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    fflush(stdout);
+
+    if ((pid = fork()) == 0) // Child runs the list
+    {
+        if (job_control)
+            setpgid(0, 0);
+        subshell();
+        sigprocmask(SIG_SETMASK, &prev_one, NULL);
+        runsequence(elems, ops, start, end, NULL);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0)
+        unix_error("fork error");
+    if (job_control)
+        setpgid(pid, pid);
+
+    if (addjob(jobs, pid, BG, jobcmd))
+    {
+        initmods(&nomods); // No modifiers: jobtimeout applies
+        settimeout(getjobpid(jobs, pid), &nomods);
+        lastbg = pid;
+        lastbgjid = pid2jid(pid);
+        if (jobmsgs)
+            printf("[%d] (%d) %s", lastbgjid, pid, jobcmd);
+    }
+    sigprocmask(SIG_SETMASK, &prev_one, NULL);
+}
+
+/*
+ * subshell - Turn a freshly forked child of the shell into a subshell
+ *    that runs commands without job control: its children stay in its
+ *    process group, so a signal sent to the job reaches all of them,
+ *    and the default actions of SIGINT and SIGTSTP apply to it.
+ */
+void subshell(void)
+{
+    int i;
+
+    job_control = 0;
+    if (recfd >= 0) // Only the shell reads the session's input
+    {
+        close(recfd);
+        recfd = -1;
+    }
+    if (serving)
+    {
+        serving = 0;
+        jobmsgs = 1;
+        Signal(SIGTERM, SIG_DFL);
+    }
+    for (i = 0; i < MAXJOBS; i++) // The jobs are the shell's, not ours
+        if (jobs[i].pid != 0 && jobs[i].pidfd >= 0)
+            close(jobs[i].pidfd);
+    initjobs(jobs);
+    if (zygotefd >= 0) // Its children would be the shell's, not ours
+    {
+        close(zygotefd);
+        zygotefd = -1;
+    }
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+}
+
+/*
+ * redirfd - Duplicate the descriptor a redirection names with &N (<&N,
+ *    >&N, 2>&1) onto fd. Return -1 after printing an error to stderr (a
+ *    child exits without flushing stdout) if N is not a number or not open.
+ */
+int redirfd(const char *name, int fd)
+{
+    long n;
+
+    if (parse_long(name + 1, &n) < 0 || n < 0 || n > INT_MAX)
+    {
+        fprintf(stderr, "%s: ambiguous redirect\n", name);
+        return -1;
+    }
+    if (n != fd && dup2(n, fd) < 0)
+    {
+        fprintf(stderr, "%ld: %s\n", n, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * redirect - Open the files named by a command's redirections and put
+ *    them on stdin, stdout and stderr. A name of the form &N is the
+ *    descriptor N instead (see redirfd); stdout is redirected before
+ *    stderr, so 2>&1 follows a > file. Return -1 after printing an
+ *    error if a file cannot be opened.
+ */
+int redirect(char *infile, char *outfile, char *errfile, int append_out)
+{
+    int fd;
+
+    // Handle input duplicated from a descriptor (<&N), as here-documents are
+    if (infile && infile[0] == '&')
+    {
+        if (redirfd(infile, STDIN_FILENO) < 0)
+            return -1;
+    }
+    // Handle input redirection
+    else if (infile)
+    {
+        if ((fd = open(infile, O_RDONLY)) < 0)
+        {
+            perror("open error for input redirection");
+            return -1;
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+
+    // Handle output redirection
+    if (outfile && outfile[0] == '&')
+    {
+        if (redirfd(outfile, STDOUT_FILENO) < 0)
+            return -1;
+    }
+    else if (outfile)
+    {
+        if ((fd = open(outfile, O_WRONLY | O_CREAT | (append_out ? O_APPEND : O_TRUNC), 0644)) < 0)
+        {
+            perror("open error for output redirection");
+            return -1;
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    // Handle error redirection
+    if (errfile && errfile[0] == '&')
+    {
+        if (redirfd(errfile, STDERR_FILENO) < 0)
+            return -1;
+    }
+    else if (errfile)
+    {
+        if ((fd = open(errfile, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        {
+            perror("open error for error redirection");
+            return -1;
+        }
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+    return 0;
+}
+
+/*
+ * saveredirs - Apply a command's redirections inside the shell itself.
+ *    The descriptors they replace are first copied into saved[] with
+ *    F_DUPFD_CLOEXEC, so children never inherit the copies. Return -1
+ *    if a file cannot be opened; call restorefds either way.
+ */
+int saveredirs(int saved[3], char *infile, char *outfile, char *errfile, int append_out)
+{
+    fflush(stdout);
+    saved[STDIN_FILENO] = infile ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    saved[STDOUT_FILENO] = outfile ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    saved[STDERR_FILENO] = errfile ? fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10) : -1;
+    return redirect(infile, outfile, errfile, append_out);
+}
+
+/*
+ * restorefds - Undo saveredirs
+ */
+void restorefds(int saved[3])
+{
+    int fd;
+
+    fflush(stdout);
+    for (fd = 0; fd < 3; fd++)
+    {
+        if (saved[fd] >= 0)
+        {
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+}
+
+/*
+ * runpipeline - Run one pipeline (or a single command) from a list.
+ *    Builtins run in the shell. Otherwise every stage is forked into
+ *    the process group of the first, and the stages form a single job
+ *    whose status is that of the last stage. A foreground job is
+ *    waited for, and its status left in last_status.
+ *
+ *    A stage may be a command group: ( list ) runs in a forked subshell,
+ *    and so does { list; } in a pipeline or the background. Alone in
+ *    the foreground, { list; } runs in the shell with no fork, its
+ *    redirections applied around it by saving and restoring fds.
+ *
+ *    The lists of process substitutions in a stage are forked just
+ *    before it, into the same job, so they share its process group and
+ *    are signaled and reaped with it.
+ *
+ *    Stages joined by |> instead of | are the consumers of a fan-out:
+ *    each gets its own copy of what the stage before the first |>
+ *    writes, from a relay process in the job. A consumer that is just
+ *    an output redirection (|> > file) is a file the relay writes to.
+ */
+void runpipeline(char *text, int bg, char *jobcmd)
+{
+    char *commands[MAXPROCS + 1];          // Pipeline stages
+    char *argv[MAXARGS];                   // Words of a stage, from parseline
+    char **args = NULL;                    // Argument list for execve(), patterns expanded
+    int nassign = 0;                       // NAME=VALUE words that start it
+    char *infile, *outfile, *errfile;      // File names for redirection
+    int append_out = 0;                    // Append mode flag
+    int num_commands;                      // Number of pipeline commands
+    pid_t pid, pgid = 0;                   // Process id, job's process group
+    int pipefds[2], prev_in = -1;          // Pipe to the next stage, read end from the previous one
+    sigset_t mask_one, prev_one;           // Signal masks for blocking/unblocking signals
+    struct cmdmods_t mods, jobmods;        // Precommand modifiers of a stage, and of the job
+    struct job_t *job = NULL;
+    char inner[MAXLINE], rest[MAXLINE];    // List and redirections of a command group
+    char stage[MAXLINE];                   // Stage with its process substitutions replaced
+    struct subst_t subs[MAXSUBST];         // Process substitutions of a stage
+    int nsubs, anysubs = 0;
+    int fanstart, npipes;                  // First fan-out consumer, number of | pipes
+    int fanrd[MAXPROCS], fanwr[MAXPROCS];  // Pipes from the relay to the consumers
+    char sink[MAXPROCS];                   // Is the consumer just an output file?
+    int i, j, k, status, kind = GROUP_NONE;
+
+    if ((num_commands = parsepipe(text, commands)) < 0)
+    {
+        last_status = 2;
+        return;
+    }
+
+    // Stages after a |> are consumers of a fan-out, up to the end
+    for (fanstart = num_commands, i = 1; i < num_commands; i++)
+    {
+        if (commands[i][0] == '>')
+        {
+            commands[i][0] = ' ';
+            fanstart = i < fanstart ? i : fanstart;
+        }
+        else if (fanstart < num_commands)
+        {
+            printf("syntax error: | after |>\n");
+            last_status = 2;
+            goto done;
+        }
+    }
+    npipes = fanstart < num_commands ? fanstart : num_commands - 1;
+
+    // Check every stage before starting any of them
+    initmods(&jobmods);
+    for (i = 0; i < num_commands; i++)
+    {
+        sink[i] = 0;
+        if ((nsubs = procsubst(commands[i], stage, subs, 0)) < 0)
+        {
+            last_status = 2;
+            goto done;
+        }
+        anysubs += nsubs;
+        if ((kind = parsegroup(stage, inner, rest)) != GROUP_NONE)
+        {
+            // Only redirections may follow a group
+            if (kind < 0 || parseline(rest, argv, &infile, &outfile, &errfile, &append_out) != 1 || argv[0])
+            {
+                if (kind > 0)
+                    printf("syntax error near unexpected token `%s'\n", argv[0] ? argv[0] : "&");
+                last_status = 2;
+                goto done;
+            }
+            continue;
+        }
+        if (parseline(stage, argv, &infile, &outfile, &errfile, &append_out) < 0)
+        {
+            printf("too many arguments\n");
+            last_status = 2;
+            goto done;
+        }
+        if (argv[0] == NULL && i >= fanstart && outfile && outfile[0] != '&' && !infile && !errfile)
+        {
+            sink[i] = 1;
+            continue;
+        }
+        if (argv[0] == NULL)
+        {
+            if (num_commands > 1)
+                printf("syntax error near unexpected token `|'\n");
+            last_status = num_commands > 1 ? 2 : last_status;
+            goto done;
+        }
+        if (parsemods(argv + assignments(argv), &mods) < 0)
+        {
+            last_status = 2;
+            goto done;
+        }
+        if (mods.timeout > 0)
+        {
+            jobmods.timeout = mods.timeout;
+            jobmods.grace = mods.grace;
+            jobmods.timeout_sig = mods.timeout_sig;
+        }
+    }
+
+    // A lone brace group in the foreground runs in the shell itself
+    if (num_commands == 1 && !bg && kind == GROUP_BRACE && anysubs == 0)
+    {
+        int saved[3];
+
+        parseline(rest, argv, &infile, &outfile, &errfile, &append_out);
+        if (saveredirs(saved, infile, outfile, errfile, append_out) == 0)
+            eval(inner);
+        else
+            last_status = 1;
+        restorefds(saved);
+        goto done;
+    }
+
+    // So does a lone builtin, with its redirections applied in place (a job server runs it as a job)
+    if (num_commands == 1 && kind == GROUP_NONE && jobmods.timeout == 0 && anysubs == 0 && !serving)
+    {
+        parseline(commands[0], argv, &infile, &outfile, &errfile, &append_out);
+        args = globargv(argv);
+        nassign = assignments(args);
+        if (args[nassign] == NULL) // Assignments alone set shell variables
+        {
+            for (k = 0; k < nassign; k++)
+                setvar(args[k], 0);
+            last_status = 0;
+            freeargv(args);
+            goto done;
+        }
+        if (parsemods(args + nassign, &mods) == 0 && isbuiltin(args[nassign]) == BI_SHELL)
+        {
+            int saved[3];
+
+            if (saveredirs(saved, infile, outfile, errfile, append_out) == 0)
+                builtin_cmd(args + nassign);
+            else
+                last_status = 1;
+            restorefds(saved);
+            freeargv(args);
+            goto done;
+        }
+        freemods(args + nassign, &mods);
+        freeargv(args);
+    }
+
+    // A lone memo command whose result is cached is answered with no fork
+    if (num_commands == 1 && kind == GROUP_NONE && anysubs == 0 && !serving)
+    {
+        parseline(commands[0], argv, &infile, &outfile, &errfile, &append_out);
+        args = globargv(argv);
+        nassign = assignments(args);
+        if (parsemods(args + nassign, &mods) > 0 && mods.memo &&
+            memo_hit(args, nassign, &mods, infile, outfile, errfile, append_out))
+        {
+            freemods(args + nassign, &mods);
+            freeargv(args);
+            goto done;
+        }
+        freemods(args + nassign, &mods);
+        freeargv(args);
+    }
+
+    sigemptyset(&mask_one);
+    sigaddset(&mask_one, SIGCHLD);
+    sigaddset(&mask_one, SIGALRM);
+    sigaddset(&mask_one, SIGINT);  // Keyboard signals wait until the job is
+    sigaddset(&mask_one, SIGTSTP); // in the list, then go to all of it
+    sigprocmask(SIG_BLOCK, &mask_one, &prev_one);
+    fflush(stdout);
+    buildenv(); // Once here, not in every child
+
+    for (i = 0; i < num_commands; i++)
+    {
+        // Before the first consumer, start the relay that feeds them all
+        if (i == fanstart)
+        {
+            for (k = fanstart; k < num_commands; k++)
+            {
+                fanrd[k] = fanwr[k] = -1;
+                if (!sink[k] && pipe2(pipefds, O_CLOEXEC) < 0)
+                    unix_error("pipe error");
+                else if (!sink[k])
+                    fanrd[k] = pipefds[0], fanwr[k] = pipefds[1];
+            }
+            if ((pid = fork()) == 0)
+            {
+                int outs[MAXPROCS], nout = 0;
+
+                sigprocmask(SIG_SETMASK, &prev_one, NULL);
+                if (job_control)
+                    setpgid(0, pgid);
+                subshell();
+                for (k = fanstart; k < num_commands; k++)
+                {
+                    if (!sink[k])
+                    {
+                        close(fanrd[k]);
+                        outs[nout++] = fanwr[k];
+                        continue;
+                    }
+                    parseline(commands[k], argv, &infile, &outfile, &errfile, &append_out);
+                    if ((outs[nout] = open(outfile, O_WRONLY | O_CREAT | O_CLOEXEC | (append_out ? O_APPEND : O_TRUNC),
+                                           0644)) < 0)
+                        printf("%s: %s\n", outfile, strerror(errno));
+                    else
+                        nout++;
+                }
+                if (nout > 0)
+                    relay(prev_in, outs, nout);
+                fflush(stdout);
+                _exit(0);
+            }
+            if (pid < 0)
+                unix_error("fork error");
+            joinjob(pid, &pgid, &job, bg, jobcmd);
+            close(prev_in);
+            prev_in = -1;
+            for (k = fanstart; k < num_commands; k++)
+                if (fanwr[k] >= 0)
+                    close(fanwr[k]);
+        }
+        if (i >= fanstart)
+        {
+            if (sink[i])
+                continue;
+            prev_in = fanrd[i];
+            fanrd[i] = -1;
+        }
+
+        if ((nsubs = procsubst(commands[i], stage, subs, 1)) < 0)
+            nsubs = 0, strcpy(stage, "false\n"); // Out of pipes: the stage fails
+
+        // Start the lists of its process substitutions
+        for (j = 0; j < nsubs; j++)
+        {
+            if ((pid = fork()) == 0)
+            {
+                sigprocmask(SIG_SETMASK, &prev_one, NULL);
+                if (job_control)
+                    setpgid(0, pgid);
+                dup2(subs[j].childfd, subs[j].output ? STDIN_FILENO : STDOUT_FILENO);
+                for (k = 0; k < nsubs; k++)
+                {
+                    close(subs[k].fd);
+                    close(subs[k].childfd);
+                }
+                if (prev_in >= 0)
+                    close(prev_in);
+
+                subshell();
+                eval(subs[j].list);
+                fflush(stdout);
+                _exit(last_status);
+            }
+            if (pid < 0)
+                unix_error("fork error");
+            joinjob(pid, &pgid, &job, bg, jobcmd);
+            close(subs[j].childfd);
+        }
+
+        if ((kind = parsegroup(stage, inner, rest)) != GROUP_NONE)
+        {
+            parseline(rest, argv, &infile, &outfile, &errfile, &append_out);
+            initmods(&mods);
+        }
+        else
+        {
+            parseline(stage, argv, &infile, &outfile, &errfile, &append_out);
+            args = globargv(argv);
+            nassign = assignments(args);
+            parsemods(args + nassign, &mods);
+        }
+
+        if (i < npipes && pipe(pipefds) < 0)
+            unix_error("pipe error");
+
+        // A plain command is started by the spawn helper, if it can
+        pid = -1;
+        if (zygote && zygotefd >= 0 && job_control && kind == GROUP_NONE && nsubs == 0 &&
+            nassign == 0 && args[0] != NULL && mods.nenv == 0 && !mods.env_clear && !mods.memo &&
+            !isbuiltin(args[0]))
+        {
+            int fds[3] = {prev_in >= 0 ? prev_in : STDIN_FILENO, i < npipes ? pipefds[1] : STDOUT_FILENO,
+                          STDERR_FILENO};
+
+            pid = zygote_spawn(args, fds, pgid, &mods, infile, outfile, errfile, append_out);
+        }
+
+        if (pid < 0 && (pid = fork()) == 0) // Child process
+        {
+            Signal(SIGINT, SIG_DFL); // Not the shell's handlers, even before exec
+            Signal(SIGTSTP, SIG_DFL);
+            sigprocmask(SIG_SETMASK, &prev_one, NULL);
+            if (job_control)
+                setpgid(0, pgid);
+
+            // Connect to the neighbouring stages
+            if (prev_in >= 0)
+            {
+                dup2(prev_in, STDIN_FILENO);
+                close(prev_in);
+            }
+            if (i < npipes)
+            {
+                dup2(pipefds[1], STDOUT_FILENO);
+                close(pipefds[0]);
+                close(pipefds[1]);
+            }
+            for (k = i + 1; k < num_commands && i >= fanstart; k++) // Other consumers' pipes
+                if (fanrd[k] >= 0)
+                    close(fanrd[k]);
+            for (k = 0; k < nsubs; k++) // Keep /dev/fd/N open across exec
+                fcntl(subs[k].fd, F_SETFD, 0);
+
+            applymods(&mods);
+            if (redirect(infile, outfile, errfile, append_out) < 0)
+                _exit(1);
+
+            // Or a lone memo command, under this child keeping its result
+            if (mods.memo && num_commands == 1 && kind == GROUP_NONE && args[nassign] != NULL)
+                memo_fork(args, nassign, &mods, infile); // Returns in the command's process
+
+            // A command group runs its list in this child
+            if (kind != GROUP_NONE)
+            {
+                subshell();
+                eval(inner);
+                fflush(stdout);
+                _exit(last_status);
+            }
+
+            // Assignments alone change nothing outside this child
+            if (args[nassign] == NULL)
+                _exit(0);
+
+            // So does a builtin that runs as a job of its own
+            if (mods.count == 0 && (status = jobbuiltin(args + nassign)) >= 0)
+            {
+                fflush(stdout);
+                _exit(status);
+            }
+
+            // A builtin inside a pipeline runs in this child
+            if (mods.count == 0 && builtin_cmd(args + nassign))
+            {
+                fflush(stdout);
+                _exit(last_status);
+            }
+
+            // Execute the command, in its own environment
+            environ = childenv(args, nassign, &mods); // The PATH search uses it too
+            if (execvpe(args[nassign], args + nassign, environ) < 0)
+            {
+                perror("Command execution error");
+                _exit(1);
+            }
+        }
+        if (pid < 0)
+            unix_error("fork error");
+
+        joinjob(pid, &pgid, &job, bg, jobcmd);
+        for (k = 0; k < nsubs; k++)
+            close(subs[k].fd);
+        if (args != NULL)
+            freemods(args + nassign, &mods);
+        freeargv(args);
+        args = NULL;
+
+        if (prev_in >= 0)
+            close(prev_in);
+        if (i < npipes)
+        {
+            close(pipefds[1]);
+            prev_in = pipefds[0];
+        }
+    }
+
+    settimeout(job, &jobmods); // The shell itself enforces deadlines
+    if (bg && job != NULL) // Its job ID, read before it can end and leave the list
+    {
+        lastbg = pgid;
+        lastbgjid = job->jid;
+    }
+    sigprocmask(SIG_SETMASK, &prev_one, NULL);
+
+    if (!bg && job == NULL)
+    {
+        last_status = 1; // Not in the job list, so no status will come
+    }
+    else if (!bg)
+    {
+        waitfg(pgid); // Wait for foreground job to finish
+    }
+    else
+    {
+        if (jobmsgs)
+            printf("[%d] (%d) %s", job ? lastbgjid : 0, pgid, jobcmd); // Print background job details
+        last_status = 0;
+    }
+
+done:
+    for (i = 0; i < num_commands; i++)
+        free(commands[i]);
+}
+
+/*
+ * relay - Copy everything that arrives on the pipe in to each of the
+ *    nout descriptors in outs (pipes to the consumers of a fan-out, or
+ *    files), without bringing it into user memory: tee(2) duplicates
+ *    the pipe's buffers to every output but the last, and splice(2)
+ *    moves them to the last. A file that is not the last output is
+ *    teed into a pipe of its own and spliced on from there, since tee
+ *    only writes to pipes. Outputs whose reader has gone are dropped.
+ *    Returns at end of input, or once every output is gone.
+ */
+void relay(int in, int *outs, int nout)
+{
+    int viar[MAXPROCS], viaw[MAXPROCS]; // Pipe a file output goes through, or -1
+    ssize_t sent[MAXPROCS];             // Bytes of this round teed to each output
+    char *buf = NULL;                   // For the rare round some tee cut short
+    int live = nout, last, k, p[2];
+    ssize_t n, m, left;
+    struct stat st;
+
+    Signal(SIGPIPE, SIG_IGN); // A consumer that exits early shows up as EPIPE
+    fcntl(in, F_SETPIPE_SZ, RELAYCHUNK);
+    for (k = 0; k < nout; k++)
+    {
+        viar[k] = viaw[k] = -1;
+        if (fstat(outs[k], &st) == 0 && S_ISFIFO(st.st_mode))
+            fcntl(outs[k], F_SETPIPE_SZ, RELAYCHUNK);
+        else if (k < nout - 1 && pipe(p) == 0)
+        {
+            fcntl(p[1], F_SETPIPE_SZ, RELAYCHUNK);
+            viar[k] = p[0];
+            viaw[k] = p[1];
+        }
+    }
+
+    while (live > 0)
+    {
+        for (last = nout - 1; outs[last] < 0; last--)
+            ;
+
+        // Duplicate the buffered input to every output but the last
+        int partial = 0;
+        n = -1;
+        for (k = 0; k < last; k++)
+        {
+            if (outs[k] < 0)
+                continue;
+            while ((m = tee(in, viaw[k] >= 0 ? viaw[k] : outs[k], n < 0 ? RELAYCHUNK : n, 0)) < 0 && errno == EINTR)
+                ;
+            if (m < 0)
+            {
+                close(outs[k]);
+                outs[k] = -1;
+                live--;
+                continue;
+            }
+            if (n < 0 && (n = m) == 0)
+                return; // End of input
+            sent[k] = m;
+            partial |= m < n;
+            for (left = m; viaw[k] >= 0 && left > 0; left -= m)
+                if ((m = splice(viar[k], NULL, outs[k], NULL, left, SPLICE_F_MOVE)) <= 0)
+                {
+                    close(outs[k]);
+                    outs[k] = -1;
+                    live--;
+                    break;
+                }
+        }
+
+        // Rarely an output had room for only part of it: finish by copying
+        if (partial)
+        {
+            if (buf == NULL && (buf = malloc(RELAYCHUNK)) == NULL)
+                return;
+            for (left = 0; left < n; left += m)
+                if ((m = read(in, buf + left, n - left)) <= 0)
+                    return;
+            for (k = 0; k <= last; k++)
+            {
+                ssize_t from = k < last ? sent[k] : 0; // The last output has had none of it
+                for (; outs[k] >= 0 && from < n; from += m)
+                    if ((m = write(outs[k], buf + from, n - from)) <= 0)
+                    {
+                        close(outs[k]);
+                        outs[k] = -1;
+                        live--;
+                        break;
+                    }
+            }
+            continue;
+        }
+
+        // Move it to the last output, which consumes it from the input
+        for (left = n; left != 0; left -= m)
+        {
+            while ((m = splice(in, NULL, outs[last], NULL, n < 0 ? RELAYCHUNK : left, SPLICE_F_MOVE)) < 0 &&
+                   errno == EINTR)
+                ;
+            if (m == 0)
+                return; // End of input
+            if (m < 0)
+            {
+                close(outs[last]);
+                outs[last] = -1;
+                live--;
+                // The others already have this round: drop it from the input
+                if (n > 0 && (buf != NULL || (buf = malloc(RELAYCHUNK)) != NULL))
+                    for (; left > 0; left -= m)
+                        if ((m = read(in, buf, left)) <= 0)
+                            return;
+                break;
+            }
+            if (n < 0)
+                break;
+        }
+    }
+}
+
+/*
+ * joinjob - Put a process just forked for a pipeline into its job. The
+ *    first one leads the job's process group and creates the job.
+ */
+void joinjob(pid_t pid, pid_t *pgid, struct job_t **job, int bg, char *jobcmd)
+{
+    if (*pgid == 0)
+    {
+        *pgid = pid;
+        if (addjob(jobs, pid, bg ? BG : FG, jobcmd))
+            *job = getjobpid(jobs, pid);
+    }
+    else if (*job != NULL)
+    {
+        addproc(*job, pid);
+    }
+    if (job_control)
+        setpgid(pid, *pgid);
+}
+
+/*
+ * expandvar - Copy the value of the variable reference at *bufp ($NAME,
+ *    ${NAME}, $?, $$ or $!) to dst, escaping it as quoted text, and advance
+ *    *bufp past it. A $ that starts no reference is copied as it is.
+ *    Copies nothing at or past end. Return the number of bytes copied.
+ */
+int expandvar(const char **bufp, char *dst, char *end)
+{
+    const char *p = *bufp + 1, *val;
+    char num[16], *d = dst;
+    size_t len;
+
+    if (*p == '?' || *p == '$' || *p == '!')
+    {
+        sprintf(num, "%d", *p == '?' ? last_status : *p == '!' ? (int)lastbg : (int)getpid());
+        val = *p == '!' && lastbg == 0 ? "" : num;
+        p++;
+    }
+    else if (*p == '{' && (len = namelen(p + 1)) > 0 && p[len + 1] == '}')
+    {
+        val = getvar(p + 1, len);
+        p += len + 2;
+    }
+    else if ((len = namelen(p)) > 0)
+    {
+        val = getvar(p, len);
+        p += len;
+    }
+    else
+    {
+        *bufp = p;
+        *d++ = '$';
+        return 1;
+    }
+
+    for (; val && *val && d < end - 1; val++)
+    {
+        if (strchr("*?[\\", *val))
+            *d++ = '\\';
+        *d++ = *val;
+    }
+    *bufp = p;
+    return d - dst;
+}
+
+/*
+ * expandref - Copy the value of the variable reference at *bufp to dst as
+ *    expandvar does, but as plain text with no escapes, for text that is
+ *    never a pattern. Copies nothing at or past end. Return the number
+ *    of bytes copied.
+ */
+int expandref(const char **bufp, char *dst, char *end)
+{
+    int n = expandvar(bufp, dst, end - 1);
+
+    unescape(dst, dst, n);
+    return strlen(dst);
+}
+
+/*
+ * expandtext - Copy s to dst with its variable references expanded, as
+ *    in a here-document body: \$ and \\ stand for $ and \. Copies nothing
+ *    at or past end; dst is always terminated. Return the number of
+ *    bytes copied.
+ */
+int expandtext(const char *s, char *dst, char *end)
+{
+    char *d = dst;
+
+    while (*s && d < end - 1)
+    {
+        if (*s == '\\' && (s[1] == '$' || s[1] == '\\'))
+        {
+            *d++ = s[1];
+            s += 2;
+        }
+        else if (*s == '$')
+            d += expandref(&s, d, end);
+        else
+            *d++ = *s++;
+    }
+    *d = '\0';
+    return d - dst;
+}
+
+/*
+ * parseline - Parse the command line and build the argv array.
+ *
+ * Characters enclosed in single quotes are treated as a single
+ * argument.  Return true if the user has requested a BG job (an
+ * unquoted & as the last word), false if the user has requested a FG
+ * job.
+ *
+ * Double quotes group characters the same way, and a quote may start
+ * in the middle of a word (--name='a b'). The quote characters
+ * themselves are removed. Redirections (<, >, >>, 2>) are only
+ * recognized at the start of an unquoted word.
+ *
+ * An argument with an unquoted *, ? or [ is a pattern, flagged in
+ * globword[] for globargv, with its quoted characters escaped.
+ * Variables ($NAME, ${NAME}, $? and $$) are expanded outside single
+ * quotes; their values are never patterns.
+ *
+ * Return -1 if the line has more words than argv (MAXARGS) can hold;
+ * argv then has the first MAXARGS - 1 of them.
+ */
+int parseline(const char *cmdline, char **argv, char **infile, char **outfile, char **errfile, int *append_out)
+{
+    static char array[8 * MAXLINE]; // Holds the unquoted words of the command line
+    const char *buf = cmdline;  // Pointer that traverses command line
+    char *dst = array;          // Where the next word is copied
+    char **target;              // Where the word being read belongs
+    int redir;                  // Is the word a redirection's file name?
+    int argc;                   // Number of args
+    int bg = 0;                 // Background job? (the last word is an unquoted &)
+
+    *infile = NULL;
+    *outfile = NULL;
+    *errfile = NULL;
+    *append_out = 0; // Initialize to 0 (overwrite mode)
+
+    argc = 0;
+
+    while (*buf)
+    {
+        // Skip over spaces
+        while (*buf == ' ' || *buf == '\t' || *buf == '\n')
+            buf++;
+
+        if (*buf == '\0')
+            break;
+
+        if (strncmp(buf, "2>", 2) == 0)
+        {
+            buf += 2;
+            target = errfile;
+            redir = 1;
+        }
+        else if (*buf == '<')
+        {
+            buf++;
+            target = infile;
+            redir = 1;
+        }
+        else if (*buf == '>')
+        {
+            buf++;
+            if (*buf == '>')
+            {
+                buf++;
+                *append_out = 1; // Set append mode
+            }
+            target = outfile;
+            redir = 1;
+        }
+        else
+        {
+            // Regular argument, if argv has room for it and the NULL
+            if (argc == MAXARGS - 1)
+            {
+                argv[argc] = NULL;
+                return -1;
+            }
+            target = &argv[argc++];
+            redir = 0;
+        }
+
+        // A redirection's file name may follow after spaces
+        if (redir)
+            while (*buf == ' ' || *buf == '\t')
+                buf++;
+
+        // Copy one word, dropping its quote characters. In case it is a
+        // pattern, quoted *, ? and [ and all backslashes are escaped
+        char *word = *target = dst;
+        int pattern = 0, quoted = 0, expanded = 0;
+        while (*buf && *buf != ' ' && *buf != '\t' && *buf != '\n')
+        {
+            if (*buf == '\'' || *buf == '"')
+            {
+                char quote = *buf++;
+                quoted = 1;
+                while (*buf && *buf != quote)
+                {
+                    if (quote == '"' && *buf == '$')
+                    {
+                        dst += expandvar(&buf, dst, array + sizeof(array) - 2 * MAXLINE);
+                        continue;
+                    }
+                    if (strchr("*?[\\", *buf))
+                        *dst++ = '\\';
+                    *dst++ = *buf++;
+                }
+                if (*buf)
+                    buf++;
+            }
+            else if (*buf == '$')
+            {
+                dst += expandvar(&buf, dst, array + sizeof(array) - 2 * MAXLINE);
+                expanded = 1;
+            }
+            else
+            {
+                if (*buf == '\\')
+                    *dst++ = '\\';
+                else if (strchr("*?[", *buf))
+                    pattern = 1;
+                *dst++ = *buf++;
+            }
+        }
+        *dst++ = '\0';
+        if (dst == word + 1 && expanded && !quoted && !redir)
+        {
+            argc--; // An unquoted expansion to nothing is no word at all
+            dst = word;
+            continue;
+        }
+        bg = !redir && !quoted && strcmp(word, "&") == 0;
+        if (!pattern || redir)
+        {
+            unescape(word, word, dst - word);
+            dst = word + strlen(word) + 1;
+        }
+        if (!redir)
+            globword[argc - 1] = pattern;
+    }
+
+    argv[argc] = NULL;
+
+    if (argc == 0) // Ignore blank line
+        return 1;
+
+    if (bg)
+    {
+        argv[--argc] = NULL;
+    }
+
+    return bg;
+}
+
+/*
+ * parse_long - Parse a whole string as a decimal integer. Return 0 on
+ *    success, -1 if s is empty or has trailing garbage.
+ */
+int parse_long(const char *s, long *val)
+{
+    char *end;
+
+    if (s == NULL || *s == '\0')
+        return -1;
+    errno = 0;
+    *val = strtol(s, &end, 10);
+    if (errno != 0 || *end != '\0')
+        return -1;
+    return 0;
+}
+
+/*
+ * parse_duration - Parse a timeout duration such as "10", "2.5s", "500ms",
+ *    "3m", "1h" or "1d" into seconds. Return 0 on success, -1 on error.
+ */
+int parse_duration(const char *s, double *secs)
+{
+    char *end;
+    double val;
+
+    if (s == NULL || *s == '\0')
+        return -1;
+    errno = 0;
+    val = strtod(s, &end);
+    if (errno != 0 || end == s || val < 0)
+        return -1;
+
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+        *secs = val;
+    else if (strcmp(end, "ms") == 0)
+        *secs = val / 1000;
+    else if (strcmp(end, "m") == 0)
+        *secs = val * 60;
+    else if (strcmp(end, "h") == 0)
+        *secs = val * 3600;
+    else if (strcmp(end, "d") == 0)
+        *secs = val * 86400;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * parse_size - Parse a size such as "4096", "64K", "16M" or "1G" into
+ *    bytes. Return 0 on success, -1 on error.
+ */
+int parse_size(const char *s, long *bytes)
+{
+    char *end;
+    long val;
+
+    if (s == NULL || !isdigit(*s))
+        return -1;
+    errno = 0;
+    val = strtol(s, &end, 10);
+    if (errno != 0)
+        return -1;
+
+    if (strcmp(end, "") == 0)
+        *bytes = val;
+    else if (strcmp(end, "K") == 0 || strcmp(end, "k") == 0)
+        *bytes = val << 10;
+    else if (strcmp(end, "M") == 0)
+        *bytes = val << 20;
+    else if (strcmp(end, "G") == 0)
+        *bytes = val << 30;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * parse_cpulist - Parse a taskset CPU list ("0,2-3") or hex mask ("0x5")
+ *    into a cpu_set_t. Return 0 on success, -1 on error.
+ */
+int parse_cpulist(const char *s, int is_list, cpu_set_t *cpus)
+{
+    CPU_ZERO(cpus);
+
+    if (!is_list) // Hex mask, least significant digit last
+    {
+        int len, bit = 0;
+
+        if (strncmp(s, "0x", 2) == 0 || strncmp(s, "0X", 2) == 0)
+            s += 2;
+        if ((len = strlen(s)) == 0)
+            return -1;
+        while (len-- > 0)
+        {
+            int digit;
+
+            if (!isxdigit(s[len]))
+                return -1;
+            digit = isdigit(s[len]) ? s[len] - '0' : tolower(s[len]) - 'a' + 10;
+            for (int j = 0; j < 4; j++, bit++)
+                if ((digit & (1 << j)) && bit < CPU_SETSIZE)
+                    CPU_SET(bit, cpus);
+        }
+        return CPU_COUNT(cpus) > 0 ? 0 : -1;
+    }
+
+    while (*s) // Comma-separated CPUs and ranges
+    {
+        char *end;
+        long lo, hi;
+
+        lo = hi = strtol(s, &end, 10);
+        if (end == s)
+            return -1;
+        if (*end == '-')
+        {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s)
+                return -1;
+        }
+        if (lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            return -1;
+        while (lo <= hi)
+            CPU_SET(lo++, cpus);
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return -1;
+        s = end;
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/* Linux I/O priority encoding (see ioprio_set(2)) */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+/*
+ * parsemods - Strip precommand modifiers from the front of argv and
+ *    record them in mods, so that they can be applied between fork and
+ *    exec of the real command instead of exec'ing wrapper binaries:
+ *
+ *        nice [-n N | -N]                 setpriority
+ *        ionice [-c CLASS] [-n LEVEL]     ioprio_set
+ *        taskset MASK | taskset -c LIST   sched_setaffinity
+ *        timeout [-k GRACE] [-s SIG] DUR  enforced by the shell
+ *        env [-i] [-u NAME] [NAME=VALUE]  environment overrides
+ *        ulimit -[cdflmnstuv] VALUE       prlimit
+ *        memo                             the result cache (memo_hit)
+ *
+ *    Modifiers may be chained. Returns the number of modifiers found
+ *    (argv then starts at the real command), or -1 after printing an
+ *    error message. The words the modifiers took are not dropped but
+ *    moved after argv's NULL, since mods->env points into them; a
+ *    caller whose words are malloc'd frees them with freemods.
+ */
+int parsemods(char **argv, struct cmdmods_t *mods)
+{
+    int i = 0; // Index of the word being examined
+    long val;
+    char *name;
+
+    initmods(mods);
+
+    while ((name = argv[i]) != NULL)
+    {
+        if (strcmp(name, "nice") == 0)
+        {
+            mods->nice_set = 1;
+            mods->nice = 10; // Same default as nice(1)
+            i++;
+            if (argv[i] && strcmp(argv[i], "-n") == 0)
+            {
+                if (parse_long(argv[i + 1], &val) < 0)
+                {
+                    printf("nice: invalid adjustment\n");
+                    return -1;
+                }
+                mods->nice = val;
+                i += 2;
+            }
+            else if (argv[i] && argv[i][0] == '-' && parse_long(argv[i] + 1, &val) == 0)
+            {
+                mods->nice = val;
+                i++;
+            }
+        }
+        else if (strcmp(name, "ionice") == 0)
+        {
+            long class = 2, level = 4; // best-effort, default level
+            i++;
+            while (argv[i] && (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "-n") == 0))
+            {
+                if (parse_long(argv[i + 1], &val) < 0)
+                {
+                    printf("ionice: invalid argument for %s\n", argv[i]);
+                    return -1;
+                }
+                if (argv[i][1] == 'c')
+                    class = val;
+                else
+                    level = val;
+                i += 2;
+            }
+            if (class < 0 || class > 3 || level < 0 || level > 7)
+            {
+                printf("ionice: class must be 0-3 and level 0-7\n");
+                return -1;
+            }
+            if (class == 3) // idle has no levels
+                level = 0;
+            mods->ioprio_set = 1;
+            mods->ioprio = (class << IOPRIO_CLASS_SHIFT) | level;
+        }
+        else if (strcmp(name, "taskset") == 0)
+        {
+            int is_list = 0;
+            i++;
+            if (argv[i] && strcmp(argv[i], "-c") == 0)
+            {
+                is_list = 1;
+                i++;
+            }
+            if (argv[i] == NULL || parse_cpulist(argv[i], is_list, &mods->cpus) < 0)
+            {
+                printf("taskset: invalid CPU %s\n", is_list ? "list" : "mask");
+                return -1;
+            }
+            mods->affinity_set = 1;
+            i++;
+        }
+        else if (strcmp(name, "timeout") == 0)
+        {
+            i++;
+            while (argv[i] && (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "-s") == 0))
+            {
+                if (argv[i][1] == 'k' && parse_duration(argv[i + 1], &mods->grace) < 0)
+                {
+                    printf("timeout: invalid time interval\n");
+                    return -1;
+                }
+                if (argv[i][1] == 's' && (mods->timeout_sig = parse_signal(argv[i + 1])) <= 0)
+                {
+                    printf("timeout: invalid signal\n");
+                    return -1;
+                }
+                i += 2;
+            }
+            if (parse_duration(argv[i], &mods->timeout) < 0)
+            {
+                printf("timeout: invalid time interval\n");
+                return -1;
+            }
+            i++;
+        }
+        else if (strcmp(name, "env") == 0)
+        {
+            i++;
+            while (argv[i])
+            {
+                if (strcmp(argv[i], "-i") == 0)
+                {
+                    mods->env_clear = 1;
+                    mods->nenv = 0; // Earlier overrides are moot
+                    i++;
+                }
+                else if (mods->nenv == MAXARGS)
+                {
+                    printf("env: too many overrides\n");
+                    return -1;
+                }
+                else if (strcmp(argv[i], "-u") == 0 && argv[i + 1])
+                {
+                    mods->env[mods->nenv++] = argv[i + 1];
+                    i += 2;
+                }
+                else if (strchr(argv[i], '=') && argv[i][0] != '=')
+                    mods->env[mods->nenv++] = argv[i++];
+                else
+                    break;
+            }
+        }
+        else if (strcmp(name, "memo") == 0)
+        {
+            mods->memo = 1;
+            i++;
+        }
+        else if (strcmp(name, "ulimit") == 0)
+        {
+            static const char opts[] = "cdflmnstuv";
+            static const int resources[] = {RLIMIT_CORE, RLIMIT_DATA, RLIMIT_FSIZE, RLIMIT_MEMLOCK,
+                                            RLIMIT_RSS, RLIMIT_NOFILE, RLIMIT_STACK, RLIMIT_CPU,
+                                            RLIMIT_NPROC, RLIMIT_AS};
+            char *opt;
+            i++;
+            while (argv[i] && argv[i][0] == '-' && argv[i][1] && argv[i][2] == '\0' &&
+                   (opt = strchr(opts, argv[i][1])) != NULL)
+            {
+                int k = opt - opts;
+                rlim_t lim;
+
+                if (argv[i + 1] && strcmp(argv[i + 1], "unlimited") == 0)
+                    lim = RLIM_INFINITY;
+                else if (parse_long(argv[i + 1], &val) == 0 && val >= 0)
+                    // Sizes are in 1024-byte blocks; -n, -t, -u are plain counts
+                    lim = strchr("ntu", *opt) ? (rlim_t)val : (rlim_t)val * 1024;
+                else
+                {
+                    printf("ulimit: %s: invalid limit\n", argv[i]);
+                    return -1;
+                }
+                if (mods->nrlimits == MAXRLIMITS)
+                {
+                    printf("ulimit: too many limits\n");
+                    return -1;
+                }
+                mods->rlimit_res[mods->nrlimits] = resources[k];
+                mods->rlimits[mods->nrlimits].rlim_cur = lim;
+                mods->rlimits[mods->nrlimits].rlim_max = lim;
+                mods->nrlimits++;
+                i += 2;
+            }
+        }
+        else
+        {
+            break; // Reached the real command
+        }
+        mods->count++;
+    }
+
+    if (mods->count == 0)
+        return 0;
+    if (argv[i] == NULL)
+    {
+        printf("%s: missing command\n", argv[0]);
+        return -1;
+    }
+
+    // Rotate the real command to the front of argv, one modifier word at
+    // a time (there are few), then put the NULL between them
+    int j, k, n = i;
+    char *word;
+    while (argv[n] != NULL)
+        n++;
+    for (k = 0; k < i; k++)
+    {
+        word = argv[0];
+        memmove(argv, argv + 1, (n - 1) * sizeof(char *));
+        argv[n - 1] = word;
+    }
+    j = n - i;
+    memmove(argv + j + 1, argv + j, i * sizeof(char *));
+    argv[j] = NULL;
+    mods->nwords = i;
+    return mods->count;
+}
+
+/*
+ * freemods - Free the words parsemods moved after the NULL of argv
+ */
+void freemods(char **argv, struct cmdmods_t *mods)
+{
+    int j, k;
+
+    for (j = 0; argv[j] != NULL; j++)
+        ;
+    for (k = 1; k <= mods->nwords; k++)
+        free(argv[j + k]);
+    mods->nwords = 0;
+}
+
+/*
+ * initmods - Reset mods to "no modifiers"
+ */
+void initmods(struct cmdmods_t *mods)
+{
+    memset(mods, 0, sizeof(*mods));
+    mods->grace = -1;
+}
+
+/*
+ * applymods - Apply precommand modifiers in the child, after fork and
+ *    before exec. The timeout modifier is enforced by the parent, and
+ *    childenv lays the env modifier over the environment.
+ */
+void applymods(struct cmdmods_t *mods)
+{
+    int i;
+
+    if (mods->count == 0)
+        return;
+
+    if (mods->nice_set)
+    {
+        errno = 0;
+        int cur = getpriority(PRIO_PROCESS, 0);
+        if ((cur != -1 || errno == 0) && setpriority(PRIO_PROCESS, 0, cur + mods->nice) < 0)
+            perror("nice: cannot set niceness"); // Like nice(1), run anyway
+    }
+
+    if (mods->ioprio_set && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, mods->ioprio) < 0)
+    {
+        perror("ionice: ioprio_set failed");
+        _exit(1);
+    }
+
+    if (mods->affinity_set && sched_setaffinity(0, sizeof(cpu_set_t), &mods->cpus) < 0)
+    {
+        perror("taskset: failed to set affinity");
+        _exit(1);
+    }
+
+    for (i = 0; i < mods->nrlimits; i++)
+    {
+        if (prlimit(0, mods->rlimit_res[i], &mods->rlimits[i], NULL) < 0)
+        {
+            perror("ulimit: error setting limit");
+            _exit(1);
+        }
+    }
+}
+
+/*
+ * parse_signal - Parse a signal number or name ("9", "KILL", "SIGKILL").
+ *    Return the signal number, or -1 if s names no signal.
+ */
+int parse_signal(const char *s)
+{
+    static const struct
+    {
+        const char *name;
+        int sig;
+    } names[] = {{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+                 {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+                 {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}};
+    long val;
+    int i;
+
+    if (s == NULL)
+        return -1;
+    if (parse_long(s, &val) == 0)
+        return (val > 0 && val < NSIG) ? val : -1;
+    if (strncmp(s, "SIG", 3) == 0)
+        s += 3;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (strcmp(s, names[i].name) == 0)
+            return names[i].sig;
+    return -1;
+}
+
+/*
+ * settimeout - Give a newly added job its deadline, from the timeout
+ *    modifier or else the jobtimeout setting, and rearm the timer.
+ *    Call with SIGALRM blocked.
+ */
+void settimeout(struct job_t *job, struct cmdmods_t *mods)
+{
+    double timeout = mods->timeout > 0 ? mods->timeout : jobtimeout;
+
+    if (job == NULL || timeout <= 0)
+        return;
+    job->deadline = monotime() + timeout;
+    job->grace = mods->grace >= 0 ? mods->grace : jobgrace;
+    job->timeout_sig = mods->timeout_sig ? mods->timeout_sig : SIGTERM;
+    timer_rearm();
+}
+
+/*
+ * isbuiltin - Return the kind of builtin command name is in builtins[]:
+ *    BI_SHELL, BI_JOB, or 0 if it is none.
+ */
+int isbuiltin(const char *name)
+{
+    int i;
+
+    for (i = 0; builtins[i].name != NULL; i++)
+        if (strcmp(name, builtins[i].name) == 0)
+            return builtins[i].kind;
+    return 0;
+}
+
+/*
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately. Its exit status is left in last_status.
+ */
+int builtin_cmd(char **argv)
+{
+    last_status = 0; // Builtins succeed unless they say otherwise
+
+    // For quit command
+    if (strcmp(argv[0], "quit") == 0)
+    {
+        exit(0);
+    }
+    // For jobs command
+    else if (strcmp(argv[0], "jobs") == 0)
+    {
+        if (argv[1] != NULL && strcmp(argv[1], "-a") != 0 && strcmp(argv[1], "-d") != 0)
+        {
+            printf("jobs: usage: jobs [-a | -d]\n");
+            last_status = 2;
+            return 1;
+        }
+        if (argv[1] == NULL || strcmp(argv[1], "-a") == 0)
+            listjobs(jobs);
+        if (argv[1] != NULL)
+            listdone(); // -a and -d: the completed jobs too, or only them
+        return 1;
+    }
+    // For bg and fg commands
+    else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0)
+    {
+        do_bgfg(argv);
+        return 1;
+    }
+    // For wait command
+    else if (strcmp(argv[0], "wait") == 0)
+    {
+        last_status = do_wait(argv);
+        return 1;
+    }
+    // For set command
+    else if (strcmp(argv[0], "set") == 0)
+    {
+        do_set(argv);
+        return 1;
+    }
+    // For echo command
+    else if (strcmp(argv[0], "echo") == 0)
+    {
+        do_echo(argv);
+        return 1;
+    }
+    // For export and unset commands
+    else if (strcmp(argv[0], "export") == 0)
+    {
+        do_export(argv);
+        return 1;
+    }
+    else if (strcmp(argv[0], "unset") == 0)
+    {
+        do_unset(argv);
+        return 1;
+    }
+    // For history command
+    else if (strcmp(argv[0], "history") == 0)
+    {
+        do_history(argv);
+        return 1;
+    }
+    // For joblog command
+    else if (strcmp(argv[0], "joblog") == 0)
+    {
+        do_joblog(argv);
+        return 1;
+    }
+    return 0; // Not a built-in command
+}
+
+/*
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+void do_bgfg(char **argv)
+{
+    struct job_t *job;  // Pointer to the job structure
+    char *id = argv[1]; // The job ID or process ID argument
+    int jid;            // Job ID
+    pid_t pid;          // Process ID
+
+    // Check if the argument is provided
+    if (id == NULL)
+    {
+        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+
+    // Check if the argument is a job ID (starts with '%')
+    if (id[0] == '%')
+    {
+        jid = atoi(&id[1]);         // Convert job ID string to integer
+        job = getjobjid(jobs, jid); // Get the job structure by job ID
+        if (job == NULL)
+        {
+            printf("%s: No such job\n", id);
+            last_status = 1;
+            return;
+        }
+        pid = job->pid; // Get the process ID from the job structure
+    }
+    // Check if the argument is a process ID (a digit)
+    else if (isdigit(id[0]))
+    {
+        pid = atoi(id);             // Convert process ID string to integer
+        job = getjobpid(jobs, pid); // Get the job structure by process ID
+        if (job == NULL)
+        {
+            printf("(%d): No such process\n", pid);
+            last_status = 1;
+            return;
+        }
+    }
+    // Invalid argument format
+    else
+    {
+        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
+        last_status = 1;
+        return;
+    }
+
+    // Send the SIGCONT signal to the job's process group
+    if (signaljob(job, SIGCONT) < 0)
+        unix_error("kill (SIGCONT) error");
+
+    // If the command is 'fg', bring the job to the foreground
+    if (strcmp(argv[0], "fg") == 0)
+    {
+        job->state = FG;  // Set job state to foreground
+        waitfg(job->pid); // Wait for the job to finish
+    }
+    // If the command is 'bg', resume the job in the background
+    else if (strcmp(argv[0], "bg") == 0)
+    {
+        job->state = BG;                                          // Set job state to background
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline); // Print job details
+    }
+}
+
+/*
+ * do_echo - Execute the builtin echo command: print the arguments
+ *    separated by spaces. -n suppresses the trailing newline, and -e
+ *    expands the escapes \n, \t and \\; any other backslash is printed.
+ */
+void do_echo(char **argv)
+{
+    int i = 1, newline = 1, escapes = 0;
+
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1] && strspn(argv[i] + 1, "ne") == strlen(argv[i] + 1); i++)
+    {
+        if (strchr(argv[i], 'n'))
+            newline = 0;
+        if (strchr(argv[i], 'e'))
+            escapes = 1;
+    }
+
+    for (int first = i; argv[i] != NULL; i++)
+    {
+        char *p;
+
+        if (i > first)
+            putchar(' ');
+        for (p = argv[i]; *p; p++)
+        {
+            if (escapes && p[0] == '\\' && p[1] && strchr("nt\\", p[1]))
+            {
+                p++;
+                putchar(*p == 'n' ? '\n' : *p == 't' ? '\t' : *p);
+            }
+            else
+                putchar(*p);
+        }
+    }
+    if (newline)
+        putchar('\n');
+}
+
+/*
+ * do_set - Execute the builtin set command: "set" lists the shell
+ *    settings, "set NAME VALUE" changes one.
+ *
+ *    jobtimeout  deadline applied to every job without its own timeout
+ *    jobgrace    delay between the timeout signal and SIGKILL
+ *    joblog      on: background jobs write to logs read with joblog
+ *    joblogsize  bytes of each log kept in memory before spilling to a file
+ *    joblogmem   most memory for all the logs
+ *    zygote      on: commands are started by the spawn helper
+ *    memodir     directory of the result cache of memo
+ *    memosize    bytes it keeps, evicting the least recently used
+ *    memoenv     names of the variables that are part of a memo key
+ */
+void do_set(char **argv)
+{
+    double val;
+
+    if (argv[1] == NULL)
+    {
+        printf("jobtimeout %gs\n", jobtimeout);
+        printf("jobgrace %gs\n", jobgrace);
+        printf("joblog %s\n", joblog ? "on" : "off");
+        printf("joblogsize %ld\n", joblogsize);
+        printf("joblogmem %ld\n", joblogmem);
+        printf("zygote %s\n", !zygote ? "off" : zygotefd < 0 ? "on (no helper)" : "on");
+        printf("memodir %s\n", memo_path());
+        printf("memosize %ld\n", memosize);
+        printf("memoenv %s\n", memoenv);
+        return;
+    }
+
+    if (strcmp(argv[1], "jobtimeout") == 0 || strcmp(argv[1], "jobgrace") == 0)
+    {
+        if (argv[2] && strcmp(argv[2], "off") == 0)
+            val = 0;
+        else if (parse_duration(argv[2], &val) < 0)
+        {
+            printf("set: %s: invalid time interval\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        if (argv[1][3] == 't')
+            jobtimeout = val;
+        else
+            jobgrace = val;
+    }
+    else if (strcmp(argv[1], "joblog") == 0 || strcmp(argv[1], "zygote") == 0)
+    {
+        if (argv[2] && (strcmp(argv[2], "on") == 0 || strcmp(argv[2], "off") == 0))
+        {
+            if (argv[1][0] == 'j')
+                joblog = argv[2][1] == 'n';
+            else
+                zygote = argv[2][1] == 'n';
+        }
+        else
+        {
+            printf("set: %s: on or off\n", argv[1]);
+            last_status = 1;
+        }
+    }
+    else if (strcmp(argv[1], "joblogsize") == 0 || strcmp(argv[1], "joblogmem") == 0)
+    {
+        long bytes;
+
+        if (parse_size(argv[2], &bytes) < 0 || bytes <= 0)
+        {
+            printf("set: %s: invalid size\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        if (argv[1][6] == 's')
+            joblogsize = bytes;
+        else
+            joblogmem = bytes;
+    }
+    else if (strcmp(argv[1], "memosize") == 0)
+    {
+        long bytes;
+
+        if (parse_size(argv[2], &bytes) < 0 || bytes <= 0)
+        {
+            printf("set: %s: invalid size\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        memosize = bytes;
+    }
+    else if (strcmp(argv[1], "memodir") == 0 && argv[2] != NULL)
+    {
+        free(memodir);
+        memodir = strdup(argv[2]);
+    }
+    else if (strcmp(argv[1], "memoenv") == 0)
+    {
+        char *p = memoenv;
+        int i;
+
+        *p = '\0';
+        for (i = 2; argv[i] != NULL && p + strlen(argv[i]) + 1 < memoenv + sizeof(memoenv); i++)
+            p += sprintf(p, "%s%s", i > 2 ? " " : "", argv[i]);
+    }
+    else
+    {
+        printf("set: %s: unknown setting\n", argv[1]);
+        last_status = 1;
+    }
+}
+
+/*
+ * do_wait - Execute the builtin wait command and return its status
+ *
+ *    wait             block until no background job is running
+ *    wait -n          block until the next background job terminates
+ *    wait %jid|PID..  block until each job terminates (or stops)
+ *
+ * A named job that has already completed gives its status from the
+ * ring of completed jobs (see donejob) rather than "No such job".
+ *
+ * Like waitfg, the shell sleeps in sigsuspend: sigchld_handler stores
+ * the awaited status in wait_status, so waiting costs nothing. Ctrl-c
+ * interrupts the wait with status 130.
+ */
+int do_wait(char **argv)
+{
+    sigset_t mask, prev;
+    struct job_t *job;
+    int i, status = 0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    sigint_seen = 0;
+
+    if (argv[1] == NULL) // Wait for every running background job
+    {
+        for (i = 0; i < MAXJOBS && !sigint_seen;)
+        {
+            if (jobs[i].state == BG)
+                sigsuspend(&prev);
+            else
+                i++;
+        }
+    }
+    else if (strcmp(argv[1], "-n") == 0) // Wait for any one of them
+    {
+        for (i = 0; i < MAXJOBS; i++)
+            if (jobs[i].state == BG)
+                break;
+        if (i == MAXJOBS)
+            status = 127; // Nothing to wait for
+        else
+        {
+            wait_target = -1;
+            while (wait_target == -1 && !sigint_seen)
+                sigsuspend(&prev);
+            status = wait_status;
+        }
+    }
+    else // Wait for the named jobs in turn
+    {
+        for (i = 1; argv[i] != NULL && !sigint_seen; i++)
+        {
+            struct donejob_t *done;
+            long val = 0;
+            int jid = 0;
+
+            if (argv[i][0] == '%')
+                job = getjobjid(jobs, jid = atoi(&argv[i][1]));
+            else if (parse_long(argv[i], &val) == 0)
+                job = getjobpid(jobs, val);
+            else
+            {
+                printf("wait: %s: argument must be a PID or %%jobid\n", argv[i]);
+                status = 2;
+                continue;
+            }
+            if (job == NULL && (done = getdone(jid, val)) != NULL)
+            {
+                status = done->status; // Completed before the wait
+                continue;
+            }
+            if (job == NULL)
+            {
+                printf("%s: No such job\n", argv[i]);
+                status = 127;
+                continue;
+            }
+            wait_target = job->pid;
+            while (wait_target != 0 && job->state != ST && !sigint_seen)
+                sigsuspend(&prev);
+            status = wait_target == 0 ? wait_status : 128 + SIGTSTP;
+        }
+    }
+
+    wait_target = 0;
+    if (sigint_seen)
+        status = 128 + SIGINT;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return status;
+}
+
+/*
+ * waitfg - Block until process pid is no longer the foreground process
+ *
+ * The shell sleeps in sigsuspend, so it wakes only when a SIGCHLD (or a
+ * SIGALRM for a job deadline) arrives instead of polling the job list.
+ * The job's status (see sigchld_handler) is left in last_status.
+ */
+void waitfg(pid_t pid)
+{
+    sigset_t mask, prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    // A subshell has no terminal to hand back: it waits for the job to end
+    while (job_control ? pid == fgpid(jobs) : getjobpid(jobs, pid) != NULL)
+    {
+        sigsuspend(&prev); // Wait for the job list to change
+    }
+
+    last_status = fg_status;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/******************
+ * Shell variables
+ ******************/
+
+/* namelen - Return the length of the variable name that starts s, 0 if none */
+size_t namelen(const char *s)
+{
+    size_t len = 0;
+
+    if (!isalpha((unsigned char)*s) && *s != '_')
+        return 0;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_')
+        len++;
+    return len;
+}
+
+/* varbucket - Return the hash chain for the len bytes of a variable name */
+struct var_t **varbucket(const char *name, size_t len)
+{
+    unsigned h = 2166136261u; // FNV-1a
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return &vartab[h % VARBUCKETS];
+}
+
+/* findvar - Find the shell variable named by the len bytes at name */
+struct var_t *findvar(const char *name, size_t len)
+{
+    struct var_t *v;
+
+    for (v = *varbucket(name, len); v != NULL; v = v->next)
+        if (strncmp(v->entry, name, len) == 0 && (v->entry[len] == '=' || v->entry[len] == '\0'))
+            return v;
+    return NULL;
+}
+
+/* getvar - Return the value of a shell variable, NULL if it is not set */
+char *getvar(const char *name, size_t len)
+{
+    struct var_t *v = findvar(name, len);
+
+    return v && v->entry[len] == '=' ? v->entry + len + 1 : NULL;
+}
+
+/*
+ * setvar - Set a shell variable from an assignment, NAME=VALUE, or just
+ *    mark it (NAME) for export. It is exported if export is set or it
+ *    already was. A change to an exported variable means the cached
+ *    environment is rebuilt before the next command runs.
+ */
+void setvar(const char *entry, int export)
+{
+    size_t len = namelen(entry);
+    struct var_t *v = findvar(entry, len);
+
+    if (v == NULL)
+    {
+        struct var_t **bucket = varbucket(entry, len);
+
+        v = calloc(1, sizeof(*v));
+        v->entry = strdup(entry);
+        v->next = *bucket;
+        *bucket = v;
+    }
+    else if (entry[len] == '=')
+    {
+        free(v->entry);
+        v->entry = strdup(entry);
+    }
+    if (export)
+        v->exported = 1;
+    if (v->exported)
+        envdirty = 1;
+}
+
+/* unsetvar - Remove a shell variable, and from the environment if exported */
+void unsetvar(const char *name)
+{
+    size_t len = strlen(name);
+    struct var_t **pv, *v = findvar(name, len);
+
+    if (v == NULL)
+        return;
+    for (pv = varbucket(name, len); *pv != v; pv = &(*pv)->next)
+        ;
+    *pv = v->next;
+    if (v->exported)
+        envdirty = 1;
+    free(v->entry);
+    free(v);
+}
+
+/*
+ * buildenv - Return the environment for commands: the exported
+ *    variables, kept in envbuf after ENVSPARE free slots (for variables
+ *    a single command adds) and rebuilt only after an export changes.
+ */
+char **buildenv(void)
+{
+    struct var_t *v;
+    int i;
+
+    if (!envdirty)
+        return envbuf + ENVSPARE;
+
+    envlen = 0;
+    for (i = 0; i < VARBUCKETS; i++)
+        for (v = vartab[i]; v != NULL; v = v->next)
+        {
+            if (!v->exported || strchr(v->entry, '=') == NULL)
+                continue;
+            if (ENVSPARE + envlen + 1 >= envcap)
+            {
+                envcap = envcap ? 2 * envcap : ENVSPARE + 256;
+                envbuf = realloc(envbuf, envcap * sizeof(char *));
+            }
+            v->envidx = ENVSPARE + envlen;
+            envbuf[ENVSPARE + envlen++] = v->entry;
+        }
+    if (envbuf == NULL)
+        envbuf = malloc((envcap = ENVSPARE + 1) * sizeof(char *));
+    envbuf[ENVSPARE + envlen] = NULL;
+    envdirty = 0;
+    return envbuf + ENVSPARE;
+}
+
+/*
+ * childenv - In a child about to exec, lay a command's own settings over
+ *    the cached environment: its prefix assignments (NAME=VALUE), then
+ *    those of an env modifier. Only the slots that change are written
+ *    (so fork's copy-on-write copies only their pages), a new name goes
+ *    in a free slot before the others, and an unset name is replaced
+ *    by the last entry. With nothing to change this costs nothing.
+ *    Return the envp to pass to exec.
+ */
+char **childenv(char **assigns, int nassign, struct cmdmods_t *mods)
+{
+    int b = ENVSPARE, e, added; // Entries are envbuf[b..e), the ones added [b..added)
+    int i, j, k, first = 0, total = nassign + mods->nenv;
+
+    buildenv();
+    e = ENVSPARE + envlen;
+    added = ENVSPARE;
+    if (mods->env_clear)
+        first = nassign, b = added = e; // env -i: the assignments go too
+    if (first == total)
+        return envbuf + b;
+
+    for (k = first; k < total; k++)
+    {
+        const char *entry = k < nassign ? assigns[k] : mods->env[k - nassign];
+        size_t len = strcspn(entry, "="); // env accepts any NAME
+        struct var_t *v = findvar(entry, len);
+
+        // Find the name's slot: from the variable table, else among those added
+        i = -1;
+        if (v && v->exported && v->envidx >= added && v->envidx < e && envbuf[v->envidx] == v->entry)
+            i = v->envidx;
+        for (j = b; i < 0 && j < added; j++)
+            if (strncmp(envbuf[j], entry, len) == 0 && envbuf[j][len] == '=')
+                i = j;
+
+        if (entry[len] == '=' && i >= 0)
+        {
+            envbuf[i] = (char *)entry;
+            if (v && i >= added)
+                v->entry = envbuf[i]; // Only this child's copy, to find it again
+        }
+        else if (entry[len] == '=' && b > 0)
+            envbuf[--b] = (char *)entry;
+        else if (entry[len] == '=')
+            fprintf(stderr, "%.*s: too many environment overrides\n", (int)len, entry);
+        else if (i >= 0)
+        {
+            // Unset: move the last entry into its slot
+            envbuf[i] = envbuf[--e];
+            envbuf[e] = NULL;
+            if (e < added)
+                added = e;
+            else if (i != e && (v = findvar(envbuf[i], strcspn(envbuf[i], "="))) != NULL && v->entry == envbuf[i])
+                v->envidx = i;
+        }
+    }
+    return envbuf + b;
+}
+
+/* assignments - Count the NAME=VALUE words that start an argument list */
+int assignments(char **argv)
+{
+    int n = 0;
+
+    while (argv[n] && namelen(argv[n]) > 0 && argv[n][namelen(argv[n])] == '=')
+        n++;
+    return n;
+}
+
+/*
+ * do_export - Execute the builtin export command
+ *        export [NAME[=VALUE] ...]
+ *    With no names, list the exported variables.
+ */
+void do_export(char **argv)
+{
+    char **env;
+    int i, n;
+
+    if (argv[1] == NULL)
+    {
+        env = buildenv();
+        for (n = 0; env[n]; n++)
+            ;
+        char **sorted = malloc((n + 1) * sizeof(char *));
+        memcpy(sorted, env, (n + 1) * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), cmpstr);
+        for (i = 0; i < n; i++)
+            printf("export %s\n", sorted[i]);
+        free(sorted);
+        return;
+    }
+
+    for (i = 1; argv[i]; i++)
+    {
+        size_t len = namelen(argv[i]);
+        if (len == 0 || (argv[i][len] != '=' && argv[i][len] != '\0'))
+        {
+            printf("export: `%s': not a valid identifier\n", argv[i]);
+            last_status = 1;
+            continue;
+        }
+        setvar(argv[i], 1);
+    }
+}
+
+/* do_unset - Execute the builtin unset command: unset NAME ... */
+void do_unset(char **argv)
+{
+    int i;
+
+    for (i = 1; argv[i]; i++)
+    {
+        size_t len = namelen(argv[i]);
+        if (len == 0 || argv[i][len] != '\0')
+        {
+            printf("unset: `%s': not a valid identifier\n", argv[i]);
+            last_status = 1;
+            continue;
+        }
+        unsetvar(argv[i]);
+    }
+}
+
+/**********
+ * History
+ **********/
+
+/*
+ * histopen - Open the history: $HISTFILE, or ~/.tsh_history when the
+ *    shell is interactive. Lines are appended to it with O_APPEND, and
+ *    the offset of each to an index file beside it (HISTFILE.idx), so
+ *    several shells can share one history. An index missing or behind
+ *    its log (say, from before a crash) is rebuilt from the log.
+ */
+void histopen(void)
+{
+    char path[MAXLINE], *file = getvar("HISTFILE", 8), *home = getvar("HOME", 4);
+    const char *last;
+    size_t len;
+
+    if (file && *file)
+        snprintf(path, sizeof(path) - 4, "%s", file);
+    else if (isatty(STDIN_FILENO) && home)
+        snprintf(path, sizeof(path) - 4, "%s/.tsh_history", home);
+    else
+        return; // No history
+    if ((histlogfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+    {
+        printf("history: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    strcat(path, ".idx");
+    if ((histidxfd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0)
+    {
+        printf("history: %s: %s\n", path, strerror(errno));
+        close(histlogfd);
+        histlogfd = -1;
+        return;
+    }
+
+    flock(histidxfd, LOCK_EX);
+    histheld++; // Held already, and exclusively
+    histmap();
+    last = histentry(histcount, &len);
+    if (histloglen > 0 && (last == NULL || last + len + 1 < histlog + histloglen) && ftruncate(histidxfd, 0) == 0)
+    {
+        // Index every line of the log again, a batch of offsets per write
+        uint64_t offs[1024];
+        const char *p, *nl, *end = histlog + histloglen;
+        int k = 0;
+
+        for (p = histlog; p < end; p = nl ? nl + 1 : end)
+        {
+            offs[k++] = p - histlog;
+            nl = memchr(p, '\n', end - p);
+            if (k == 1024 || !nl || nl + 1 == end)
+            {
+                if (write(histidxfd, offs, k * sizeof(uint64_t)) < 0)
+                    break;
+                k = 0;
+            }
+        }
+        histmap();
+    }
+    histheld--;
+    flock(histidxfd, LOCK_UN);
+}
+
+/*
+ * histmap - Map the history log and its index, again only if they have
+ *    grown since they were last mapped. The maps are of the files, so
+ *    the shell's memory stays the same however long they get. Return
+ *    the number of entries, or -1 with no history.
+ */
+long histmap(void)
+{
+    struct stat lst, ist;
+
+    if (histlogfd < 0 || fstat(histlogfd, &lst) < 0 || fstat(histidxfd, &ist) < 0)
+        return -1;
+    if ((size_t)lst.st_size != histloglen)
+    {
+        if (histlog != NULL)
+            munmap((void *)histlog, histloglen);
+        histlog = NULL;
+        histloglen = lst.st_size;
+        if (histloglen > 0 && (histlog = mmap(NULL, histloglen, PROT_READ, MAP_SHARED, histlogfd, 0)) == MAP_FAILED)
+            histlog = NULL, histloglen = 0;
+    }
+    if ((size_t)ist.st_size / sizeof(uint64_t) != (size_t)histcount)
+    {
+        if (histidx != NULL)
+            munmap((void *)histidx, histcount * sizeof(uint64_t));
+        histidx = NULL;
+        histcount = ist.st_size / sizeof(uint64_t);
+        if (histcount > 0 &&
+            (histidx = mmap(NULL, histcount * sizeof(uint64_t), PROT_READ, MAP_SHARED, histidxfd, 0)) == MAP_FAILED)
+            histidx = NULL, histcount = 0;
+    }
+    return histcount;
+}
+
+/*
+ * histhold - Hold the index's lock shared while reading its map, so that
+ *    another shell rebuilding the index (see histopen) cannot truncate
+ *    it under the map, and map it again as it is now. Holds nest, and
+ *    histrelease drops one; readers of many entries hold around them.
+ */
+void histhold(void)
+{
+    if (histidxfd >= 0 && histheld++ == 0)
+    {
+        flock(histidxfd, LOCK_SH);
+        histmap();
+    }
+}
+
+/* histrelease - Drop a hold taken by histhold */
+void histrelease(void)
+{
+    if (histidxfd >= 0 && --histheld == 0)
+        flock(histidxfd, LOCK_UN);
+}
+
+/*
+ * histentry - Return history entry n (from 1) and its length, without
+ *    the newline, or NULL if there is no such entry. The log is only
+ *    ever appended to, so the entry stays readable after the index is
+ *    released.
+ */
+const char *histentry(long n, size_t *len)
+{
+    const char *p, *nl;
+    uint64_t off;
+
+    histhold();
+    off = n < 1 || n > histcount ? histloglen : histidx[n - 1];
+    histrelease();
+    if (off >= histloglen)
+        return NULL;
+    p = histlog + off;
+    nl = memchr(p, '\n', histlog + histloglen - p);
+    *len = nl ? (size_t)(nl - p) : (size_t)(histlog + histloglen - p);
+    return p;
+}
+
+/*
+ * histfind - Return the number of the newest entry before entry before
+ *    that starts with text (prefix set) or contains it, or 0 if none.
+ */
+long histfind(const char *text, long before, int prefix)
+{
+    size_t tlen = strlen(text), len;
+    const char *e;
+    long n;
+
+    histhold();
+    for (n = before - 1; n >= 1; n--)
+        if ((e = histentry(n, &len)) != NULL &&
+            (prefix ? len >= tlen && memcmp(e, text, tlen) == 0 : memmem(e, len, text, tlen) != NULL))
+            break;
+    histrelease();
+    return n > 0 ? n : 0;
+}
+
+/*
+ * histadd - Append a command line to the history: one write to the log,
+ *    then one of its offset to the index, both under the index's lock
+ *    so that concurrent shells number their lines the same way.
+ */
+void histadd(const char *cmdline)
+{
+    size_t len = strlen(cmdline);
+    uint64_t off;
+    off_t end;
+
+    if (histlogfd < 0 || strspn(cmdline, " \t\n") == len)
+        return;
+    flock(histidxfd, LOCK_EX);
+    if (write(histlogfd, cmdline, len) == (ssize_t)len && (end = lseek(histlogfd, 0, SEEK_CUR)) >= (off_t)len)
+    {
+        off = end - len;
+        if (write(histidxfd, &off, sizeof(off)) != sizeof(off))
+            printf("history: cannot write index: %s\n", strerror(errno));
+    }
+    flock(histidxfd, LOCK_UN);
+}
+
+/*
+ * histexpand - Replace the history references in a command line that
+ *    are outside single quotes: !! (the last line), !n, !-n (n lines
+ *    back) and !prefix (the last line starting with prefix). Print the
+ *    line if it changed. Return 0, or -1 after printing an error.
+ */
+int histexpand(char *cmdline)
+{
+    char out[MAXLINE], word[MAXLINE];
+    const char *p, *e;
+    size_t len, olen = 0;
+    char quote = 0;
+    int changed = 0;
+    long n;
+
+    if (strchr(cmdline, '!') == NULL || histmap() < 0)
+        return 0;
+
+    for (p = cmdline; *p; p++)
+    {
+        if (quote != '\'' && *p == '!' && p[1] && !strchr(" \t\n=()'\";&|<>", p[1]))
+        {
+            const char *ref = p++;
+            if (*p == '!')
+                n = histcount, p++;
+            else if (isdigit((unsigned char)*p) || (*p == '-' && isdigit((unsigned char)p[1])))
+            {
+                n = strtol(p, (char **)&p, 10);
+                n = n < 0 ? histcount + 1 + n : n;
+            }
+            else
+            {
+                len = strcspn(p, " \t\n;&|<>()'\"");
+                sprintf(word, "%.*s", (int)len, p);
+                n = histfind(word, histcount + 1, 1);
+                p += len;
+            }
+            if ((e = histentry(n, &len)) == NULL)
+            {
+                printf("%.*s: event not found\n", (int)(p - ref), ref);
+                return -1;
+            }
+            if (olen + len >= MAXLINE - 1)
+            {
+                printf("history: expanded line too long\n");
+                return -1;
+            }
+            memcpy(out + olen, e, len);
+            olen += len;
+            changed = 1;
+            p--;
+            continue;
+        }
+        if (quote == *p)
+            quote = 0;
+        else if (!quote && (*p == '\'' || *p == '"'))
+            quote = *p;
+        if (olen >= MAXLINE - 1)
+        {
+            printf("history: expanded line too long\n");
+            return -1;
+        }
+        out[olen++] = *p;
+    }
+    out[olen] = '\0';
+    if (changed)
+    {
+        strcpy(cmdline, out);
+        printf("%s", cmdline);
+    }
+    return 0;
+}
+
+/*
+ * do_history - Execute the builtin history command
+ *        history [N]        list the history, or its last N lines
+ *        history -r TEXT    list the lines containing TEXT, newest first
+ */
+void do_history(char **argv)
+{
+    const char *e;
+    size_t len;
+    long n, first = 1;
+
+    if (histmap() < 0)
+    {
+        printf("history: no history (set HISTFILE)\n");
+        last_status = 1;
+        return;
+    }
+
+    if (argv[1] && strcmp(argv[1], "-r") == 0)
+    {
+        if (argv[2] == NULL)
+        {
+            printf("history: -r: missing text\n");
+            last_status = 1;
+            return;
+        }
+        for (n = histcount + 1; (n = histfind(argv[2], n, 0)) > 0;)
+            if ((e = histentry(n, &len)) != NULL)
+                printf("%5ld  %.*s\n", n, (int)len, e);
+        return;
+    }
+
+    if (argv[1])
+    {
+        if (parse_long(argv[1], &n) < 0 || n < 0)
+        {
+            printf("history: %s: numeric argument required\n", argv[1]);
+            last_status = 1;
+            return;
+        }
+        first = histcount - n + 1;
+    }
+    for (n = first < 1 ? 1 : first; n <= histcount; n++) // Not held while printing
+        if ((e = histentry(n, &len)) != NULL)
+            printf("%5ld  %.*s\n", n, (int)len, e);
+}
+
+/**************
+ * Line editor
+ **************/
+
+/*
+ * readcmdline - Read a line of input into buf (MAXLINE bytes), with the
+ *    line editor when the shell is interactive, else with fgets after
+ *    printing prompt if prompts are on. Return NULL at end of file.
+ */
+char *readcmdline(char *buf, const char *prompt)
+{
+    int kind = strcmp(prompt, "> ") == 0 ? 'C' : 'L'; // Continuation or command line
+
+    if (lineedit)
+    {
+        if (editline(prompt, buf) < 0)
+            return NULL;
+        record(kind, buf, strlen(buf));
+        return buf;
+    }
+
+    if (emit_prompt)
+    {
+        printf("%s", prompt);
+        fflush(stdout);
+    }
+    if ((fgets(buf, MAXLINE, input) == NULL) && ferror(input))
+        app_error("fgets error");
+    if (feof(input))
+        return NULL;
+    record(kind, buf, strlen(buf));
+    return buf;
+}
+
+/* rawmode - Put the terminal in raw mode for editing, or (on = 0) back */
+void rawmode(int on)
+{
+    static struct termios cooked;
+    static int saved = 0;
+    struct termios raw;
+
+    if (on)
+    {
+        if (tcgetattr(STDIN_FILENO, &cooked) < 0)
+            return;
+        if (!saved)
+            atexit(cookedmode); // Never leave the terminal raw
+        saved = 1;
+        raw = cooked;
+        raw.c_iflag &= ~(ICRNL | IXON);
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN); // ctrl-c and ctrl-z come as keys
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    }
+    else if (saved)
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+}
+
+/* cookedmode - Restore the terminal, at exit */
+void cookedmode(void)
+{
+    rawmode(0);
+}
+
+/*
+ * refresh - Redraw the line being edited after prompt, scrolled
+ *    sideways so that the cursor (at pos) stays within the terminal.
+ */
+void refresh(const char *prompt, const char *buf, size_t len, size_t pos)
+{
+    char out[2 * MAXLINE];
+    struct winsize ws;
+    size_t cols = 80, plen = strlen(prompt), avail, off = 0, n;
+    int k;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        cols = ws.ws_col;
+    avail = cols > plen + 1 ? cols - plen - 1 : 1;
+    if (pos >= avail)
+        off = pos - avail + 1;
+    n = len - off < avail ? len - off : avail;
+    k = snprintf(out, sizeof(out), "\r%s%.*s\x1b[K", prompt, (int)n, buf + off);
+    if (off + n > pos)
+        k += snprintf(out + k, sizeof(out) - k, "\x1b[%dD", (int)(off + n - pos));
+    if (write(STDOUT_FILENO, out, k) < 0)
+        return;
+}
+
+/*
+ * trieadd - Add a command name to the trie of commands on PATH. Each
+ *    node keeps its children in order and the number of names below it.
+ */
+void trieadd(const char *name)
+{
+    int n = 0, *link, k;
+    const char *p;
+
+    for (p = name; *p; p++)
+    {
+        for (link = &trie[n].child; *link && trie[*link].c < *p; link = &trie[*link].sibling)
+            ;
+        if (*link == 0 || trie[*link].c != *p)
+        {
+            if (ntrie == triecap)
+            {
+                triecap = triecap ? 2 * triecap : 4096;
+                trie = realloc(trie, triecap * sizeof(*trie));
+                for (link = &trie[n].child; *link && trie[*link].c < *p; link = &trie[*link].sibling)
+                    ; // realloc moved it
+            }
+            k = ntrie++;
+            memset(&trie[k], 0, sizeof(trie[k]));
+            trie[k].c = *p;
+            trie[k].sibling = *link;
+            *link = k;
+        }
+        n = *link;
+    }
+    if (trie[n].end)
+        return; // Already there, from an earlier PATH directory
+
+    trie[n].end = 1;
+    for (n = 0, p = name;; p++)
+    {
+        trie[n].count++;
+        if (*p == '\0')
+            break;
+        for (n = trie[n].child; trie[n].c != *p; n = trie[n].sibling)
+            ;
+    }
+}
+
+/*
+ * triefresh - Make sure the trie holds the builtins and the executables
+ *    in the directories on PATH: rebuild it if PATH has changed or the
+ *    mtime of one of its directories has, else leave it be.
+ */
+void triefresh(void)
+{
+    char *path = getvar("PATH", 4), dir[MAXLINE], file[2 * MAXLINE];
+    const char *p, *colon;
+    struct stat st;
+    int i, ndirs = 0, stale = trie == NULL || strcmp(triepath, path ? path : "") != 0;
+
+    if (path == NULL)
+        path = "";
+    for (p = path; !stale && *p; p = *colon ? colon + 1 : colon)
+    {
+        colon = p + strcspn(p, ":");
+        snprintf(dir, sizeof(dir), "%.*s", (int)(colon - p), p);
+        if (ndirs == MAXPATHDIRS || stat(*dir ? dir : ".", &st) < 0 ||
+            st.st_mtim.tv_sec != triemtimes[ndirs].tv_sec || st.st_mtim.tv_nsec != triemtimes[ndirs].tv_nsec)
+            stale = 1;
+        ndirs++;
+    }
+    if (!stale)
+        return;
+
+    if (trie == NULL)
+    {
+        triecap = 4096;
+        trie = malloc(triecap * sizeof(*trie));
+    }
+    ntrie = 1;
+    memset(&trie[0], 0, sizeof(trie[0]));
+    for (i = 0; builtins[i].name != NULL; i++)
+        trieadd(builtins[i].name);
+
+    snprintf(triepath, sizeof(triepath), "%s", path);
+    for (ndirs = 0, p = path; *p && ndirs < MAXPATHDIRS; p = *colon ? colon + 1 : colon, ndirs++)
+    {
+        colon = p + strcspn(p, ":");
+        snprintf(dir, sizeof(dir), "%.*s", (int)(colon - p), p);
+        struct dirlist_t *dl = readdirlist(dir);
+        memset(&triemtimes[ndirs], 0, sizeof(triemtimes[ndirs]));
+        if (dl == NULL)
+            continue;
+        triemtimes[ndirs] = dl->mtime;
+        for (i = 0; i < dl->count; i++)
+        {
+            const char *name = dl->names + dl->offs[i];
+            if (dl->types[i] == DT_DIR)
+                continue;
+            snprintf(file, sizeof(file), "%s/%s", *dir ? dir : ".", name);
+            if (access(file, X_OK) == 0 && (dl->types[i] == DT_REG || (stat(file, &st) == 0 && S_ISREG(st.st_mode))))
+                trieadd(name);
+        }
+    }
+}
+
+/*
+ * triecollect - Add the names in the subtree of node n to args, with
+ *    prefix (len bytes, room for MAXLINE) in front, at most max of them.
+ */
+void triecollect(int n, char *prefix, size_t len, struct arglist_t *args, int max)
+{
+    int k;
+
+    if (trie[n].end && args->argc < max)
+    {
+        prefix[len] = '\0';
+        addarg(args, prefix);
+    }
+    for (k = trie[n].child; k && args->argc < max && len + 1 < MAXLINE; k = trie[k].sibling)
+    {
+        prefix[len] = trie[k].c;
+        triecollect(k, prefix, len + 1, args, max);
+    }
+}
+
+/*
+ * complete - Complete the word before the cursor: a command name from
+ *    the trie in command position, a job spec (%1) after a %, else a
+ *    file name. A single match is inserted whole; several are extended
+ *    to their longest common prefix, or listed if that adds nothing.
+ *    Return the number of bytes inserted into buf at *pos.
+ */
+int complete(char *buf, size_t *len, size_t *pos)
+{
+    struct arglist_t args = {NULL, 0, 0};
+    char word[MAXLINE], lcp[MAXLINE];
+    size_t ws = *pos, wlen, n = 0, k;
+    int i, total = 0, node = -1;
+    const char *p;
+
+    while (ws > 0 && !strchr(" \t;&|()<>", buf[ws - 1]))
+        ws--;
+    wlen = *pos - ws;
+    memcpy(word, buf + ws, wlen);
+    word[wlen] = '\0';
+    for (p = buf + ws; p > buf && (p[-1] == ' ' || p[-1] == '\t'); p--)
+        ;
+    int command = p == buf || strchr(";&|(", p[-1]) != NULL;
+
+    if (word[0] == '%')
+    {
+        char spec[32];
+        for (i = 0; i < MAXJOBS; i++)
+            if (jobs[i].jid > 0 && snprintf(spec, sizeof(spec), "%%%d", jobs[i].jid) > 0 &&
+                strncmp(spec, word, wlen) == 0)
+                addarg(&args, spec);
+        total = args.argc;
+    }
+    else if (command && strchr(word, '/') == NULL)
+    {
+        triefresh();
+        for (node = 0, p = word; node >= 0 && *p; p++)
+        {
+            for (node = trie[node].child; node && trie[node].c != *p; node = trie[node].sibling)
+                ;
+            node = node ? node : -1;
+        }
+        if (node >= 0)
+        {
+            total = trie[node].count;
+            // Longest common prefix: follow the only child down
+            strcpy(lcp, word);
+            n = wlen;
+            for (k = node; !trie[k].end && trie[k].child && !trie[trie[k].child].sibling && n + 1 < MAXLINE;)
+            {
+                k = trie[k].child;
+                lcp[n++] = trie[k].c;
+            }
+            lcp[n] = '\0';
+            if (total == 1)
+                addarg(&args, lcp);
+        }
+    }
+    else
+    {
+        const char *slash = strrchr(word, '/');
+        size_t dlen = slash ? (size_t)(slash - word + 1) : 0;
+        char dir[MAXLINE], path[2 * MAXLINE];
+        struct dirlist_t *dl;
+        struct stat st;
+
+        snprintf(dir, sizeof(dir), "%.*s", (int)dlen, word);
+        if ((dl = readdirlist(dir)) != NULL)
+            for (i = 0; i < dl->count; i++)
+            {
+                const char *name = dl->names + dl->offs[i];
+                if (strncmp(name, word + dlen, wlen - dlen) != 0 || (name[0] == '.' && word[dlen] != '.'))
+                    continue;
+                int isdir = dl->types[i] == DT_DIR;
+                snprintf(path, sizeof(path), "%s%s", dir, name);
+                if (dl->types[i] == DT_LNK || dl->types[i] == DT_UNKNOWN)
+                    isdir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+                if (isdir)
+                    strcat(path, "/");
+                addarg(&args, path);
+            }
+        total = args.argc;
+    }
+
+    // The longest common prefix of a list
+    if (node < 0 && args.argc > 0)
+    {
+        qsort(args.argv, args.argc, sizeof(char *), cmpstr);
+        strcpy(lcp, args.argv[0]);
+        n = strlen(lcp);
+        for (i = 1; i < args.argc; i++)
+        {
+            for (k = 0; k < n && lcp[k] == args.argv[i][k]; k++)
+                ;
+            n = k;
+        }
+        lcp[n] = '\0';
+    }
+
+    int added = 0;
+    if (total == 0)
+    {
+        if (write(STDOUT_FILENO, "\a", 1) < 0)
+            added = 0;
+    }
+    else if (total == 1 || strlen(lcp) > wlen)
+    {
+        const char *text = total == 1 ? args.argv[0] : lcp;
+        size_t tlen = strlen(text);
+        int space = total == 1 && text[tlen - 1] != '/';
+
+        if (*len + tlen - wlen + space < MAXLINE - 1)
+        {
+            memmove(buf + ws + tlen + space, buf + *pos, *len - *pos);
+            memcpy(buf + ws, text, tlen);
+            if (space)
+                buf[ws + tlen] = ' ';
+            added = tlen + space - wlen;
+            *len += added;
+            *pos += added;
+        }
+    }
+    else
+    {
+        // Nothing to add: show the choices
+        char prefix[MAXLINE];
+        printf("\n");
+        if (node >= 0)
+        {
+            strcpy(prefix, word);
+            freeargv(args.argv);
+            args.argv = NULL;
+            args.argc = args.cap = 0;
+            triecollect(node, prefix, wlen, &args, MAXLISTED);
+        }
+        for (i = 0; i < args.argc; i++)
+            printf("%s%s", args.argv[i], i + 1 < args.argc ? "  " : "\n");
+        if (total > args.argc)
+            printf("... and %d more\n", total - args.argc);
+        fflush(stdout);
+    }
+    freeargv(args.argv);
+    return added;
+}
+
+/*
+ * editline - Read a command line from the terminal into buf, with
+ *    editing: the usual emacs keys (ctrl-a, -e, -b, -f, -k, -u, -w, -l
+ *    and the arrows), up and down for history, ctrl-r to search it,
+ *    and tab to complete. ctrl-c drops the line. Return the length of
+ *    the line (ending in a newline), or -1 at end of file.
+ */
+int editline(const char *prompt, char *buf)
+{
+    char saved[MAXLINE], query[MAXLINE], shown[MAXLINE + 64];
+    size_t len = 0, pos = 0, qlen = 0, elen;
+    long hpos = histmap() + 1, match = 0;
+    int searching = 0, c, k;
+    const char *e;
+    unsigned char ch, seq[3];
+
+    fflush(stdout);
+    rawmode(1);
+    refresh(prompt, buf, len, pos);
+    while (1)
+    {
+        if (read(STDIN_FILENO, &ch, 1) <= 0)
+            ch = 4; // End of file is ctrl-d
+        c = ch;
+
+        if (searching)
+        {
+            // ctrl-r: search older; backspace and text edit the query; anything else ends the search
+            if (c == 18 || c == 127 || c == 8 || (c >= ' ' && c < 127))
+            {
+                if (c == 127 || c == 8)
+                    qlen -= qlen > 0;
+                else if (c != 18 && qlen < (int)sizeof(query) - 1)
+                    query[qlen++] = c;
+                query[qlen] = '\0';
+                k = histfind(query, c == 18 && match ? match : histcount + 1, 0);
+                match = k ? k : match;
+                if (k && (e = histentry(match, &elen)) != NULL)
+                {
+                    len = pos = elen < MAXLINE - 2 ? elen : MAXLINE - 2;
+                    memcpy(buf, e, len);
+                }
+                snprintf(shown, sizeof(shown), "(%sreverse-i-search)`%s': ", k || !qlen ? "" : "failed ", query);
+                refresh(shown, buf, len, pos);
+                continue;
+            }
+            searching = 0;
+            if (c == 7 || c == 3) // ctrl-g, ctrl-c: back to the line as it was
+            {
+                strcpy(buf, saved);
+                len = pos = strlen(buf);
+                refresh(prompt, buf, len, pos);
+                continue;
+            }
+            refresh(prompt, buf, len, pos);
+        }
+
+        switch (c)
+        {
+        case '\r':
+        case '\n':
+            refresh(prompt, buf, len, len);
+            rawmode(0);
+            printf("\n");
+            buf[len++] = '\n';
+            buf[len] = '\0';
+            return len;
+        case 3: // ctrl-c
+            rawmode(0);
+            printf("^C\n");
+            last_status = 130;
+            len = pos = 0;
+            hpos = histmap() + 1;
+            rawmode(1);
+            break;
+        case 4: // ctrl-d
+            if (len == 0)
+            {
+                rawmode(0);
+                printf("\n");
+                return -1;
+            }
+            if (pos < len)
+                memmove(buf + pos, buf + pos + 1, len-- - pos - 1);
+            break;
+        case 127: // backspace
+        case 8:
+            if (pos > 0)
+            {
+                memmove(buf + pos - 1, buf + pos, len - pos);
+                pos--, len--;
+            }
+            break;
+        case 1: // ctrl-a
+            pos = 0;
+            break;
+        case 5: // ctrl-e
+            pos = len;
+            break;
+        case 2: // ctrl-b
+            pos -= pos > 0;
+            break;
+        case 6: // ctrl-f
+            pos += pos < len;
+            break;
+        case 11: // ctrl-k
+            len = pos;
+            break;
+        case 21: // ctrl-u
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            break;
+        case 23: // ctrl-w
+            for (k = pos; k > 0 && buf[k - 1] == ' '; k--)
+                ;
+            for (; k > 0 && buf[k - 1] != ' '; k--)
+                ;
+            memmove(buf + k, buf + pos, len - pos);
+            len -= pos - k;
+            pos = k;
+            break;
+        case 12: // ctrl-l
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0)
+                break;
+            break;
+        case 18: // ctrl-r
+            if (histmap() < 0)
+                break;
+            buf[len] = '\0';
+            strcpy(saved, buf);
+            searching = 1;
+            qlen = 0;
+            query[0] = '\0';
+            match = 0;
+            refresh("(reverse-i-search)`': ", buf, len, pos);
+            continue;
+        case '\t':
+            buf[len] = '\0';
+            complete(buf, &len, &pos);
+            break;
+        case 27: // Escape sequences: arrows, home, end, delete
+            if (read(STDIN_FILENO, seq, 1) <= 0 || read(STDIN_FILENO, seq + 1, 1) <= 0)
+                break;
+            if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9')
+            {
+                if (read(STDIN_FILENO, seq + 2, 1) <= 0 || seq[2] != '~')
+                    break;
+                seq[1] = seq[1] == '3' ? 'X' : seq[1] == '1' || seq[1] == '7' ? 'H' : seq[1] == '4' || seq[1] == '8' ? 'F' : 0;
+            }
+            if (seq[0] != '[' && seq[0] != 'O')
+                break;
+            if (seq[1] == 'C')
+                pos += pos < len;
+            else if (seq[1] == 'D')
+                pos -= pos > 0;
+            else if (seq[1] == 'H')
+                pos = 0;
+            else if (seq[1] == 'F')
+                pos = len;
+            else if (seq[1] == 'X' && pos < len)
+                memmove(buf + pos, buf + pos + 1, len-- - pos - 1);
+            else if ((seq[1] == 'A' || seq[1] == 'B') && histmap() >= 0)
+            {
+                long to = hpos + (seq[1] == 'A' ? -1 : 1);
+                if (to < 1 || to > histcount + 1)
+                    break;
+                if (hpos == histcount + 1)
+                {
+                    buf[len] = '\0';
+                    strcpy(saved, buf);
+                }
+                hpos = to;
+                if (hpos == histcount + 1)
+                    strcpy(buf, saved);
+                else if ((e = histentry(hpos, &elen)) != NULL)
+                {
+                    elen = elen < MAXLINE - 2 ? elen : MAXLINE - 2;
+                    memcpy(buf, e, elen);
+                    buf[elen] = '\0';
+                }
+                len = pos = strlen(buf);
+            }
+            break;
+        default:
+            if (c >= ' ' && len < MAXLINE - 2)
+            {
+                memmove(buf + pos + 1, buf + pos, len - pos);
+                buf[pos++] = c;
+                len++;
+            }
+        }
+        refresh(prompt, buf, len, pos);
+    }
+}
+
+/*********************
+ * Pathname expansion
+ *********************/
+
+/*
+ * hasglob - Return true if a word (or one component of it) contains an
+ *    unescaped *, ? or [ and so is a pattern.
+ */
+int hasglob(const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && s[i]; i++)
+    {
+        if (s[i] == '\\' && i + 1 < len && s[i + 1])
+            i++;
+        else if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * unescape - Remove the backslashes parseline put before the quoted
+ *    characters of a pattern, copying at most len bytes of s into dst.
+ */
+void unescape(char *dst, const char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && s[i]; i++)
+    {
+        if (s[i] == '\\' && i + 1 < len && s[i + 1])
+            i++;
+        *dst++ = s[i];
+    }
+    *dst = '\0';
+}
+
+/*
+ * readdirlist - Return the listing of a directory ("" for the current
+ *    one), from the cache if the directory's mtime has not changed since
+ *    it was read, else read with getdents64 into large buffers, keeping
+ *    each entry's d_type so that most entries never need a stat. Return
+ *    NULL if the directory cannot be read. A full cache evicts a listing
+ *    no expansion is walking (see globdir); one that is being walked is
+ *    returned as it is even if the directory has changed.
+ */
+struct dirlist_t *readdirlist(const char *path)
+{
+    static char *buf = NULL; // getdents64 buffer
+    struct dirlist_t *dl = NULL;
+    struct stat st;
+    long n, pos;
+    int i, fd;
+
+    if (stat(*path ? path : ".", &st) < 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+    for (i = 0; i < ndirlists; i++)
+        if (strcmp(dirlists[i].path, path) == 0)
+        {
+            dl = &dirlists[i];
+            if ((dl->mtime.tv_sec == st.st_mtim.tv_sec && dl->mtime.tv_nsec == st.st_mtim.tv_nsec) || dl->busy)
+                return dl;
+            break;
+        }
+    if (dl == NULL && ndirlists == MAXDIRLISTS)
+    {
+        for (i = 0; i < MAXDIRLISTS && dirlists[(dirlistnext + i) % MAXDIRLISTS].busy; i++)
+            ;
+        if (i == MAXDIRLISTS)
+            return NULL; // Every listing is in use
+        dl = &dirlists[(dirlistnext + i) % MAXDIRLISTS];
+        dirlistnext = (dirlistnext + i + 1) % MAXDIRLISTS;
+        free(dl->path);
+        dl->path = strdup(path);
+        dl->count = 0;
+        memset(&dl->mtime, 0, sizeof(dl->mtime)); // Not read yet
+    }
+
+    if ((fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return NULL;
+    if (buf == NULL && (buf = malloc(GLOBBUFSIZE)) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (dl == NULL)
+    {
+        dl = &dirlists[ndirlists++];
+        memset(dl, 0, sizeof(*dl));
+        dl->path = strdup(path);
+    }
+    dl->mtime = st.st_mtim;
+    dl->count = 0;
+    dl->used = 0;
+
+    while ((n = syscall(SYS_getdents64, fd, buf, GLOBBUFSIZE)) > 0)
+    {
+        for (pos = 0; pos < n; pos += ((struct dirent64 *)(buf + pos))->d_reclen)
+        {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+            size_t len = strlen(d->d_name) + 1;
+
+            if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                continue; // Never matched
+            if (dl->count == dl->cap)
+            {
+                dl->cap = dl->cap ? 2 * dl->cap : 256;
+                dl->offs = realloc(dl->offs, dl->cap * sizeof(*dl->offs));
+                dl->types = realloc(dl->types, dl->cap);
+            }
+            if (dl->used + len > dl->size)
+            {
+                dl->size = dl->size ? 2 * dl->size : 8192;
+                if (dl->size < dl->used + len)
+                    dl->size = dl->used + len;
+                dl->names = realloc(dl->names, dl->size);
+            }
+            memcpy(dl->names + dl->used, d->d_name, len);
+            dl->offs[dl->count] = dl->used;
+            dl->types[dl->count++] = d->d_type;
+            dl->used += len;
+        }
+    }
+    close(fd);
+    return dl;
+}
+
+/* cleardirlists - Forget every cached directory listing */
+void cleardirlists(void)
+{
+    int i;
+
+    for (i = 0; i < ndirlists; i++)
+    {
+        free(dirlists[i].path);
+        free(dirlists[i].names);
+        free(dirlists[i].offs);
+        free(dirlists[i].types);
+    }
+    ndirlists = 0;
+    dirlistnext = 0;
+}
+
+/* addarg - Append a malloc'd copy of s to a growing argument list */
+void addarg(struct arglist_t *args, const char *s)
+{
+    if (args->argc + 1 >= args->cap)
+    {
+        args->cap = args->cap ? 2 * args->cap : MAXARGS;
+        args->argv = realloc(args->argv, args->cap * sizeof(char *));
+    }
+    args->argv[args->argc++] = strdup(s);
+    args->argv[args->argc] = NULL;
+}
+
+/* cmpstr - Compare two strings through pointers to them, for qsort */
+int cmpstr(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * globdir - Add to args every existing path that is the directory path
+ *    (empty, or ending in /) followed by a name matching pattern, which
+ *    may have more components after slashes.
+ */
+void globdir(char *path, size_t plen, const char *pattern, struct arglist_t *args)
+{
+    const char *slash = strchr(pattern, '/');
+    size_t clen = slash ? (size_t)(slash - pattern) : strlen(pattern);
+    const char *rest = slash ? slash + strspn(slash, "/") : NULL;
+    char comp[MAXLINE], pre[MAXLINE], *star;
+    struct dirlist_t *dl;
+    struct stat st;
+    int i;
+
+    if (plen + clen + 2 >= MAXLINE)
+        return;
+
+    // A literal component is just appended, and need only exist
+    if (!hasglob(pattern, clen))
+    {
+        unescape(path + plen, pattern, clen);
+        plen += strlen(path + plen);
+        if (rest && *rest)
+        {
+            path[plen++] = '/';
+            globdir(path, plen, rest, args);
+        }
+        else if (lstat(path, &st) == 0 && (!rest || S_ISDIR(st.st_mode)))
+        {
+            if (rest)
+                strcpy(path + plen, "/");
+            addarg(args, path);
+        }
+        return;
+    }
+
+    path[plen] = '\0';
+    if ((dl = readdirlist(path)) == NULL)
+        return;
+
+    // *suffix, prefix* and pre*suf are matched without fnmatch
+    memcpy(comp, pattern, clen);
+    comp[clen] = '\0';
+    star = strchr(comp, '*');
+    int simple = star && strchr(star + 1, '*') == NULL && !strpbrk(comp, "?[\\");
+    size_t prelen = simple ? (size_t)(star - comp) : 0, suflen = simple ? strlen(star + 1) : 0;
+    memcpy(pre, comp, prelen);
+
+    dl->busy++; // Deeper components must not evict it
+    for (i = 0; i < dl->count; i++)
+    {
+        const char *name = dl->names + dl->offs[i];
+
+        if (simple)
+        {
+            size_t len = strlen(name);
+            if (len < prelen + suflen || (name[0] == '.' && comp[0] != '.') || memcmp(name, pre, prelen) != 0 ||
+                memcmp(name + len - suflen, star + 1, suflen) != 0)
+                continue;
+        }
+        else if (fnmatch(comp, name, FNM_PERIOD) != 0)
+            continue;
+
+        size_t nlen = strlen(name);
+        if (plen + nlen + 2 >= MAXLINE)
+            continue;
+        memcpy(path + plen, name, nlen + 1);
+        if (rest)
+        {
+            // Only a directory can lead any further
+            int type = dl->types[i];
+            if (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+                continue;
+            if (type != DT_DIR && (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)))
+                continue;
+            path[plen + nlen] = '/';
+            path[plen + nlen + 1] = '\0';
+            if (*rest)
+                globdir(path, plen + nlen + 1, rest, args);
+            else
+                addarg(args, path);
+        }
+        else
+            addarg(args, path);
+    }
+    dl->busy--;
+}
+
+/*
+ * globargv - Return a malloc'd copy of the argument list from the last
+ *    parseline, argv, with each pattern word replaced by the sorted paths
+ *    it matches, or left as it is (unescaped) if it matches none. The
+ *    list grows as needed, so it is not bound by MAXARGS. Release it with
+ *    freeargv.
+ */
+char **globargv(char **argv)
+{
+    struct arglist_t args = {NULL, 0, MAXARGS};
+    char path[MAXLINE];
+    int i, first;
+
+    args.argv = malloc(MAXARGS * sizeof(char *));
+    args.argv[0] = NULL;
+    for (i = 0; argv[i]; i++)
+    {
+        first = args.argc;
+        if (globword[i])
+        {
+            size_t plen = 0;
+            if (argv[i][0] == '/')
+                path[plen++] = '/';
+            globdir(path, plen, argv[i] + strspn(argv[i], "/"), &args);
+            qsort(args.argv + first, args.argc - first, sizeof(char *), cmpstr);
+        }
+        if (args.argc == first)
+        {
+            unescape(path, argv[i], MAXLINE - 1);
+            addarg(&args, globword[i] ? path : argv[i]);
+        }
+    }
+    return args.argv;
+}
+
+/* freeargv - Release an argument list made by globargv */
+void freeargv(char **argv)
+{
+    int i;
+
+    if (argv == NULL)
+        return;
+    for (i = 0; argv[i]; i++)
+        free(argv[i]);
+    free(argv);
+}
+
+/**************
+ * DAG executor
+ **************/
+
+/*
+ * jobbuiltin - Run a builtin that executes as a job of its own (in a
+ *    forked child, with its own process group and redirections) rather
+ *    than inside the shell. Return its exit status, or -1 if argv is
+ *    not such a builtin.
+ */
+int jobbuiltin(char **argv)
+{
+    if (isbuiltin(argv[0]) != BI_JOB)
+        return -1;
+    if (strcmp(argv[0], "dag") == 0)
+    {
+        subshell();
+        return do_dag(argv);
+    }
+    return -1;
+}
+
+/*
+ * dag_reaped - Called by sigchld_handler for a child that is not a job.
+ *    If it is a running DAG node, record how and when it finished.
+ */
+void dag_reaped(pid_t pid, int status)
+{
+    int i;
+
+    if (WIFSTOPPED(status) || WIFCONTINUED(status))
+        return;
+    for (i = 0; i < ndagnodes; i++)
+    {
+        if (dagnodes[i].state == DAG_RUN && dagnodes[i].pid == pid)
+        {
+            dagnodes[i].end = monotime();
+            dagnodes[i].status = exitcode(status);
+            dagnodes[i].state = dagnodes[i].status == 0 ? DAG_OK : DAG_FAIL;
+            dag_running--;
+            return;
+        }
+    }
+}
+
+/*
+ * dag_find - Return the index of the node called name, or -1
+ */
+int dag_find(const char *name)
+{
+    int i;
+
+    for (i = 0; i < ndagnodes; i++)
+        if (strcmp(dagnodes[i].name, name) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * dag_parse - Read a graph spec into dagnodes. Each line names a node,
+ *    the nodes it depends on, and its command line:
+ *
+ *        NAME [DEP ...] : COMMAND
+ *
+ *    Blank lines and lines starting with # are ignored. Return 0 on
+ *    success, -1 after printing an error.
+ */
+int dag_parse(FILE *fp, const char *src)
+{
+    char line[MAXLINE];
+    char *deps[MAXNODES];
+    int lineno = 0, i, j, named = 0; // named: nodes whose depnames are allocated
+
+    ndagnodes = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *colon, *word, *p = line;
+        int ndeps = 0;
+
+        lineno++;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if ((colon = strchr(p, ':')) == NULL)
+        {
+            printf("dag: %s:%d: expected NAME [DEP ...] : COMMAND\n", src, lineno);
+            goto fail;
+        }
+        if (ndagnodes == MAXNODES)
+        {
+            printf("dag: %s:%d: too many nodes\n", src, lineno);
+            goto fail;
+        }
+        *colon = '\0';
+
+        struct dagnode_t *node = &dagnodes[ndagnodes];
+        memset(node, 0, sizeof(*node));
+        if ((word = strtok(p, " \t")) == NULL || strlen(word) >= sizeof(node->name))
+        {
+            printf("dag: %s:%d: bad node name\n", src, lineno);
+            goto fail;
+        }
+        strcpy(node->name, word);
+        if (dag_find(node->name) >= 0)
+        {
+            printf("dag: %s:%d: duplicate node %s\n", src, lineno, node->name);
+            goto fail;
+        }
+        while ((word = strtok(NULL, " \t")) != NULL)
+        {
+            if (ndeps == MAXDEPS)
+            {
+                printf("dag: %s:%d: too many dependencies\n", src, lineno);
+                goto fail;
+            }
+            deps[ndeps++] = word;
+        }
+
+        // Keep the dependency names until every node is known
+        node->ndeps = ndeps;
+        for (j = 0; j < ndeps; j++)
+            node->depnames[j] = strdup(deps[j]);
+        named = ndagnodes + 1;
+
+        p = colon + 1;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\n' || *p == '\0')
+        {
+            printf("dag: %s:%d: node %s has no command\n", src, lineno, node->name);
+            goto fail;
+        }
+        strcpy(node->cmdline, p);
+        if (node->cmdline[strlen(node->cmdline) - 1] != '\n')
+            strcat(node->cmdline, "\n");
+        ndagnodes++;
+    }
+
+    // Resolve dependency names to node indices
+    for (i = 0; i < ndagnodes; i++)
+    {
+        for (j = 0; j < dagnodes[i].ndeps; j++)
+        {
+            if ((dagnodes[i].deps[j] = dag_find(dagnodes[i].depnames[j])) < 0)
+            {
+                printf("dag: node %s depends on unknown node %s\n", dagnodes[i].name, dagnodes[i].depnames[j]);
+                goto fail;
+            }
+        }
+    }
+    dag_freenames(named);
+    return 0;
+
+fail:
+    dag_freenames(named);
+    return -1;
+}
+
+/* dag_freenames - Free the dependency names dag_parse kept for nodes 0..n-1 */
+void dag_freenames(int n)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++)
+        for (j = 0; j < dagnodes[i].ndeps; j++)
+        {
+            free(dagnodes[i].depnames[j]);
+            dagnodes[i].depnames[j] = NULL;
+        }
+}
+
+/*
+ * dag_cyclic - Depth-first search from node i for a dependency cycle.
+ *    color is 0 (unvisited), 1 (on the current path) or 2 (done).
+ */
+int dag_cyclic(int i, char *color)
+{
+    int j;
+
+    if (color[i] == 1)
+    {
+        printf("dag: dependency cycle through %s\n", dagnodes[i].name);
+        return 1;
+    }
+    if (color[i] == 2)
+        return 0;
+    color[i] = 1;
+    for (j = 0; j < dagnodes[i].ndeps; j++)
+        if (dag_cyclic(dagnodes[i].deps[j], color))
+            return 1;
+    color[i] = 2;
+    return 0;
+}
+
+/*
+ * dag_launch - Fork a child that runs node i's command line
+ */
+void dag_launch(int i, sigset_t *prev)
+{
+    struct dagnode_t *node = &dagnodes[i];
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+    {
+        ndagnodes = 0; // This child is not running the graph
+        sigprocmask(SIG_SETMASK, prev, NULL);
+        eval(node->cmdline);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid < 0)
+        unix_error("fork error");
+    node->pid = pid;
+    node->start = monotime();
+    node->state = DAG_RUN;
+    dag_running++;
+}
+
+/*
+ * dag_report - Print each node's status and timing, then the critical
+ *    path: the chain of dependencies with the longest total run time.
+ */
+void dag_report(double t0, double t1)
+{
+    static const char *states[] = {"pending", "running", "ok", "failed", "skipped"};
+    double *cp = malloc(ndagnodes * sizeof(double));
+    int *via = malloc(ndagnodes * sizeof(int));
+    int counts[5] = {0}, i, j, last = -1;
+
+    for (i = 0; i < ndagnodes; i++)
+        counts[dagnodes[i].state]++;
+    printf("dag: %d nodes, %d ok, %d failed, %d skipped in %.2fs\n", ndagnodes, counts[DAG_OK], counts[DAG_FAIL],
+           counts[DAG_SKIP], t1 - t0);
+    printf("  %-16s %-8s %8s %8s\n", "NODE", "STATUS", "START", "TIME");
+    for (i = 0; i < ndagnodes; i++)
+    {
+        struct dagnode_t *node = &dagnodes[i];
+        if (node->state == DAG_OK || node->state == DAG_FAIL)
+            printf("  %-16s %-8s %7.2fs %7.2fs\n", node->name, states[node->state], node->start - t0,
+                   node->end - node->start);
+        else
+            printf("  %-16s %-8s %8s %8s\n", node->name, states[node->state], "-", "-");
+    }
+
+    // Longest finished chain ending at each node, filled in dependency order
+    for (i = 0; i < ndagnodes; i++)
+        cp[i] = -1;
+    for (int pass = 0; pass < ndagnodes; pass++) // Relax until every finished node is placed
+    {
+        int changed = 0;
+        for (i = 0; i < ndagnodes; i++)
+        {
+            struct dagnode_t *node = &dagnodes[i];
+            double best = 0;
+            int from = -1, ready = 1, d; // from: the predecessor, -1 while there is none
+
+            if (cp[i] >= 0 || (node->state != DAG_OK && node->state != DAG_FAIL))
+                continue;
+            for (j = 0; j < node->ndeps; j++)
+            {
+                d = node->deps[j];
+                if (cp[d] < 0)
+                    ready = 0;
+                else if (from < 0 || cp[d] > best || (cp[d] == best && dagnodes[d].end > dagnodes[from].end))
+                    best = cp[d], from = d; // Ties (zero-length nodes) go to the one that ended last
+            }
+            if (!ready)
+                continue;
+            cp[i] = best + (node->end - node->start);
+            via[i] = from;
+            changed = 1;
+            if (last < 0 || cp[i] > cp[last] || (cp[i] == cp[last] && node->end > dagnodes[last].end))
+                last = i;
+        }
+        if (!changed)
+            break;
+    }
+
+    if (last >= 0)
+    {
+        int path[MAXNODES], n = 0;
+
+        for (i = last; i >= 0; i = via[i])
+            path[n++] = i;
+        printf("dag: critical path");
+        while (n-- > 0)
+            printf(" %s%s", dagnodes[path[n]].name, n > 0 ? " ->" : "");
+        printf(" (%.2fs)\n", cp[last]);
+    }
+    free(cp);
+    free(via);
+}
+
+/*
+ * do_dag - Execute the builtin dag command, which runs a dependency
+ *    graph of command lines in parallel:
+ *
+ *        dag [-j N] [-k] [-v] [FILE]
+ *
+ *    The spec (see dag_parse) is read from FILE, or stdin if FILE is
+ *    missing or "-". Up to N nodes run at once (default: one per CPU).
+ *    A node starts as soon as sigchld_handler has reaped all of its
+ *    dependencies. After a failure no new nodes start, unless -k is
+ *    given, in which case only the failed node's dependents are
+ *    skipped. -v reports each node as it finishes. dag runs as one job
+ *    and prints per-node timings and the critical path at the end.
+ */
+int do_dag(char **argv)
+{
+    int maxrun = sysconf(_SC_NPROCESSORS_ONLN), keepgoing = 0, verbose_dag = 0;
+    char *src = "-";
+    sigset_t mask, prev;
+    double t0;
+    long val;
+    int i, j, failed = 0;
+    FILE *fp;
+
+    for (i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && parse_long(argv[i + 1], &val) == 0 && val > 0)
+            maxrun = val, i++;
+        else if (strcmp(argv[i], "-k") == 0)
+            keepgoing = 1;
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose_dag = 1;
+        else if (argv[i][0] != '-' || strcmp(argv[i], "-") == 0)
+            src = argv[i];
+        else
+        {
+            printf("usage: dag [-j N] [-k] [-v] [FILE]\n");
+            return 2;
+        }
+    }
+
+    if (strcmp(src, "-") == 0)
+        fp = stdin;
+    else if ((fp = fopen(src, "r")) == NULL)
+    {
+        printf("dag: %s: %s\n", src, strerror(errno));
+        return 1;
+    }
+    dagnodes = malloc(MAXNODES * sizeof(struct dagnode_t));
+    if (dag_parse(fp, src) < 0)
+        return 2;
+    if (fp != stdin)
+        fclose(fp);
+
+    char color[MAXNODES] = {0};
+    for (i = 0; i < ndagnodes; i++)
+        if (dag_cyclic(i, color))
+            return 2;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    t0 = monotime();
+
+    while (1)
+    {
+        for (i = 0; i < ndagnodes; i++)
+        {
+            struct dagnode_t *node = &dagnodes[i];
+            int ready = 1;
+
+            if (node->state != DAG_WAIT)
+                continue;
+            for (j = 0; j < node->ndeps; j++)
+            {
+                int dep = dagnodes[node->deps[j]].state;
+                if (dep == DAG_FAIL || dep == DAG_SKIP)
+                    ready = -1;
+                else if (dep != DAG_OK && ready > 0)
+                    ready = 0;
+            }
+            if (ready < 0 || (failed && !keepgoing))
+            {
+                node->state = DAG_SKIP; // Can never run
+                i = -1;                 // Dependents may now be skippable too
+            }
+            else if (ready && dag_running < maxrun)
+                dag_launch(i, &prev);
+        }
+
+        if (dag_running == 0)
+            break;
+        sigsuspend(&prev); // Wait for sigchld_handler to reap a node
+
+        for (i = 0; i < ndagnodes; i++)
+        {
+            struct dagnode_t *node = &dagnodes[i];
+            if ((node->state == DAG_OK || node->state == DAG_FAIL) && !node->reported)
+            {
+                node->reported = 1;
+                if (node->state == DAG_FAIL)
+                    failed = 1;
+                if (verbose_dag)
+                    printf("dag: %s %s (status %d) in %.2fs\n", node->name,
+                           node->state == DAG_OK ? "done" : "failed", node->status, node->end - node->start);
+            }
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    dag_report(t0, monotime());
+    for (i = 0; i < ndagnodes; i++)
+        if (dagnodes[i].state != DAG_OK)
+            return 1;
+    return 0;
+}
+
+/******************
+ * Job output logs
+ ******************/
+
+/*
+ * joblog_begin - With set joblog on, a background job's stdout and
+ *    stderr go to a pipe the shell drains into a log (see sigio_handler)
+ *    instead of to the terminal. Put the shell's own stdout and stderr
+ *    on a new pipe while the job starts, saving them in saved. Return
+ *    the read end, or -1 if there is no pipe to be had.
+ */
+int joblog_begin(int saved[2])
+{
+    int pipefds[2];
+
+    if (pipe2(pipefds, O_CLOEXEC) < 0)
+        return -1;
+    fflush(stdout);
+    saved[0] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    saved[1] = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    dup2(pipefds[1], STDOUT_FILENO);
+    dup2(pipefds[1], STDERR_FILENO);
+    close(pipefds[1]);
+    jobmsgs = 0; // The job's start is reported once we have stdout back
+    return pipefds[0];
+}
+
+/*
+ * joblog_attach - Put back the shell's stdout and stderr and, if a job
+ *    started (lastbg is no longer prevbg), report it and give the pipe
+ *    fd a log: a ring of joblogsize bytes while the rings of all logs
+ *    stay within joblogmem, with older output spilling to a file. Then
+ *    have the kernel send SIGIO whenever the job writes.
+ */
+void joblog_attach(int fd, int saved[2], pid_t prevbg, char *jobcmd)
+{
+    struct joblog_t *l = NULL;
+    sigset_t mask, prev;
+    int i;
+
+    dup2(saved[0], STDOUT_FILENO);
+    dup2(saved[1], STDERR_FILENO);
+    close(saved[0]);
+    close(saved[1]);
+    jobmsgs = 1;
+    if (lastbg == prevbg) // Nothing started
+    {
+        close(fd);
+        return;
+    }
+    printf("[%d] (%d) %s", lastbgjid, lastbg, jobcmd);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGIO);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+
+    // A free entry, else the oldest whose output is all in, else the oldest
+    for (i = 0; i < MAXJOBLOGS && joblogs[i].pid != 0; i++)
+        ;
+    if (i < MAXJOBLOGS)
+        l = &joblogs[i];
+    else
+        for (i = 0; i < MAXJOBLOGS; i++)
+            if (l == NULL || (l->fd >= 0 && joblogs[i].fd < 0) ||
+                ((l->fd < 0) == (joblogs[i].fd < 0) && joblogs[i].seq < l->seq))
+                l = &joblogs[i];
+    if (l->pid != 0)
+    {
+        joblog_spill(l);
+        if (l->fd >= 0)
+            close(l->fd);
+        if (l->spillfd >= 0)
+            close(l->spillfd);
+    }
+
+    // Make room in memory by moving finished logs to their files
+    for (i = 0; i < MAXJOBLOGS && joblogused + joblogsize > joblogmem; i++)
+        if (joblogs[i].pid != 0 && joblogs[i].fd < 0)
+            joblog_spill(&joblogs[i]);
+
+    l->pid = lastbg;
+    l->jid = lastbgjid;
+    l->seq = ++joblogseq;
+    l->fd = fd;
+    l->ring = NULL;
+    l->size = l->start = l->len = 0;
+    l->spillfd = -1;
+    l->spilled = 0;
+    if (joblogused + joblogsize <= joblogmem && (l->ring = malloc(joblogsize)) != NULL)
+    {
+        l->size = joblogsize;
+        joblogused += l->size;
+    }
+
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC);
+    joblog_drain(l); // What it wrote before O_ASYNC
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*
+ * joblog_append - Add n bytes of output to a log. When its ring is full
+ *    (or it has none), the oldest bytes move to the spill file, an
+ *    unnamed file in P_tmpdir made when first needed. Safe in a
+ *    signal handler: no malloc, and stdio is not touched.
+ */
+void joblog_append(struct joblog_t *l, const char *buf, size_t n)
+{
+    size_t k, at;
+    ssize_t w;
+
+    while (n > 0)
+    {
+        if (l->len < l->size) // Room in the ring
+        {
+            at = (l->start + l->len) % l->size;
+            k = n < l->size - at ? n : l->size - at;
+            k = k < l->size - l->len ? k : l->size - l->len;
+            memcpy(l->ring + at, buf, k);
+            l->len += k;
+            buf += k;
+            n -= k;
+            continue;
+        }
+
+        if (l->spillfd < 0 && (l->spillfd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+            return; // Nowhere to keep it
+        if (l->size == 0) // No ring: straight to the file
+        {
+            if ((w = write(l->spillfd, buf, n)) > 0)
+                l->spilled += w;
+            return;
+        }
+        k = l->len < l->size - l->start ? l->len : l->size - l->start; // The oldest run of bytes
+        if ((w = write(l->spillfd, l->ring + l->start, k)) <= 0)
+            return; // The file is full: the rest is lost
+        k = w;
+        l->start = (l->start + k) % l->size;
+        l->len -= k;
+        l->spilled += k;
+    }
+}
+
+/* joblog_drain - Read all a log's job has written so far; close it at end of file */
+void joblog_drain(struct joblog_t *l)
+{
+    char buf[16384];
+    ssize_t n;
+
+    while ((n = read(l->fd, buf, sizeof(buf))) > 0)
+        joblog_append(l, buf, n);
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+        close(l->fd);
+        l->fd = -1;
+    }
+}
+
+/*
+ * joblog_spill - Move a log's ring to its spill file and free it, with
+ *    SIGIO blocked.
+ */
+void joblog_spill(struct joblog_t *l)
+{
+    size_t size = l->size;
+
+    if (l->ring == NULL)
+        return;
+    l->size = 0; // Everything goes to the file from here on
+    while (l->len > 0)
+    {
+        size_t k = l->len < size - l->start ? l->len : size - l->start;
+
+        if (l->spillfd < 0 && (l->spillfd = open(P_tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+            break;
+        if (write(l->spillfd, l->ring + l->start, k) < 0)
+            break;
+        l->start = (l->start + k) % size;
+        l->len -= k;
+        l->spilled += k;
+    }
+    l->spilled += l->len; // Whatever could not be kept
+    l->len = l->start = 0;
+    free(l->ring);
+    l->ring = NULL;
+    joblogused -= size;
+}
+
+/*
+ * joblog_read - Copy up to max bytes of a log's output, from position
+ *    pos of all it has written, to buf, with SIGIO blocked. Return how
+ *    many, 0 if there are no more yet.
+ */
+size_t joblog_read(struct joblog_t *l, size_t pos, char *buf, size_t max)
+{
+    size_t k, at, first;
+    ssize_t n;
+
+    if (pos < l->spilled)
+    {
+        k = l->spilled - pos < max ? l->spilled - pos : max;
+        n = l->spillfd >= 0 ? pread(l->spillfd, buf, k, pos) : -1;
+        if (n <= 0) // Lost to a write error: show a gap of zeros
+        {
+            memset(buf, 0, k);
+            n = k;
+        }
+        return n;
+    }
+    if (pos - l->spilled >= l->len)
+        return 0;
+    k = l->len - (pos - l->spilled) < max ? l->len - (pos - l->spilled) : max;
+    at = (l->start + pos - l->spilled) % l->size;
+    first = k < l->size - at ? k : l->size - at;
+    memcpy(buf, l->ring + at, first);
+    memcpy(buf + first, l->ring, k - first);
+    return k;
+}
+
+/*
+ * do_joblog - Execute the builtin joblog command: "joblog %jid|PID"
+ *    prints the output a background job has written while set joblog
+ *    was on, and with -f goes on printing it as it comes until the job
+ *    closes its output or ctrl-c. A job ID means the newest job with it.
+ */
+void do_joblog(char **argv)
+{
+    struct joblog_t *l = NULL;
+    char buf[16384], *spec = NULL;
+    sigset_t mask, prev;
+    int i, follow = 0;
+    size_t pos = 0, n;
+
+    for (i = 1; argv[i] != NULL; i++)
+        if (strcmp(argv[i], "-f") == 0)
+            follow = 1;
+        else
+            spec = argv[i];
+    if (spec == NULL || (spec[0] != '%' && !isdigit(spec[0])))
+    {
+        printf("joblog: usage: joblog %%jobid|PID [-f]\n");
+        last_status = 2;
+        return;
+    }
+    for (i = 0; i < MAXJOBLOGS; i++)
+        if (joblogs[i].pid != 0 &&
+            (spec[0] == '%' ? joblogs[i].jid == atoi(spec + 1) : joblogs[i].pid == atoi(spec)) &&
+            (l == NULL || joblogs[i].seq > l->seq))
+            l = &joblogs[i];
+    if (l == NULL)
+    {
+        printf("%s: No job output logged\n", spec);
+        last_status = 1;
+        return;
+    }
+
+    // Copy with SIGIO held off, write with it let in, so the job never waits on us
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGIO);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    sigint_seen = 0;
+    while (1)
+    {
+        while (follow && l->fd >= 0 && pos == l->spilled + l->len && !sigint_seen)
+            sigsuspend(&prev);
+        n = joblog_read(l, pos, buf, sizeof(buf));
+        if (n == 0 && (!follow || l->fd < 0 || sigint_seen))
+            break;
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+        fwrite(buf, 1, n, stdout);
+        fflush(stdout);
+        pos += n;
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+    }
+    if (sigint_seen)
+        last_status = 128 + SIGINT;
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/*************
+ * Job server
+ *************/
+
+/*
+ * serve - Run as a job server on the Unix socket at path (tsh --serve
+ *    path) until SIGINT or SIGTERM. Clients send requests and get
+ *    replies as messages: a 4-byte length in network order, then that
+ *    many bytes of text.
+ *
+ *    run CMDLINE          start CMDLINE as a background job; replies
+ *                         "ok JID PID", or "err MESSAGE" if nothing
+ *                         started. With the job list full the request
+ *                         waits, and so does the rest of that client's
+ *                         input, until a job ends.
+ *    jobs                 "ok" and the job list, as the jobs builtin
+ *    bg SPEC              continue a stopped job; "ok"
+ *    kill [-SIG] SPEC     signal a job (SIGTERM by default); "ok"
+ *    output SPEC          the job's output so far and as it comes, as
+ *                         "out BYTES" messages, then "end STATUS"
+ *    fg SPEC              continue the job, then as output
+ *
+ *    SPEC is %JID or a pid. Jobs run with stdin on /dev/null and their
+ *    stdout and stderr on a pipe the server reads with epoll, with the
+ *    last OUTBACKLOG bytes kept for clients that ask later. Replies to
+ *    a client come in the order of its requests.
+ */
+void serve(const char *path)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[SERVEEVENTS];
+    sigset_t mask, prev;
+    int lfd, fd, n, i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("%s: socket path too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        unix_error("socket error");
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        // Take over the socket of a server that is gone, not of one that is running
+        if (errno == EADDRINUSE && (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0)
+        {
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno == ECONNREFUSED)
+                unlink(path);
+            close(fd);
+        }
+        if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            printf("%s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+    }
+    if (listen(lfd, SOMAXCONN) < 0)
+        unix_error("listen error");
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)SV_LISTEN << 32;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+    if ((nullfd = open("/dev/null", O_RDWR | O_CLOEXEC)) < 0)
+        unix_error("open /dev/null error");
+    for (i = 0; i < 3; i++)
+        servefds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    for (i = 0; i < MAXSERVED; i++)
+    {
+        served[i].outfd = -1;
+        served[i].watchers = -1;
+    }
+
+    serving = 1;
+    jobmsgs = 0;
+    Signal(SIGINT, serve_stop);
+    Signal(SIGTERM, serve_stop);
+    printf("tsh: serving on %s\n", path);
+    fflush(stdout);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    while (!serve_quit)
+    {
+        // Take in the jobs that ended; sleep only when there are none
+        sigprocmask(SIG_BLOCK, &mask, &prev);
+        if (serve_drain() > 0)
+        {
+            sigprocmask(SIG_SETMASK, &prev, NULL);
+            serve_resume();
+            continue;
+        }
+        n = epoll_pwait(epfd, events, SERVEEVENTS, -1, &prev);
+        sigprocmask(SIG_SETMASK, &prev, NULL);
+
+        for (i = 0; i < n; i++)
+        {
+            int idx = events[i].data.u64 & 0xffffffff;
+
+            switch (events[i].data.u64 >> 32)
+            {
+            case SV_LISTEN:
+                while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                    serve_accept(fd);
+                break;
+            case SV_CLIENT:
+                if (clients[idx].fd < 0)
+                    break; // Closed by an earlier event
+                if (events[i].events & EPOLLOUT)
+                    serve_flush(idx);
+                if (clients[idx].fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    serve_read(idx);
+                break;
+            case SV_OUTPUT:
+                serve_output(idx);
+                break;
+            }
+        }
+        serve_resume(); // Job slots may have come free
+    }
+
+    // Hang up on the jobs, as a terminal would
+    unlink(path);
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid != 0)
+        {
+            signaljob(&jobs[i], SIGHUP);
+            signaljob(&jobs[i], SIGCONT);
+        }
+    exit(0);
+}
+
+/* serve_stop - SIGINT and SIGTERM end the job server */
+void serve_stop(int sig)
+{
+    serve_quit = 1;
+}
+
+/*
+ * serve_reaped - Called by sigchld_handler for a job of the job server
+ *    that has ended: queue its pid and status for serve_drain.
+ */
+void serve_reaped(struct job_t *job)
+{
+    int k = donehead % NDONE;
+
+    donepids[k] = job->pid;
+    donestatus[k] = job->status;
+    donehead++;
+}
+
+/*
+ * serve_drain - With SIGCHLD blocked, mark the jobs queued by
+ *    serve_reaped as done. Return how many there were.
+ */
+int serve_drain(void)
+{
+    int n = 0, k, s;
+
+    for (; donetail != donehead; donetail++, n++)
+    {
+        k = donetail % NDONE;
+        for (s = 0; s < MAXSERVED; s++)
+            if (served[s].pid == donepids[k] && !served[s].done)
+            {
+                served[s].done = 1;
+                served[s].status = donestatus[k];
+                serve_end(s);
+            }
+    }
+    return n;
+}
+
+/* serve_resume - Go on with the input of clients waiting for a free job slot */
+void serve_resume(void)
+{
+    int c;
+
+    for (c = 0; c < nclients; c++)
+        if (clients[c].fd >= 0 && clients[c].stalled)
+        {
+            clients[c].stalled = 0;
+            serve_input(c);
+        }
+}
+
+/* serve_accept - Take on a new client connection */
+void serve_accept(int fd)
+{
+    struct epoll_event ev;
+    int c;
+
+    for (c = 0; c < nclients && clients[c].fd >= 0; c++)
+        ;
+    if (c == nclients)
+    {
+        clients = realloc(clients, ++nclients * sizeof(*clients));
+        memset(&clients[c], 0, sizeof(clients[c]));
+    }
+    clients[c].fd = fd;
+    clients[c].inlen = clients[c].outlen = 0;
+    clients[c].watching = clients[c].nextwatch = -1;
+    clients[c].stalled = 0;
+    clients[c].events = EPOLLIN;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)SV_CLIENT << 32 | c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* serve_close - Drop a client, and its place among a job's watchers */
+void serve_close(int c)
+{
+    struct client_t *cl = &clients[c];
+    int *link;
+
+    if (cl->watching >= 0)
+    {
+        for (link = &served[cl->watching].watchers; *link != c; link = &clients[*link].nextwatch)
+            ;
+        *link = cl->nextwatch;
+    }
+    close(cl->fd); // Also removes it from the epoll set
+    cl->fd = -1;
+    cl->watching = -1;
+    free(cl->in);
+    free(cl->out);
+    cl->in = cl->out = NULL;
+    cl->incap = cl->outcap = 0;
+}
+
+/* serve_read - Read what a client has sent, and act on its whole requests */
+void serve_read(int c)
+{
+    struct client_t *cl = &clients[c];
+    ssize_t n;
+
+    while (1)
+    {
+        if (cl->inlen == cl->incap)
+        {
+            cl->incap = cl->incap ? 2 * cl->incap : 4096;
+            cl->in = realloc(cl->in, cl->incap);
+        }
+        if ((n = read(cl->fd, cl->in + cl->inlen, cl->incap - cl->inlen)) > 0)
+        {
+            cl->inlen += n;
+            if (cl->inlen > 4 * (MAXLINE + 16) && cl->stalled)
+                break; // Enough queued up: read the rest when it can go on
+            continue;
+        }
+        if (n == 0 || errno != EAGAIN)
+        {
+            serve_close(c);
+            return;
+        }
+        break;
+    }
+    serve_input(c);
+}
+
+/*
+ * serve_input - Act on each whole request a client has sent, in order,
+ *    stopping at a run that has to wait for a job slot. Then send the
+ *    replies and watch the client for what it can do next.
+ */
+void serve_input(int c)
+{
+    struct client_t *cl = &clients[c];
+    char req[MAXLINE + 16];
+    size_t pos = 0;
+    uint32_t len;
+
+    while (!cl->stalled && cl->inlen - pos >= 4)
+    {
+        memcpy(&len, cl->in + pos, 4);
+        len = ntohl(len);
+        if (len >= sizeof(req))
+        {
+            serve_close(c); // Not a request
+            return;
+        }
+        if (cl->inlen - pos - 4 < len)
+            break;
+        memcpy(req, cl->in + pos + 4, len);
+        req[len] = '\0';
+        if (serve_request(c, req) < 0)
+            break; // Stalled: leave it to be done again
+        pos += 4 + len;
+    }
+    memmove(cl->in, cl->in + pos, cl->inlen - pos);
+    cl->inlen -= pos;
+    serve_flush(c);
+}
+
+/*
+ * serve_request - Act on one request of a client. Return -1 if it is a
+ *    run that must wait for a free slot in the job list, else 0.
+ */
+int serve_request(int c, char *req)
+{
+    char *argv[4], *p;
+    struct job_t *job = NULL;
+    int argc, s = -1, sig = SIGTERM, i;
+
+    if (strncmp(req, "run ", 4) == 0)
+        return serve_run(c, req + 4);
+
+    // The rest have at most three words
+    for (argc = 0, p = strtok(req, " \t\n"); p && argc < 3; p = strtok(NULL, " \t\n"))
+        argv[argc++] = p;
+    argv[argc] = NULL;
+    if (argc == 0)
+    {
+        serve_printf(c, "err empty request");
+        return 0;
+    }
+
+    if (strcmp(argv[0], "jobs") == 0)
+    {
+        char list[MAXJOBS * (MAXLINE + 48)];
+        int len = sprintf(list, "ok\n");
+
+        for (i = 0; i < MAXJOBS; i++)
+            if (jobs[i].pid != 0)
+                len += sprintf(list + len, "[%d] (%d) %s %s", jobs[i].jid, jobs[i].pid,
+                               jobs[i].state == ST ? "Stopped" : "Running", jobs[i].cmdline);
+        serve_frame(c, list, len, NULL, 0);
+        return 0;
+    }
+
+    if (strcmp(argv[0], "kill") == 0 && argc == 3 && argv[1][0] == '-')
+    {
+        if ((sig = parse_signal(argv[1] + 1)) < 0)
+        {
+            serve_printf(c, "err %s: invalid signal", argv[1] + 1);
+            return 0;
+        }
+        argv[1] = argv[2];
+    }
+    else if (argc != 2)
+    {
+        serve_printf(c, "err usage: %s %s", argv[0], strcmp(argv[0], "kill") ? "SPEC" : "[-SIG] SPEC");
+        return 0;
+    }
+
+    // Find the job: a live one, and for output also one that has ended
+    if (argv[1][0] == '%')
+        job = getjobjid(jobs, atoi(argv[1] + 1));
+    else if (isdigit(argv[1][0]))
+        job = getjobpid(jobs, atoi(argv[1]));
+    for (i = 0; i < MAXSERVED; i++)
+        if (served[i].pid != 0 &&
+            (job ? served[i].pid == job->pid
+                 : (argv[1][0] == '%' ? served[i].jid == atoi(argv[1] + 1) : served[i].pid == atoi(argv[1]))) &&
+            (s < 0 || served[i].seq > served[s].seq))
+            s = i;
+
+    if (strcmp(argv[0], "output") == 0 || strcmp(argv[0], "fg") == 0)
+    {
+        if (s < 0 || (argv[0][0] == 'f' && job == NULL))
+        {
+            serve_printf(c, "err %s: No such job", argv[1]);
+            return 0;
+        }
+        if (job != NULL && argv[0][0] == 'f')
+        {
+            job->state = BG;
+            signaljob(job, SIGCONT);
+        }
+        serve_watch(c, s);
+        return 0;
+    }
+    if (strcmp(argv[0], "bg") != 0 && strcmp(argv[0], "kill") != 0)
+    {
+        serve_printf(c, "err %s: unknown request", argv[0]);
+        return 0;
+    }
+    if (job == NULL)
+    {
+        serve_printf(c, "err %s: No such job", argv[1]);
+        return 0;
+    }
+    if (argv[0][0] == 'b')
+    {
+        job->state = BG;
+        sig = SIGCONT;
+    }
+    signaljob(job, sig);
+    serve_printf(c, "ok");
+    return 0;
+}
+
+/*
+ * serve_run - Start cmdline as a background job whose output goes to a
+ *    pipe the server reads, and reply with its job ID and pid. Return
+ *    -1 if the job list is full, else 0.
+ */
+int serve_run(int c, char *cmdline)
+{
+    char line[MAXLINE], err[MAXLINE], *elems[MAXARGS];
+    int ops[MAXARGS], pipefds[2], s, i, n;
+    sigset_t mask, prev;
+    struct epoll_event ev;
+    struct served_t *sv;
+
+    // Ended jobs free their slots here, and their entries below
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    serve_drain();
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+
+    for (i = 0; i < MAXJOBS && jobs[i].pid != 0; i++)
+        ;
+    // An entry that is free, or the one that ended longest ago, unwatched
+    for (s = -1, n = 0; n < MAXSERVED; n++)
+        if (served[n].pid == 0 || (served[n].done && served[n].outfd < 0 && served[n].watchers < 0))
+            if (s < 0 || served[n].pid == 0 || (served[s].pid != 0 && served[n].seq < served[s].seq))
+                s = n;
+    if (i == MAXJOBS || s < 0)
+    {
+        clients[c].stalled = 1;
+        return -1;
+    }
+
+    n = strlen(cmdline);
+    if (n + 2 > MAXLINE)
+    {
+        serve_printf(c, "err command line too long");
+        return 0;
+    }
+    sprintf(line, "%s%s", cmdline, n > 0 && cmdline[n - 1] == '\n' ? "" : "\n");
+    if (pipe2(pipefds, O_CLOEXEC) < 0)
+    {
+        serve_printf(c, "err pipe: %s", strerror(errno));
+        return 0;
+    }
+
+    // Start it with our stdin, stdout and stderr where its own go
+    fflush(stdout);
+    dup2(nullfd, STDIN_FILENO);
+    dup2(pipefds[1], STDOUT_FILENO);
+    dup2(pipefds[1], STDERR_FILENO);
+    close(pipefds[1]);
+    lastbg = 0;
+    if ((n = parselist(line, elems, ops)) > 0)
+    {
+        if (n == 1)
+            runpipeline(elems[0], 1, line);
+        else
+            runlistjob(elems, ops, 0, n - 1, line);
+        for (i = 0; i < n; i++)
+            free(elems[i]);
+    }
+    fflush(stdout);
+    for (i = 0; i < 3; i++)
+        dup2(servefds[i], i);
+
+    if (lastbg == 0) // What it printed says why it did not start
+    {
+        fcntl(pipefds[0], F_SETFL, O_NONBLOCK);
+        n = read(pipefds[0], err, sizeof(err) - 1);
+        close(pipefds[0]);
+        err[n > 0 ? n - (err[n - 1] == '\n') : 0] = '\0';
+        serve_printf(c, "err %s", n > 0 ? err : "nothing to run");
+        return 0;
+    }
+
+    sv = &served[s];
+    sv->pid = lastbg;
+    sv->jid = lastbgjid;
+    sv->seq = ++servedseq;
+    sv->done = 0;
+    sv->outlen = 0;
+    sv->watchers = -1;
+    sv->outfd = pipefds[0];
+    fcntl(sv->outfd, F_SETFL, O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)SV_OUTPUT << 32 | s;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sv->outfd, &ev);
+    serve_printf(c, "ok %d %d", lastbgjid, (int)lastbg);
+    return 0;
+}
+
+/*
+ * serve_output - Read what a job has written, keep the last OUTBACKLOG
+ *    bytes of it, and pass it on to the clients watching the job.
+ */
+void serve_output(int s)
+{
+    struct served_t *sv = &served[s];
+    char buf[OUTBACKLOG];
+    ssize_t n, k, len;
+    size_t at;
+    int c;
+
+    if (sv->outfd < 0)
+        return;
+    while ((n = read(sv->outfd, buf, sizeof(buf))) > 0)
+    {
+        if (sv->backlog == NULL)
+            sv->backlog = malloc(OUTBACKLOG);
+        for (k = 0; k < n; k += len) // Byte k goes at outlen + k in the ring
+        {
+            at = (sv->outlen + k) % OUTBACKLOG;
+            len = n - k < (ssize_t)(OUTBACKLOG - at) ? n - k : (ssize_t)(OUTBACKLOG - at);
+            memcpy(sv->backlog + at, buf + k, len);
+        }
+        sv->outlen += n;
+        for (c = sv->watchers; c >= 0; c = clients[c].nextwatch)
+        {
+            serve_frame(c, "out ", 4, buf, n);
+            serve_flush(c);
+        }
+    }
+    if (n == 0 || errno != EAGAIN)
+    {
+        close(sv->outfd);
+        sv->outfd = -1;
+        serve_end(s);
+    }
+}
+
+/*
+ * serve_watch - Send a client a job's output so far, and the rest as it
+ *    comes, with "end STATUS" once the job is over and its output read.
+ */
+void serve_watch(int c, int s)
+{
+    struct served_t *sv = &served[s];
+    size_t at;
+
+    if (clients[c].watching >= 0)
+    {
+        serve_printf(c, "err already watching a job");
+        return;
+    }
+    if (sv->outlen > OUTBACKLOG)
+    {
+        at = sv->outlen % OUTBACKLOG;
+        serve_frame(c, "out ", 4, sv->backlog + at, OUTBACKLOG - at);
+        serve_frame(c, "out ", 4, sv->backlog, at);
+    }
+    else if (sv->outlen > 0)
+        serve_frame(c, "out ", 4, sv->backlog, sv->outlen);
+
+    clients[c].watching = s;
+    clients[c].nextwatch = sv->watchers;
+    sv->watchers = c;
+    serve_end(s);
+}
+
+/* serve_end - Once a job is over and all its output read, tell its watchers */
+void serve_end(int s)
+{
+    struct served_t *sv = &served[s];
+    int c, next;
+
+    if (!sv->done || sv->outfd >= 0)
+        return;
+    for (c = sv->watchers; c >= 0; c = next)
+    {
+        next = clients[c].nextwatch;
+        clients[c].watching = clients[c].nextwatch = -1;
+        serve_printf(c, "end %d", sv->status);
+        serve_flush(c);
+    }
+    sv->watchers = -1;
+}
+
+/* serve_printf - Queue a formatted reply for a client */
+void serve_printf(int c, const char *fmt, ...)
+{
+    char msg[MAXLINE + 64];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(msg))
+        len = sizeof(msg) - 1;
+    serve_frame(c, msg, len, NULL, 0);
+}
+
+/* serve_frame - Queue a reply for a client: head, then len bytes of data */
+void serve_frame(int c, const char *head, size_t hlen, const char *data, size_t len)
+{
+    struct client_t *cl = &clients[c];
+    uint32_t n = htonl(hlen + len);
+
+    if (cl->outlen + 4 + hlen + len > cl->outcap)
+    {
+        cl->outcap = cl->outcap ? 2 * cl->outcap : 4096;
+        if (cl->outcap < cl->outlen + 4 + hlen + len)
+            cl->outcap = cl->outlen + 4 + hlen + len;
+        cl->out = realloc(cl->out, cl->outcap);
+    }
+    memcpy(cl->out + cl->outlen, &n, 4);
+    memcpy(cl->out + cl->outlen + 4, head, hlen);
+    if (len > 0)
+        memcpy(cl->out + cl->outlen + 4 + hlen, data, len);
+    cl->outlen += 4 + hlen + len;
+}
+
+/*
+ * serve_flush - Send a client what can be sent of its replies, and have
+ *    epoll watch for it to take more, or for more requests unless it
+ *    waits for a job slot. A client that lets MAXCLIENTOUT bytes of
+ *    replies pile up is dropped.
+ */
+void serve_flush(int c)
+{
+    struct client_t *cl = &clients[c];
+    struct epoll_event ev;
+    ssize_t n;
+
+    while (cl->outlen > 0 && (n = send(cl->fd, cl->out, cl->outlen, MSG_NOSIGNAL | MSG_DONTWAIT)) > 0)
+    {
+        memmove(cl->out, cl->out + n, cl->outlen - n);
+        cl->outlen -= n;
+    }
+    if (cl->outlen > 0 && errno != EAGAIN)
+    {
+        serve_close(c);
+        return;
+    }
+    if (cl->outlen > MAXCLIENTOUT)
+    {
+        serve_close(c);
+        return;
+    }
+
+    ev.events = (cl->stalled ? 0 : EPOLLIN) | (cl->outlen > 0 ? EPOLLOUT : 0);
+    if (ev.events != cl->events)
+    {
+        ev.data.u64 = (uint64_t)SV_CLIENT << 32 | c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+        cl->events = ev.events;
+    }
+}
+
+/**************
+ * Spawn helper
+ **************/
+
+/*
+ * zygote_start - Fork the spawn helper, a copy of the shell taken at
+ *    startup while its address space is still small. Commands are then
+ *    started by asking it to fork (see zygote_spawn), so the cost of a
+ *    fork no longer grows with the shell's caches, history and job
+ *    table. The helper shares a socket pair with the shell and exits
+ *    when the shell's end closes.
+ */
+void zygote_start(void)
+{
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return; // Commands are forked by the shell itself
+    if ((pid = fork()) == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+    close(sv[1]);
+    if (pid < 0)
+        close(sv[0]);
+    else
+        zygotefd = sv[0];
+}
+
+/*
+ * zygote_main - The spawn helper's loop. Each request is a spawnmsg_t
+ *    followed by the command's strings, with its stdin, stdout and
+ *    stderr attached as SCM_RIGHTS. The helper forks the command with
+ *    CLONE_PARENT, so it is a child of the shell like any other: the
+ *    shell gets its SIGCHLD, reaps it and may set its process group.
+ *    The reply is the pid, or -errno if the fork failed.
+ */
+void zygote_main(int sock)
+{
+    static char msg[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {msg, sizeof(msg)};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    int fds[3], null, k;
+    sigset_t keys;
+    ssize_t n;
+    pid_t pid;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1)
+        _exit(0); // The shell is already gone
+
+    // Hold nothing of the shell's open: no terminal, no pipe to a driver
+    if ((null = open("/dev/null", O_RDWR)) >= 0)
+    {
+        for (k = 0; k < 3; k++)
+            dup2(null, k);
+    }
+    dup2(sock, 3);
+    sock = 3;
+    close_range(4, ~0U, 0);
+
+    // Keyboard signals are for the shell and its jobs. Blocked, those
+    // sent to a child before zygote_exec restores their actions wait
+    // for it rather than being ignored
+    Signal(SIGINT, SIG_IGN);
+    Signal(SIGTSTP, SIG_IGN);
+    Signal(SIGQUIT, SIG_IGN);
+    Signal(SIGTTIN, SIG_IGN);
+    Signal(SIGTTOU, SIG_IGN);
+    sigemptyset(&keys);
+    sigaddset(&keys, SIGINT);
+    sigaddset(&keys, SIGTSTP);
+    sigaddset(&keys, SIGQUIT);
+    sigaddset(&keys, SIGTTIN);
+    sigaddset(&keys, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &keys, NULL);
+
+    while (1)
+    {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+        if ((n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            _exit(0);
+
+        fds[0] = fds[1] = fds[2] = -1;
+        cm = CMSG_FIRSTHDR(&mh);
+        if (cm && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+            memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+        if (fds[2] < 0 || (size_t)n < sizeof(struct spawnmsg_t))
+            pid = -EINVAL;
+        else if ((pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0)) == 0)
+            zygote_exec(msg, n, fds);
+        else if (pid < 0)
+            pid = -errno;
+
+        for (k = 0; k < 3; k++)
+            if (fds[k] >= 0)
+                close(fds[k]);
+        if (send(sock, &pid, sizeof(pid), MSG_NOSIGNAL) < 0)
+            _exit(0);
+    }
+}
+
+/*
+ * zygote_exec - In a child of the spawn helper, set up the command
+ *    described by the request msg of n bytes as runpipeline's children
+ *    do, on the descriptors fds, and exec it.
+ */
+void zygote_exec(char *msg, size_t n, int fds[3])
+{
+    struct spawnmsg_t *m = (struct spawnmsg_t *)msg;
+    char *files[3] = {NULL, NULL, NULL}, **vec;
+    char *p = msg + sizeof(*m), *end = msg + n;
+    sigset_t mask;
+    int k;
+
+    msg[n - 1] = '\0'; // Every string ends inside the message
+    if ((vec = malloc((m->nargs + m->nenv + 2) * sizeof(char *))) == NULL)
+        _exit(1);
+    for (k = 0; k < 3; k++)
+    {
+        if (m->redirs & 1 << k)
+        {
+            files[k] = p;
+            p += strlen(p) + 1;
+        }
+    }
+    for (k = 0; k < m->nargs + m->nenv && p < end; k++)
+    {
+        vec[k + (k >= m->nargs)] = p;
+        p += strlen(p) + 1;
+    }
+    if (k < m->nargs + m->nenv || m->nargs == 0)
+        _exit(1);
+    vec[m->nargs] = NULL;
+    vec[m->nargs + 1 + m->nenv] = NULL;
+
+    setpgid(0, m->pgid);
+    for (k = 0; k < 3; k++)
+        dup2(fds[k], k); // Clears close-on-exec on the copies
+    close_range(3, ~0U, 0);
+    Signal(SIGINT, SIG_DFL);
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGQUIT, SIG_DFL);
+    Signal(SIGTTIN, SIG_DFL);
+    Signal(SIGTTOU, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    applymods(&m->mods);
+    if (redirect(files[0], files[1], files[2], m->append_out) < 0)
+        _exit(1);
+    environ = vec + m->nargs + 1; // The PATH search uses it too
+    execvpe(vec[0], vec, environ);
+    perror("Command execution error");
+    _exit(1);
+}
+
+/*
+ * zygote_spawn - Start the command argv (with the shell's environment)
+ *    through the spawn helper, on the descriptors fds, in process group
+ *    pgid (0 for a new one), with the modifiers and redirections of its
+ *    stage. A here-document (<&N) becomes its stdin. Return its pid, or
+ *    -1 if the helper cannot start it, and the caller forks instead, as
+ *    it does for >&N and 2>&N (the numbers are the shell's descriptors).
+ */
+pid_t zygote_spawn(char **argv, int fds[3], pid_t pgid, struct cmdmods_t *mods,
+                   char *infile, char *outfile, char *errfile, int append_out)
+{
+    static char msg[ZYGOTEMSG];
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct spawnmsg_t *m = (struct spawnmsg_t *)msg;
+    char *files[3] = {infile, outfile, errfile}, **envp = buildenv();
+    int in[3] = {fds[0], fds[1], fds[2]}, k;
+    size_t len = sizeof(*m), n;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    pid_t pid;
+
+    if ((outfile && outfile[0] == '&') || (errfile && errfile[0] == '&'))
+        return -1;
+    if (infile && infile[0] == '&' && isdigit(infile[1]))
+    {
+        in[0] = atoi(infile + 1);
+        files[0] = NULL;
+    }
+    memset(m, 0, sizeof(*m));
+    m->pgid = pgid;
+    m->append_out = append_out;
+    m->mods = *mods;
+    for (k = 0; k < 3; k++)
+    {
+        if (files[k] == NULL)
+            continue;
+        m->redirs |= 1 << k;
+        if ((n = strlen(files[k]) + 1) > sizeof(msg) - len)
+            return -1;
+        memcpy(msg + len, files[k], n);
+        len += n;
+    }
+    for (k = 0; argv[k]; k++, m->nargs++)
+    {
+        if ((n = strlen(argv[k]) + 1) > sizeof(msg) - len)
+            return -1;
+        memcpy(msg + len, argv[k], n);
+        len += n;
+    }
+    for (k = 0; envp[k]; k++, m->nenv++)
+    {
+        if ((n = strlen(envp[k]) + 1) > sizeof(msg) - len)
+            return -1; // A huge environment: fork
+        memcpy(msg + len, envp[k], n);
+        len += n;
+    }
+
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(in));
+    memcpy(CMSG_DATA(cm), in, sizeof(in));
+
+    if (sendmsg(zygotefd, &mh, MSG_NOSIGNAL) < 0)
+    {
+        if (errno == EPIPE || errno == ECONNRESET) // The helper died: stop asking it
+        {
+            close(zygotefd);
+            zygotefd = -1;
+        }
+        return -1;
+    }
+    while ((n = recv(zygotefd, &pid, sizeof(pid), 0)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(pid))
+    {
+        close(zygotefd);
+        zygotefd = -1;
+        return -1;
+    }
+    return pid > 0 ? pid : -1;
+}
+
+/*******************
+ * Session recording
+ *******************/
+
+/*
+ * record_start - Start writing the session log for tsh -R: RECMAGIC,
+ *    then one event per input line read and per SIGINT or SIGTSTP
+ *    received, which tshreplay plays back (see record).
+ */
+void record_start(const char *path)
+{
+    if ((recfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0 ||
+        write(recfd, RECMAGIC, strlen(RECMAGIC)) != (ssize_t)strlen(RECMAGIC))
+    {
+        printf("%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    reclast = (long)(monotime() * 1e6);
+}
+
+/*
+ * record - Append an event to the session log, if there is one: a kind
+ *    byte ('L' a command line, 'C' a continuation line of a here-
+ *    document, 'I' SIGINT, 'T' SIGTSTP, lower case if there was no
+ *    foreground job to forward it to), the microseconds since the
+ *    previous event and, for a line, its length and bytes, the numbers
+ *    as LEB128 varints. Each event is one write(2), so the signal
+ *    handlers can call this too.
+ */
+void record(int kind, const char *text, size_t len)
+{
+    unsigned char buf[MAXLINE + 24];
+    unsigned long v[2];
+    int olderrno = errno, i, nv = text != NULL ? 2 : 1;
+    size_t n = 0;
+    sigset_t mask_all, prev_all;
+    long now;
+
+    if (recfd < 0)
+        return;
+    if (len > MAXLINE)
+        len = MAXLINE;
+    sigfillset(&mask_all); // The clock and the log advance together
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+    now = (long)(monotime() * 1e6);
+    v[0] = now > reclast ? now - reclast : 0;
+    v[1] = len;
+    reclast = now;
+    buf[n++] = kind;
+    for (i = 0; i < nv; i++)
+    {
+        for (; v[i] >= 0x80; v[i] >>= 7)
+            buf[n++] = (v[i] & 0x7f) | 0x80;
+        buf[n++] = v[i];
+    }
+    if (text != NULL)
+    {
+        memcpy(buf + n, text, len);
+        n += len;
+    }
+    if (write(recfd, buf, n) != (ssize_t)n) // Stop rather than log a gap
+    {
+        close(recfd);
+        recfd = -1;
+    }
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    errno = olderrno;
+}
+
+/**************
+ * Result cache
+ **************/
+
+/*
+ * memo_path - The directory of the result cache, without making it: set
+ *    memodir, else ~/.cache/tsh-memo with the shell's HOME, else
+ *    /tmp/tsh-memo-UID.
+ */
+const char *memo_path(void)
+{
+    static char dflt[PATH_MAX];
+    char *home;
+
+    if (memodir != NULL)
+        return memodir;
+    if ((home = getvar("HOME", 4)) != NULL && *home && strlen(home) + 20 < sizeof(dflt))
+        sprintf(dflt, "%s/.cache/tsh-memo", home);
+    else
+        sprintf(dflt, "/tmp/tsh-memo-%d", (int)getuid());
+    return dflt;
+}
+
+/*
+ * memo_dir - The directory of the result cache (see memo_path), made if
+ *    need be, with ~/.cache for the default. NULL if it cannot be made.
+ */
+const char *memo_dir(void)
+{
+    const char *dir = memo_path();
+    char parent[PATH_MAX], *slash;
+    struct stat st;
+
+    if (memodir == NULL && (slash = strrchr(strcpy(parent, dir), '/')) != NULL)
+    {
+        *slash = '\0';
+        mkdir(parent, 0700);
+    }
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return NULL;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid())
+        return NULL; // Not ours to trust
+    return dir;
+}
+
+/*
+ * memo_key - Make the key of a memo command in memokey, and the path
+ *    of its cache entry, named by the key's FNV-1a hash, in path. The
+ *    key is the working directory, the assignments and env overrides,
+ *    the variables named by memoenv, the arguments, and the device,
+ *    inode, size and mtime of the input file and of every argument that
+ *    names a regular file. With no < the input is the shell's stdin if
+ *    that is a regular file, keyed with its offset too, else /dev/null
+ *    (see memo_fork). Returns its length, 0 if the command cannot be
+ *    cached: its input is a here-document, or the key is too long.
+ */
+size_t memo_key(char **args, int nassign, struct cmdmods_t *mods, char *infile, char *path)
+{
+    char *p = memokey, *name, *val;
+    const char *dir = memo_dir();
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    struct stat st;
+    size_t len;
+    int i;
+
+    if (dir == NULL || (infile && infile[0] == '&') || getcwd(p, MEMOKEY) == NULL)
+        return 0;
+    p += strlen(p) + 1;
+
+    for (i = 0; i < nassign; i++)
+        p = memo_keyadd(p, args[i], strlen(args[i]) + 1, NULL);
+    p = memo_keyadd(p, mods->env_clear ? "-i" : "--", 3, NULL);
+    for (i = 0; i < mods->nenv; i++)
+        p = memo_keyadd(p, mods->env[i], strlen(mods->env[i]) + 1, NULL);
+    for (name = memoenv; *name; name += len)
+    {
+        name += strspn(name, " ");
+        if ((len = strcspn(name, " ")) == 0)
+            break;
+        p = memo_keyadd(p, name, len, NULL);
+        if ((val = getvar(name, len)) != NULL) // NAME=VALUE, or NAME alone if unset
+            p = memo_keyadd(p, val, strlen(val), NULL);
+        p = memo_keyadd(p, "", 1, NULL);
+    }
+    p = memo_keyadd(p, "\n", 1, NULL);
+    for (i = nassign; args[i] != NULL; i++)
+        p = memo_keyadd(p, args[i], strlen(args[i]) + 1,
+                        stat(args[i], &st) == 0 && S_ISREG(st.st_mode) ? &st : NULL);
+    if (infile != NULL)
+    {
+        if (stat(infile, &st) < 0)
+            return 0; // The command is bound to fail
+        p = memo_keyadd(p, "<", 1, NULL);
+        p = memo_keyadd(p, infile, strlen(infile) + 1, &st);
+    }
+    else if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        off_t off = lseek(STDIN_FILENO, 0, SEEK_CUR);
+
+        p = memo_keyadd(p, "<", 1, NULL);
+        p = memo_keyadd(p, &off, sizeof(off), &st);
+    }
+    else
+        p = memo_keyadd(p, "</dev/null", 11, NULL);
+    if (p == NULL)
+        return 0;
+
+    len = p - memokey;
+    for (i = 0; i < (int)len; i++)
+        h = (h ^ (unsigned char)memokey[i]) * 1099511628211ULL;
+    if (snprintf(path, PATH_MAX, "%s/%016llx", dir, (unsigned long long)h) >= PATH_MAX)
+        return 0;
+    return len;
+}
 
-    if (argc == 0) // Ignore blank line
-        return 1;
+/*
+ * memo_keyadd - Add n bytes to the key at p and, for a file, its device,
+ *    inode, size and mtime in st. Returns the end, NULL once the key is
+ *    too long.
+ */
+char *memo_keyadd(char *p, const void *data, size_t n, struct stat *st)
+{
+    uint64_t id[5];
 
-    if ((bg = (*argv[argc - 1] == '&')) != 0)
+    if (p == NULL || (size_t)(memokey + MEMOKEY - p) < n + (st ? sizeof(id) : 0))
+        return NULL;
+    memcpy(p, data, n);
+    p += n;
+    if (st != NULL)
     {
-        argv[--argc] = NULL;
+        id[0] = st->st_dev;
+        id[1] = st->st_ino;
+        id[2] = st->st_size;
+        id[3] = st->st_mtim.tv_sec;
+        id[4] = st->st_mtim.tv_nsec;
+        memcpy(p, id, sizeof(id));
+        p += sizeof(id);
     }
-
-    return bg;
+    return p;
 }
 
 /*
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.
+ * memo_hit - Answer a memo command from the result cache, if its entry
+ *    is there: copy its stdout and stderr to the command's redirections
+ *    with sendfile, with no process started, and leave its status in
+ *    last_status. The entry becomes the most recently used. Returns 1
+ *    if it was answered, else 0 (the command runs, see memo_fork).
  */
-int builtin_cmd(char **argv)
+int memo_hit(char **args, int nassign, struct cmdmods_t *mods, char *infile, char *outfile, char *errfile,
+             int append_out)
 {
-    // For quit command
-    if (strcmp(argv[0], "quit") == 0)
+    char path[PATH_MAX], *key;
+    struct memohdr_t hdr;
+    struct stat st;
+    int fd, saved[3], hit = 0;
+    size_t len;
+
+    if ((len = memo_key(args, nassign, mods, infile, path)) == 0 ||
+        (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && memcmp(hdr.magic, MEMOMAGIC, 8) == 0 &&
+        hdr.keylen == len && fstat(fd, &st) == 0 &&
+        (uint64_t)st.st_size == sizeof(hdr) + len + hdr.outlen + hdr.errlen && (key = malloc(len)) != NULL)
     {
-        exit(0);
+        hit = pread(fd, key, len, sizeof(hdr)) == (ssize_t)len && memcmp(key, memokey, len) == 0;
+        free(key); // A hash collision, or a torn entry, runs the command
     }
-    // For jobs command
-    else if (strcmp(argv[0], "jobs") == 0)
+    if (!hit)
     {
-        listjobs(jobs);
-        return 1;
+        close(fd);
+        return 0;
     }
-    // For bg and fg commands
-    else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0)
+
+    futimens(fd, NULL); // Most recently used
+    if (saveredirs(saved, NULL, outfile, errfile, append_out) == 0)
     {
-        do_bgfg(argv);
-        return 1;
+        memo_copy(STDOUT_FILENO, fd, sizeof(hdr) + len, hdr.outlen);
+        memo_copy(STDERR_FILENO, fd, sizeof(hdr) + len + hdr.outlen, hdr.errlen);
+        last_status = hdr.status;
     }
-    return 0; // Not a built-in command
+    else
+        last_status = 1;
+    restorefds(saved);
+    close(fd);
+    return 1;
 }
 
 /*
- * do_bgfg - Execute the builtin bg and fg commands
+ * memo_fork - Run a memo command the cache missed, in the job's process
+ *    after its redirections: fork the command onto pipes and relay what
+ *    it writes to the redirections and into a new cache entry, which is
+ *    linked into the cache if it exits (rather than dies) and fits in
+ *    memosize. Exits as the command did. A command with no < reads
+ *    /dev/null unless the shell's stdin is a regular file: a terminal
+ *    or pipe is not part of the key. Returns, in the command's process,
+ *    or at once if the command cannot be cached.
  */
-void do_bgfg(char **argv)
+void memo_fork(char **args, int nassign, struct cmdmods_t *mods, char *infile)
 {
-    struct job_t *job;  // Pointer to the job structure
-    char *id = argv[1]; // The job ID or process ID argument
-    int jid;            // Job ID
-    pid_t pid;          // Process ID
+    char path[PATH_MAX], proc[64], buf[65536];
+    struct pollfd pfd[2];
+    struct memohdr_t hdr;
+    struct stat st;
+    int out[2], err[2], data, errdata, status, k, nopen = 2, keep = 1;
+    uint64_t lens[2] = {0, 0};
+    size_t len;
+    ssize_t n;
+    pid_t pid;
 
-    // Check if the argument is provided
-    if (id == NULL)
+    if ((len = memo_key(args, nassign, mods, infile, path)) == 0 ||
+        (data = open(memo_dir(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+        return;
+    if ((errdata = open(memo_dir(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0 || pipe2(out, O_CLOEXEC) < 0 ||
+        pipe2(err, O_CLOEXEC) < 0)
     {
-        printf("%s command requires PID or %%jobid argument\n", argv[0]);
+        close(data);
         return;
     }
-
-    // Check if the argument is a job ID (starts with '%')
-    if (id[0] == '%')
+    if (infile == NULL && (fstat(STDIN_FILENO, &st) < 0 || !S_ISREG(st.st_mode)) &&
+        (k = open("/dev/null", O_RDONLY)) >= 0)
     {
-        jid = atoi(&id[1]);         // Convert job ID string to integer
-        job = getjobjid(jobs, jid); // Get the job structure by job ID
-        if (job == NULL)
+        dup2(k, STDIN_FILENO);
+        close(k);
+    }
+    Signal(SIGCHLD, SIG_DFL); // The shell's handler would reap the command
+    if ((pid = fork()) <= 0)
+    {
+        if (pid == 0)
         {
-            printf("%s: No such job\n", id);
-            return;
+            dup2(out[1], STDOUT_FILENO);
+            dup2(err[1], STDERR_FILENO);
         }
-        pid = job->pid; // Get the process ID from the job structure
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        close(data);
+        close(errdata);
+        return;
     }
-    // Check if the argument is a process ID (a digit)
-    else if (isdigit(id[0]))
+    close(out[1]);
+    close(err[1]);
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (write(data, &hdr, sizeof(hdr)) != sizeof(hdr) || write(data, memokey, len) != (ssize_t)len)
+        keep = 0;
+    pfd[0].fd = out[0];
+    pfd[1].fd = err[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (nopen > 0)
     {
-        pid = atoi(id);             // Convert process ID string to integer
-        job = getjobpid(jobs, pid); // Get the job structure by process ID
-        if (job == NULL)
+        if (poll(pfd, 2, -1) < 0)
         {
-            printf("(%d): No such process\n", pid);
-            return;
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (k = 0; k < 2; k++)
+        {
+            if (pfd[k].fd < 0 || !(pfd[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            if ((n = read(pfd[k].fd, buf, sizeof(buf))) <= 0)
+            {
+                close(pfd[k].fd);
+                pfd[k].fd = -1;
+                nopen--;
+                continue;
+            }
+            lens[k] += n;
+            if (write(k + 1, buf, n) != n) // To the redirection, as the command would
+                keep = 0;
+            if (keep && (lens[0] + lens[1] > (uint64_t)memosize || write(k ? errdata : data, buf, n) != n))
+                keep = 0;
         }
     }
-    // Invalid argument format
-    else
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    if (keep && WIFEXITED(status) && memo_copy(data, errdata, 0, lens[1]) == 0)
     {
-        printf("%s: argument must be a PID or %%jobid\n", argv[0]);
-        return;
+        memcpy(hdr.magic, MEMOMAGIC, 8);
+        hdr.status = WEXITSTATUS(status);
+        hdr.keylen = len;
+        hdr.outlen = lens[0];
+        hdr.errlen = lens[1];
+        sprintf(proc, "/proc/self/fd/%d", data);
+        if (pwrite(data, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0 ||
+             (errno == EEXIST && unlink(path) == 0 && linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0)))
+            memo_evict(memo_dir());
     }
-
-    // Send the SIGCONT signal to the job's process group
-    if (kill(-pid, SIGCONT) < 0)
-        unix_error("kill (SIGCONT) error");
-
-    // If the command is 'fg', bring the job to the foreground
-    if (strcmp(argv[0], "fg") == 0)
+    if (WIFSIGNALED(status))
     {
-        job->state = FG;  // Set job state to foreground
-        waitfg(job->pid); // Wait for the job to finish
+        Signal(WTERMSIG(status), SIG_DFL);
+        kill(getpid(), WTERMSIG(status)); // Die as the command did
     }
-    // If the command is 'bg', resume the job in the background
-    else if (strcmp(argv[0], "bg") == 0)
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/*
+ * memo_copy - Copy len bytes at off in from to to, with sendfile, or
+ *    read and write where sendfile cannot. Returns 0, or -1 on error.
+ */
+int memo_copy(int to, int from, off_t off, size_t len)
+{
+    char buf[65536];
+    ssize_t n;
+
+    while (len > 0)
     {
-        job->state = BG;                                          // Set job state to background
-        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline); // Print job details
+        if ((n = sendfile(to, from, &off, len)) < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            if ((n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), off)) > 0 &&
+                (n = write(to, buf, n)) > 0)
+                off += n;
+        }
+        if (n <= 0)
+            return -1;
+        len -= n;
     }
+    return 0;
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * memo_evict - Bring the result cache in dir within memosize bytes by
+ *    removing its least recently used entries (memo_hit touches them).
  */
-void waitfg(pid_t pid)
+void memo_evict(const char *dir)
 {
-    while (pid == fgpid(jobs))
+    struct memoent_t *ents = NULL, *e;
+    int dfd, n = 0, max = 0, i;
+    long total = 0;
+    struct dirent *d;
+    struct stat st;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    dfd = dirfd(dp);
+    while ((d = readdir(dp)) != NULL)
+    {
+        if (strlen(d->d_name) != 16 || strspn(d->d_name, "0123456789abcdef") != 16 ||
+            fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (n == max)
+        {
+            if ((e = realloc(ents, (max ? 2 * max : 64) * sizeof(*ents))) == NULL)
+                break;
+            ents = e;
+            max = max ? 2 * max : 64;
+        }
+        ents[n].used = st.st_mtim;
+        ents[n].size = st.st_size;
+        strcpy(ents[n++].name, d->d_name);
+        total += st.st_size;
+    }
+    if (total > memosize)
     {
-        usleep(1000); // Sleep for 1 millisecond
+        qsort(ents, n, sizeof(*ents), cmpmemoent);
+        for (i = 0; i < n && total > memosize; i++)
+            if (unlinkat(dfd, ents[i].name, 0) == 0)
+                total -= ents[i].size;
     }
+    free(ents);
+    closedir(dp);
+}
+
+/* cmpmemoent - Order cache entries from least to most recently used */
+int cmpmemoent(const void *a, const void *b)
+{
+    const struct timespec *x = &((const struct memoent_t *)a)->used, *y = &((const struct memoent_t *)b)->used;
+
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
 }
 
 /*****************
@@ -589,7 +6643,9 @@ void waitfg(pid_t pid)
 /*
  * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
  *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     received a SIGSTOP or SIGTSTP signal, or continues after one.
+ *     Orphaned descendants of jobs are the shell's children too (it
+ *     is their subreaper), and are reaped here. The handler reaps all
  *     available zombie children, but doesn't wait for any other
  *     currently running children to terminate.
  */
@@ -597,8 +6653,10 @@ void sigchld_handler(int sig)
 {
     int olderrno = errno;        // Save the old errno value
     sigset_t mask_all, prev_all; // Signal masks for blocking/unblocking signals
+    struct job_t *job;           // Job the reaped child belongs to
+    struct rusage ru;            // Resources used by the reaped child
     pid_t pid;
-    int status;
+    int status, idx;
 
     sigfillset(&mask_all); // Initialize mask_all to block all signals
     // // check for error
@@ -607,49 +6665,88 @@ void sigchld_handler(int sig)
     //     unix_error("sigfillset error");
     // }
 
-    // Reap all available zombie children
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0)
+    // Reap all available zombie children, with all signals blocked once
+    // for the whole burst rather than around each one
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all); // Block all signals
+    // check for error
+    // if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
+    // {
+    //     unix_error("sigprocmask error");
+    // }
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
     {
-        sigprocmask(SIG_BLOCK, &mask_all, &prev_all); // Block all signals
-        // check for error
-        // if (sigprocmask(SIG_BLOCK, &mask_all, &prev_all) < 0)
-        // {
-        //     unix_error("sigprocmask error");
-        // }
-
+        if ((job = getjobproc(jobs, pid, &idx)) == NULL)
+        {
+            dag_reaped(pid, status); // Not a job, perhaps a DAG node
+        }
         // Check if the child was stopped by a signal
-        if (WIFSTOPPED(status))
+        else if (WIFSTOPPED(status))
         {
-            struct job_t *job = getjobpid(jobs, pid); // Get the job structure by process ID
-            if (job != NULL)
+            if (job->state != ST)
             {
+                if (job->state == FG)
+                    fg_status = exitcode(status);
                 job->state = ST; // Set job state to stopped
-                printf("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
+                if (job_control && jobmsgs)
+                    printf("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
             }
-        }
-        // Check if the child was terminated by a signal
-        else if (WIFSIGNALED(status))
-        {
-            struct job_t *job = getjobpid(jobs, pid); // Get the job structure by process ID
-            if (job != NULL)
+            if (wait_target == job->pid) // Hand the status to the wait builtin
             {
-                printf("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
-                deletejob(jobs, pid); // Delete the job from the job list
+                wait_status = exitcode(status);
+                wait_target = 0;
             }
         }
-        // Check if the child exited normally
-        else if (WIFEXITED(status))
+        // A stopped job continued by someone else (kill -CONT) runs in the background
+        else if (WIFCONTINUED(status))
         {
-            deletejob(jobs, pid); // Delete the job from the job list
+            if (job->state == ST)
+                job->state = BG;
         }
+        // The child terminated, normally or by a signal
+        else
+        {
+            job->procs[idx] = 0;
+            addrusage(&job->ru, &ru);
+            if (idx == job->nprocs - 1) // The last stage decides the job's status
+            {
+                job->status = exitcode(status);
+                job->how = status;
+            }
+
+            // Report a signal death once per job (SIGPIPE is normal mid-pipeline)
+            if (WIFSIGNALED(status) && !job->signaled && (WTERMSIG(status) != SIGPIPE || idx == job->nprocs - 1))
+            {
+                job->signaled = 1;
+                if (job_control && jobmsgs)
+                    printf("Job [%d] (%d) terminated by signal %d%s\n", job->jid, job->pid, WTERMSIG(status),
+                           job->timedout ? " (timed out)" : "");
+            }
 
-        sigprocmask(SIG_SETMASK, &prev_all, NULL); // Restore previous signal mask
-        // check for error
-        // if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
-        // {
-        //     unix_error("sigprocmask error");
-        // }
+            if (--job->nlive == 0) // Whole job is done
+            {
+                if (job->state == FG)
+                {
+                    fg_status = job->status;
+                    fg_sigint = WIFSIGNALED(job->how) && WTERMSIG(job->how) == SIGINT;
+                }
+                if (wait_target == job->pid || (wait_target == -1 && job->state == BG))
+                {
+                    wait_status = job->status;
+                    wait_target = 0;
+                }
+                if (serving)
+                    serve_reaped(job);
+                donejob(job);              // Remember it for jobs -a and wait
+                deletejob(jobs, job->pid); // Delete the job from the job list
+            }
+        }
     }
+    sigprocmask(SIG_SETMASK, &prev_all, NULL); // Restore previous signal mask
+    // check for error
+    // if (sigprocmask(SIG_SETMASK, &prev_all, NULL) < 0)
+    // {
+    //     unix_error("sigprocmask error");
+    // }
     // check for error
     // if (pid < 0 && errno != ECHILD)
     // {
@@ -669,9 +6766,14 @@ void sigint_handler(int sig)
 {
     pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
 
-    if (fg_pid != 0)
+    record(fg_pid != 0 ? 'I' : 'i', NULL, 0);
+    if (fg_pid == 0)
     {
-        if (kill(-fg_pid, SIGINT) < 0)
+        sigint_seen = 1; // Interrupts the wait builtin
+    }
+    else
+    {
+        if (signaljob(getjobpid(jobs, fg_pid), SIGINT) < 0)
         { // Send SIGINT to the process group
             perror("kill (sigint_handler)");
         }
@@ -687,15 +6789,71 @@ void sigtstp_handler(int sig)
 {
     pid_t fg_pid = fgpid(jobs); // Get the PID of the foreground job
 
+    record(fg_pid != 0 ? 'T' : 't', NULL, 0);
     if (fg_pid != 0)
     {
-        if (kill(-fg_pid, SIGTSTP) < 0)
+        if (signaljob(getjobpid(jobs, fg_pid), SIGTSTP) < 0)
         { // Send SIGTSTP to the process group
             perror("kill (sigtstp_handler)");
         }
     }
 }
 
+/*
+ * sigalrm_handler - The interval timer fires when the earliest job
+ *    deadline has passed. Send an expired job's process group its
+ *    timeout signal (SIGTERM by default) and, if it is still around
+ *    after the grace period, SIGKILL. Then rearm for the next deadline.
+ */
+void sigalrm_handler(int sig)
+{
+    int olderrno = errno;
+    sigset_t mask_all, prev_all;
+    double now = monotime();
+    int i;
+
+    sigfillset(&mask_all);
+    sigprocmask(SIG_BLOCK, &mask_all, &prev_all);
+
+    for (i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].pid != 0 && jobs[i].deadline > 0 && jobs[i].deadline <= now)
+        {
+            if (jobs[i].timedout) // Grace period is over
+            {
+                jobs[i].deadline = 0;
+                signaljob(&jobs[i], SIGKILL);
+                continue;
+            }
+            jobs[i].timedout = 1;
+            jobs[i].deadline = jobs[i].grace > 0 ? now + jobs[i].grace : 0;
+            signaljob(&jobs[i], jobs[i].timeout_sig);
+            if (jobs[i].state == ST) // A stopped job must run to see it
+                signaljob(&jobs[i], SIGCONT);
+        }
+    }
+    timer_rearm();
+
+    sigprocmask(SIG_SETMASK, &prev_all, NULL);
+    errno = olderrno;
+}
+
+/*
+ * sigio_handler - The kernel sends a SIGIO when a background job with a
+ *    log (set joblog on) writes to its pipe. Drain every log's pipe, so
+ *    the job never blocks on a full pipe while the shell waits for input.
+ */
+void sigio_handler(int sig)
+{
+    int olderrno = errno;
+    int i;
+
+    for (i = 0; i < MAXJOBLOGS; i++)
+        if (joblogs[i].pid != 0 && joblogs[i].fd >= 0)
+            joblog_drain(&joblogs[i]);
+    errno = olderrno;
+}
+
 /*********************
  * End signal handlers
  *********************/
@@ -711,6 +6869,18 @@ void clearjob(struct job_t *job)
     job->jid = 0;
     job->state = UNDEF;
     job->cmdline[0] = '\0';
+    job->deadline = 0;
+    job->grace = 0;
+    job->timeout_sig = 0;
+    job->timedout = 0;
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->status = 0;
+    job->signaled = 0;
+    job->pidfd = -1;
+    job->started = 0;
+    job->how = 0;
+    memset(&job->ru, 0, sizeof(job->ru));
 }
 
 /* initjobs - Initialize the job list */
@@ -720,17 +6890,67 @@ void initjobs(struct job_t *jobs)
 
     for (i = 0; i < MAXJOBS; i++)
         clearjob(&jobs[i]);
+    jid_reset();
 }
 
-/* maxjid - Returns largest allocated job ID */
-int maxjid(struct job_t *jobs)
+/* jid_reset - Mark every job ID free but 0 */
+void jid_reset(void)
 {
-    int i, max = 0;
+    memset(jidused, 0, sizeof(jidused));
+    memset(jidany, 0, sizeof(jidany));
+    memset(jidroom, 0xff, sizeof(jidroom));
+    jidroomsum = ~0ULL;
+    jidused[0] = jidany[0] = jidanysum = 1;
+}
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid > max)
-            max = jobs[i].jid;
-    return max;
+/* jid_max - Returns largest allocated job ID, 0 if there is none */
+int jid_max(void)
+{
+    int v = 63 - __builtin_clzll(jidanysum);
+    int w = v * 64 + 63 - __builtin_clzll(jidany[v]);
+
+    return w * 64 + 63 - __builtin_clzll(jidused[w]);
+}
+
+/*
+ * jid_alloc - Allocate the job ID after the largest one in use, or
+ *    the smallest free one once that would reach MAXJID. Returns 0 if
+ *    every ID is in use.
+ */
+int jid_alloc(void)
+{
+    int jid = jid_max() + 1, v, w;
+
+    if (jid >= MAXJID)
+    {
+        if (jidroomsum == 0)
+            return 0;
+        v = __builtin_ctzll(jidroomsum);
+        w = v * 64 + __builtin_ctzll(jidroom[v]);
+        jid = w * 64 + __builtin_ctzll(~jidused[w]);
+    }
+    w = jid / 64;
+    v = w / 64;
+    jidused[w] |= 1ULL << (jid % 64);
+    jidany[v] |= 1ULL << (w % 64);
+    jidanysum |= 1ULL << v;
+    if (jidused[w] == ~0ULL && (jidroom[v] &= ~(1ULL << (w % 64))) == 0)
+        jidroomsum &= ~(1ULL << v);
+    return jid;
+}
+
+/* jid_free - Release a job ID */
+void jid_free(int jid)
+{
+    int w = jid / 64, v = w / 64;
+
+    if (jid < 1 || jid >= MAXJID)
+        return;
+    jidused[w] &= ~(1ULL << (jid % 64));
+    if (jidused[w] == 0 && (jidany[v] &= ~(1ULL << (w % 64))) == 0)
+        jidanysum &= ~(1ULL << v);
+    jidroom[v] |= 1ULL << (w % 64);
+    jidroomsum |= 1ULL << v;
 }
 
 /* addjob - Add a job to the job list */
@@ -746,10 +6966,16 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
         if (jobs[i].pid == 0)
         {
             jobs[i].pid = pid;
+            jobs[i].procs[0] = pid;
+            jobs[i].nprocs = jobs[i].nlive = 1;
             jobs[i].state = state;
-            jobs[i].jid = nextjid++;
-            if (nextjid > MAXJOBS)
-                nextjid = 1;
+            jobs[i].pidfd = syscall(SYS_pidfd_open, pid, 0); // -1 on kernels without pidfds
+            jobs[i].started = monotime();
+            if ((jobs[i].jid = jid_alloc()) == 0)
+            {
+                clearjob(&jobs[i]);
+                break;
+            }
             strcpy(jobs[i].cmdline, cmdline);
             if (verbose)
             {
@@ -762,6 +6988,16 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
     return 0;
 }
 
+/* addproc - Add another pipeline process to a job */
+int addproc(struct job_t *job, pid_t pid)
+{
+    if (pid < 1 || job->nprocs == MAXPROCS)
+        return 0;
+    job->procs[job->nprocs++] = pid;
+    job->nlive++;
+    return 1;
+}
+
 /* deletejob - Delete a job whose PID=pid from the job list */
 int deletejob(struct job_t *jobs, pid_t pid)
 {
@@ -774,8 +7010,10 @@ int deletejob(struct job_t *jobs, pid_t pid)
     {
         if (jobs[i].pid == pid)
         {
+            jid_free(jobs[i].jid);
+            if (jobs[i].pidfd >= 0)
+                close(jobs[i].pidfd);
             clearjob(&jobs[i]);
-            nextjid = maxjid(jobs) + 1;
             return 1;
         }
     }
@@ -806,6 +7044,69 @@ struct job_t *getjobpid(struct job_t *jobs, pid_t pid)
     return NULL;
 }
 
+/* getjobproc - Find the job (by the PID of any live process) and the
+ * process's index in it */
+struct job_t *getjobproc(struct job_t *jobs, pid_t pid, int *idx)
+{
+    int i, j;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        for (j = 0; j < jobs[i].nprocs; j++)
+            if (jobs[i].procs[j] == pid)
+            {
+                *idx = j;
+                return &jobs[i];
+            }
+    return NULL;
+}
+
+/* pidfd_send_signal(2) flag: signal the process group (Linux 6.9) */
+#ifndef PIDFD_SIGNAL_PROCESS_GROUP
+#define PIDFD_SIGNAL_PROCESS_GROUP (1U << 2)
+#endif
+
+/*
+ * signaljob - Send sig to a job: to its process group under job control,
+ *    else to each of its live processes. The group is named by the
+ *    leader's pidfd, which keeps naming it after the leader is reaped,
+ *    so a recycled PID is never signaled; kernels without pidfds or
+ *    PIDFD_SIGNAL_PROCESS_GROUP get kill(2). SIGCHLD stays blocked
+ *    throughout, so no PID used here is reaped until it is done.
+ */
+int signaljob(struct job_t *job, int sig)
+{
+    sigset_t mask, prev;
+    int j, rc = 0;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (job == NULL || job->pid == 0) // Deleted since it was looked up
+    {
+        errno = ESRCH;
+        rc = -1;
+    }
+    else if (job_control)
+    {
+        rc = -1;
+        errno = EINVAL;
+        if (job->pidfd >= 0)
+            rc = syscall(SYS_pidfd_send_signal, job->pidfd, sig, NULL, PIDFD_SIGNAL_PROCESS_GROUP);
+        if (rc < 0 && errno == EINVAL)
+            rc = kill(-job->pid, sig);
+    }
+    else
+    {
+        for (j = 0; j < job->nprocs; j++)
+            if (job->procs[j] != 0 && kill(job->procs[j], sig) < 0)
+                rc = -1;
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+    return rc;
+}
+
 /* getjobjid  - Find a job (by JID) on the job list */
 struct job_t *getjobjid(struct job_t *jobs, int jid)
 {
@@ -863,6 +7164,96 @@ void listjobs(struct job_t *jobs)
         }
     }
 }
+
+/* addrusage - Add the resources a reaped process used to a job's */
+void addrusage(struct rusage *sum, const struct rusage *ru)
+{
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss; // The largest process, not the sum
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_inblock += ru->ru_inblock;
+    sum->ru_oublock += ru->ru_oublock;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/*
+ * donejob - Copy a job that has completed into the ring of completed
+ *    jobs, over the oldest one once the ring is full. It runs in
+ *    sigchld_handler just before deletejob, so it only copies: nothing
+ *    is allocated or freed however fast jobs come and go.
+ */
+void donejob(struct job_t *job)
+{
+    struct donejob_t *done = &donejobs[ndonejobs % MAXDONE];
+
+    done->pid = job->pid;
+    done->jid = job->jid;
+    strcpy(done->cmdline, job->cmdline);
+    done->status = job->status;
+    done->how = job->how;
+    done->started = job->started;
+    done->ended = monotime();
+    done->endtime = time(NULL);
+    done->ru = job->ru;
+    ndonejobs++;
+}
+
+/*
+ * getdone - Find the most recent completed job with job ID jid, or if
+ *    jid is 0 with process ID pid; NULL if the ring has none. Callers
+ *    block SIGCHLD.
+ */
+struct donejob_t *getdone(int jid, pid_t pid)
+{
+    unsigned long k;
+    struct donejob_t *done;
+
+    for (k = ndonejobs; k > 0 && ndonejobs - k < MAXDONE; k--)
+    {
+        done = &donejobs[(k - 1) % MAXDONE];
+        if (jid > 0 ? done->jid == jid : pid > 0 && done->pid == pid)
+            return done;
+    }
+    return NULL;
+}
+
+/*
+ * listdone - Print the completed jobs in the ring, oldest first: how
+ *    each ended, when, its elapsed, user and system time, and the
+ *    largest resident set of its processes.
+ */
+void listdone(void)
+{
+    sigset_t mask, prev;
+    unsigned long k;
+    struct donejob_t *done;
+    struct tm tm;
+    char how[32];
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    for (k = ndonejobs > MAXDONE ? ndonejobs - MAXDONE : 0; k < ndonejobs; k++)
+    {
+        done = &donejobs[k % MAXDONE];
+        if (WIFSIGNALED(done->how))
+            sprintf(how, "Signal %d", WTERMSIG(done->how));
+        else if (done->status != 0)
+            sprintf(how, "Exit %d", done->status);
+        else
+            strcpy(how, "Done");
+        localtime_r(&done->endtime, &tm);
+        printf("[%d] (%d) %-10s %02d:%02d:%02d real %.3fs user %.3fs sys %.3fs maxrss %ldK %s",
+               done->jid, done->pid, how, tm.tm_hour, tm.tm_min, tm.tm_sec, done->ended - done->started,
+               done->ru.ru_utime.tv_sec + done->ru.ru_utime.tv_usec / 1e6,
+               done->ru.ru_stime.tv_sec + done->ru.ru_stime.tv_usec / 1e6, done->ru.ru_maxrss, done->cmdline);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
 /******************************
  * end job list helper routines
  ******************************/
@@ -876,10 +7267,13 @@ void listjobs(struct job_t *jobs)
  */
 void usage(void)
 {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [-R log] [script]\n");
+    printf("       shell --serve socket\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -R log   record input lines and signals in log for tshreplay\n");
+    printf("   --serve socket   run jobs for clients of a Unix socket\n");
     exit(1);
 }
 
@@ -901,6 +7295,60 @@ void app_error(char *msg)
     exit(1);
 }
 
+/*
+ * exitcode - Convert a waitpid status to a shell exit status: the exit
+ *    code, or 128 plus the number of the signal that ended the process.
+ */
+int exitcode(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 0;
+}
+
+/*
+ * monotime - Return the monotonic clock in seconds
+ */
+double monotime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * timer_rearm - Arm the interval timer for the earliest job deadline, or
+ *    disarm it if no job has one. Call with SIGALRM blocked.
+ */
+void timer_rearm(void)
+{
+    struct itimerval it;
+    double next = 0, delta;
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid != 0 && jobs[i].deadline > 0 && (next == 0 || jobs[i].deadline < next))
+            next = jobs[i].deadline;
+
+    memset(&it, 0, sizeof(it));
+    if (next > 0)
+    {
+        delta = next - monotime();
+        if (delta < 1e-6) // Already expired; fire as soon as possible
+            delta = 1e-6;
+        it.it_value.tv_sec = (time_t)delta;
+        it.it_value.tv_usec = (suseconds_t)((delta - it.it_value.tv_sec) * 1e6);
+        if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0)
+            it.it_value.tv_usec = 1;
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 /*
  * Signal - wrapper for the sigaction function
  */
@@ -0,0 +1,369 @@
+/*
+ * tshbench.c - Microbenchmarks of the shell's hot paths, as JSON
+ *
+ * usage: tshbench [-s shell] [-n runs] [-e]
+ * Drives the shell (default ./tsh) through pipes, as the driver does,
+ * and times runs repetitions (default 200) of:
+ *   eval_true          a line running /bin/true, from write to prompt
+ *   line_to_exec       from write to the start of the command's main
+ *   exit_to_prompt     from the command's exit to the prompt, which
+ *                      covers its reaping by sigchld_handler
+ *   sigint_forward     from SIGINT to the shell until the foreground
+ *   sigtstp_forward    job's handler runs
+ * These work with any shell that prints "tsh> ", tshref included.
+ * Unless -e is given it also times, in this process, functions of the
+ * tsh.c it is built with:
+ *   parseline          one typical command line
+ *   jobtable_fill      addjob until the job table is full, then
+ *                      deletejob of each job, per operation
+ *   jobtable_lookup    getjobjid, getjobpid and getjobproc in a full
+ *                      table of full pipelines, per lookup
+ *   jid_16, jid_100k   jid_free of the oldest of 16 or 100000 job IDs
+ *                      in use and jid_alloc of another, per pair; IDs
+ *                      run up to MAXJID and then wrap to the lowest
+ *                      free one, so both ways of allocating are timed
+ * Times are in microseconds, or nanoseconds for the in-process ones.
+ * The shell runs tshbench -T and -S (see stamp and sigtarget) as its
+ * commands.
+ */
+#define main tsh_main
+#include "tsh.c"
+#undef main
+#include <poll.h>
+
+#define BENCHBUF 65536
+
+char *bench_shell = "./tsh";
+char bench_self[PATH_MAX];
+pid_t bench_pid;
+int bench_in, bench_out;                /* the shell's stdin and stdout */
+char bench_buf[BENCHBUF];               /* its output not yet consumed */
+size_t bench_len = 0;
+int bench_first = 1;                    /* no result printed yet */
+
+long nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* stamp - tshbench -T: print when main started and when it exits */
+int stamp(void)
+{
+    char line[64];
+    long t0 = nanos();
+
+    sprintf(line, "T %ld ", t0);
+    sprintf(line + strlen(line), "%ld\n", nanos());
+    if (write(STDOUT_FILENO, line, strlen(line)) < 0)
+	_exit(1);
+    _exit(0);
+}
+
+void sigtarget_handler(int sig)
+{
+    char line[64];
+
+    sprintf(line, "S %ld\n", nanos());
+    if (write(STDOUT_FILENO, line, strlen(line)) < 0)
+	_exit(1);
+}
+
+/* sigtarget - tshbench -S: print the time of each SIGINT and SIGTSTP */
+int sigtarget(void)
+{
+    char line[64];
+
+    signal(SIGINT, sigtarget_handler);
+    signal(SIGTSTP, sigtarget_handler);
+    sprintf(line, "P %d\n", (int)getpid());
+    if (write(STDOUT_FILENO, line, strlen(line)) < 0)
+	_exit(1);
+    while (1)
+	pause();
+}
+
+/* startshell - Run the shell with its stdin and stdout on pipes */
+void startshell(void)
+{
+    int in[2], out[2];
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((bench_pid = fork()) == 0) {
+	setpgid(0, 0);
+	dup2(in[0], STDIN_FILENO);
+	dup2(out[1], STDOUT_FILENO);
+	dup2(out[1], STDERR_FILENO);
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	execl(bench_shell, bench_shell, (char *)NULL);
+	perror(bench_shell);
+	_exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    bench_in = in[1];
+    bench_out = out[0];
+}
+
+/* sendline - Write a command line to the shell; return when it was sent */
+long sendline(const char *line)
+{
+    long t = nanos();
+
+    if (write(bench_in, line, strlen(line)) != (ssize_t)strlen(line)) {
+	perror("write");
+	exit(1);
+    }
+    return t;
+}
+
+/*
+ * expect - Read the shell's output until text appears. Return the time
+ * of the read that completed it; what came before it is left in
+ * bench_buf, up to a '\0' put in place of text, and consumed by the
+ * next call.
+ */
+long expect(const char *text)
+{
+    static size_t used = 0;
+    struct pollfd pfd = {bench_out, POLLIN, 0};
+    char *p;
+    long t = nanos();
+    ssize_t n;
+
+    memmove(bench_buf, bench_buf + used, bench_len - used);
+    bench_len -= used;
+    used = 0;
+    bench_buf[bench_len] = '\0';
+    while ((p = strstr(bench_buf, text)) == NULL) {
+	if (poll(&pfd, 1, 5000) <= 0 || bench_len == BENCHBUF - 1 ||
+	    (n = read(bench_out, bench_buf + bench_len, BENCHBUF - 1 - bench_len)) <= 0) {
+	    fprintf(stderr, "tshbench: %s: no \"%s\" in time; got \"%s\"\n", bench_shell, text, bench_buf);
+	    kill(bench_pid, SIGKILL);
+	    exit(1);
+	}
+	t = nanos();
+	bench_len += n;
+	bench_buf[bench_len] = '\0';
+    }
+    *p = '\0';
+    used = p - bench_buf + strlen(text);
+    return t;
+}
+
+/* stampline - The times a tshbench -T in bench_buf printed */
+void stampline(long *start, long *end)
+{
+    char *p = strstr(bench_buf, "T ");
+
+    if (p == NULL || sscanf(p, "T %ld %ld", start, end) != 2) {
+	fprintf(stderr, "tshbench: %s: no stamp in \"%s\"\n", bench_shell, bench_buf);
+	exit(1);
+    }
+}
+
+int cmplong(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* result - Print the statistics of n samples in ns, scaled by div */
+void result(const char *name, const char *unit, long *v, int n, double div)
+{
+    double sum = 0;
+    int i;
+
+    qsort(v, n, sizeof(long), cmplong);
+    for (i = 0; i < n; i++)
+	sum += v[i];
+    printf("%s\n    \"%s\": {\"unit\": \"%s\", \"n\": %d, \"min\": %.3f, \"p50\": %.3f, "
+	   "\"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f}",
+	   bench_first ? "" : ",", name, unit, n, v[0] / div, v[n / 2] / div,
+	   v[n * 99 / 100] / div, v[n - 1] / div, sum / n / div);
+    bench_first = 0;
+}
+
+/* endtoend - The benchmarks that drive the shell */
+void endtoend(int runs, long *v, long *w)
+{
+    char line[PATH_MAX + 8];
+    long t0, start, end, t;
+    pid_t target;
+    int i, sig;
+
+    startshell();
+    expect("tsh> ");
+
+    for (i = 0; i < runs; i++) {
+	t0 = sendline("/bin/true\n");
+	v[i] = expect("tsh> ") - t0;
+    }
+    result("eval_true", "us", v, runs, 1e3);
+
+    sprintf(line, "%s -T\n", bench_self);
+    for (i = 0; i < runs; i++) {
+	t0 = sendline(line);
+	t = expect("tsh> ");
+	stampline(&start, &end);
+	v[i] = start - t0;
+	w[i] = t - end;
+    }
+    result("line_to_exec", "us", v, runs, 1e3);
+    result("exit_to_prompt", "us", w, runs, 1e3);
+
+    /* One foreground target takes every signal; SIGKILL ends it */
+    sprintf(line, "%s -S\n", bench_self);
+    sendline(line);
+    expect("P ");
+    expect("\n");
+    target = atoi(bench_buf);
+    usleep(20000); // Until the shell has it in the job table as FG
+    for (sig = SIGINT; sig; sig = sig == SIGINT ? SIGTSTP : 0) {
+	for (i = 0; i < runs; i++) {
+	    t0 = nanos();
+	    kill(bench_pid, sig);
+	    expect("S ");
+	    expect("\n");
+	    v[i] = atol(bench_buf) - t0;
+	}
+	result(sig == SIGINT ? "sigint_forward" : "sigtstp_forward", "us", v, runs, 1e3);
+    }
+    kill(target, SIGKILL);
+    expect("tsh> ");
+
+    close(bench_in); // End of file: the shell exits
+    waitpid(bench_pid, NULL, 0);
+}
+
+/* jidbench - Time jid_free and jid_alloc with n job IDs in use */
+void jidbench(int runs, long *v, int n, const char *name)
+{
+    int *ids = malloc(n * sizeof(int));
+    int i, k, next = 0, rounds = 1000;
+    long t0;
+
+    jid_reset();
+    for (k = 0; k < n; k++)
+	ids[k] = jid_alloc();
+    for (i = 0; i < runs; i++) {
+	t0 = nanos();
+	for (k = 0; k < rounds; k++) {
+	    jid_free(ids[next]);
+	    ids[next] = jid_alloc();
+	    next = (next + 1) % n;
+	}
+	v[i] = (nanos() - t0) / rounds;
+    }
+    result(name, "ns", v, runs, 1);
+    free(ids);
+}
+
+/* inprocess - The benchmarks that call tsh.c directly */
+void inprocess(int runs, long *v)
+{
+    char *line = "ls -l /usr/bin \"a b\" 'c d' e\\ f < in > out 2> err &\n";
+    char *argv[MAXARGS], *infile, *outfile, *errfile;
+    char cmd[] = "myspin 1 &\n";
+    int append_out, i, k, j, rounds = 1000;
+    long t0;
+    volatile long sink = 0;
+
+    for (i = 0; i < runs; i++) {
+	t0 = nanos();
+	for (k = 0; k < rounds; k++)
+	    sink += parseline(line, argv, &infile, &outfile, &errfile, &append_out);
+	v[i] = (nanos() - t0) / rounds;
+    }
+    result("parseline", "ns", v, runs, 1);
+
+    initjobs(jobs);
+    for (i = 0; i < runs; i++) {
+	t0 = nanos();
+	for (k = 0; k < rounds; k++) {
+	    for (j = 0; j < MAXJOBS; j++)
+		addjob(jobs, 1000 + j, BG, cmd);
+	    for (j = 0; j < MAXJOBS; j++)
+		deletejob(jobs, 1000 + j);
+	}
+	v[i] = (nanos() - t0) / (rounds * 2 * MAXJOBS);
+    }
+    result("jobtable_fill", "ns", v, runs, 1);
+
+    for (j = 0; j < MAXJOBS; j++) {
+	addjob(jobs, 1000 + j * MAXPROCS, BG, cmd);
+	for (k = 1; k < MAXPROCS; k++)
+	    addproc(getjobpid(jobs, 1000 + j * MAXPROCS), 1000 + j * MAXPROCS + k);
+    }
+    for (i = 0; i < runs; i++) {
+	t0 = nanos();
+	for (k = 0; k < rounds; k++) {
+	    j = k % MAXJOBS;
+	    sink += getjobjid(jobs, jobs[j].jid) != NULL;
+	    sink += getjobpid(jobs, jobs[j].pid) != NULL;
+	    sink += getjobproc(jobs, 1000 + MAXJOBS * MAXPROCS - 1 - k % (MAXJOBS * MAXPROCS), &j) != NULL;
+	}
+	v[i] = (nanos() - t0) / (rounds * 3);
+    }
+    result("jobtable_lookup", "ns", v, runs, 1);
+    initjobs(jobs);
+
+    jidbench(runs, v, 16, "jid_16");
+    jidbench(runs, v, 100000, "jid_100k");
+    initjobs(jobs);
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 200, endonly = 0, c;
+    long *v, *w;
+
+    if (argc == 2 && strcmp(argv[1], "-T") == 0)
+	return stamp();
+    if (argc == 2 && strcmp(argv[1], "-S") == 0)
+	return sigtarget();
+
+    while ((c = getopt(argc, argv, "s:n:e")) != EOF) {
+	switch (c) {
+	case 's':
+	    bench_shell = optarg;
+	    break;
+	case 'n':
+	    runs = atoi(optarg);
+	    break;
+	case 'e':
+	    endonly = 1;
+	    break;
+	default:
+	    runs = 0;
+	}
+    }
+    if (runs < 1) {
+	fprintf(stderr, "Usage: %s [-s shell] [-n runs] [-e]\n", argv[0]);
+	exit(1);
+    }
+    if (realpath("/proc/self/exe", bench_self) == NULL) {
+	perror("/proc/self/exe");
+	exit(1);
+    }
+    v = malloc(runs * sizeof(long));
+    w = malloc(runs * sizeof(long));
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("{\n  \"shell\": \"%s\",\n  \"runs\": %d,\n  \"results\": {", bench_shell, runs);
+    fflush(stdout);
+    endtoend(runs, v, w);
+    if (!endonly)
+	inprocess(runs, v);
+    printf("\n  }\n}\n");
+    exit(0);
+}
@@ -0,0 +1,239 @@
+/*
+ * tshload.c - Client and load generator for tsh --serve
+ *
+ * usage: tshload -s socket -x request
+ *        tshload -s socket [-c conns] [-n runs] [-w window] [-e cmdline]
+ * The first form sends one request and prints the replies: "out"
+ * messages as the raw output they carry, anything else as a line,
+ * stopping at the first reply that is not "out".
+ * The second submits runs "run cmdline" requests (default 10000 of
+ * "true") over conns connections (default 4), each keeping up to
+ * window requests in flight (default 16), and prints the submissions
+ * per second and the latency from request to "ok" reply.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#define MAXCONNS 256
+#define MAXMSG (1 << 20)
+
+char *sockpath = NULL;
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* dial - Connect to the server */
+int dial(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	perror(sockpath);
+	exit(1);
+    }
+    return fd;
+}
+
+/* readall - Read exactly len bytes; return 0, or -1 at end of file */
+int readall(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = read(fd, buf, len)) <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* request - Add a request to buf at *len */
+void request(char *buf, size_t *len, const char *text)
+{
+    uint32_t n = htonl(strlen(text));
+
+    memcpy(buf + *len, &n, 4);
+    memcpy(buf + *len + 4, text, strlen(text));
+    *len += 4 + strlen(text);
+}
+
+/* one - Send one request and print the replies */
+int one(char *text)
+{
+    static char msg[MAXMSG + 1];
+    char buf[4096 + 4];
+    size_t len = 0;
+    uint32_t n;
+    int fd = dial();
+
+    if (strlen(text) > 4096) {
+	fprintf(stderr, "tshload: request too long\n");
+	exit(1);
+    }
+    request(buf, &len, text);
+    if (write(fd, buf, len) != len) {
+	perror("write");
+	exit(1);
+    }
+    while (readall(fd, (char *)&n, 4) == 0) {
+	n = ntohl(n);
+	if (n > MAXMSG || readall(fd, msg, n) < 0)
+	    break;
+	if (n >= 4 && strncmp(msg, "out ", 4) == 0) {
+	    fwrite(msg + 4, 1, n - 4, stdout);
+	    continue;
+	}
+	msg[n] = '\0';
+	printf("%s\n", msg);
+	exit(strncmp(msg, "err", 3) == 0);
+    }
+    fprintf(stderr, "tshload: connection closed\n");
+    exit(1);
+}
+
+int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    char *cmdline = "true", *onereq = NULL, text[4096 + 8];
+    struct pollfd pfd[MAXCONNS];
+    int conns = 4, window = 16, c, i, errors = 0;
+    long runs = 10000, sent = 0, done = 0;
+    long head[MAXCONNS], tail[MAXCONNS]; /* requests sent and answered, per connection */
+    double *start, *lat, t0, t1;
+    static char in[MAXCONNS][8192];
+    size_t inlen[MAXCONNS];
+
+    while ((c = getopt(argc, argv, "s:x:c:n:w:e:")) != EOF) {
+	switch (c) {
+	case 's':
+	    sockpath = optarg;
+	    break;
+	case 'x':
+	    onereq = optarg;
+	    break;
+	case 'c':
+	    conns = atoi(optarg);
+	    break;
+	case 'n':
+	    runs = atol(optarg);
+	    break;
+	case 'w':
+	    window = atoi(optarg);
+	    break;
+	case 'e':
+	    cmdline = optarg;
+	    break;
+	default:
+	    sockpath = NULL;
+	}
+    }
+    if (sockpath == NULL || conns < 1 || conns > MAXCONNS || runs < 1 || window < 1 ||
+	strlen(cmdline) > 4096) {
+	fprintf(stderr, "Usage: %s -s socket -x request\n", argv[0]);
+	fprintf(stderr, "       %s -s socket [-c conns] [-n runs] [-w window] [-e cmdline]\n", argv[0]);
+	exit(1);
+    }
+    if (onereq)
+	return one(onereq);
+
+    sprintf(text, "run %s", cmdline);
+    start = malloc(runs * sizeof(double));
+    lat = malloc(runs * sizeof(double));
+    for (i = 0; i < conns; i++) {
+	pfd[i].fd = dial();
+	pfd[i].events = POLLIN;
+	head[i] = tail[i] = 0;
+	inlen[i] = 0;
+    }
+
+    /*
+     * Request k of connection i is submission k * conns + i, so the
+     * replies, which come in order, say which start time they go with.
+     */
+    t0 = now();
+    while (done < runs) {
+	for (i = 0; i < conns; i++) {
+	    char buf[16 * (4096 + 12)];
+	    size_t len = 0;
+
+	    while (head[i] - tail[i] < window && head[i] * conns + i < runs && len + 4 + strlen(text) <= sizeof(buf)) {
+		start[head[i] * conns + i] = now();
+		request(buf, &len, text);
+		head[i]++;
+		sent++;
+	    }
+	    if (len > 0 && write(pfd[i].fd, buf, len) != len) {
+		perror("write");
+		exit(1);
+	    }
+	}
+	if (poll(pfd, conns, -1) < 0) {
+	    perror("poll");
+	    exit(1);
+	}
+	for (i = 0; i < conns; i++) {
+	    ssize_t n;
+	    size_t pos = 0;
+	    uint32_t mlen;
+
+	    if (!(pfd[i].revents & (POLLIN | POLLHUP)))
+		continue;
+	    if ((n = read(pfd[i].fd, in[i] + inlen[i], sizeof(in[i]) - inlen[i])) <= 0) {
+		fprintf(stderr, "tshload: connection closed\n");
+		exit(1);
+	    }
+	    inlen[i] += n;
+	    while (inlen[i] - pos >= 4) {
+		memcpy(&mlen, in[i] + pos, 4);
+		mlen = ntohl(mlen);
+		if (mlen > sizeof(in[i]) - 4) {
+		    fprintf(stderr, "tshload: reply too long\n");
+		    exit(1);
+		}
+		if (inlen[i] - pos - 4 < mlen)
+		    break;
+		if (strncmp(in[i] + pos + 4, "ok", 2) != 0)
+		    errors++;
+		lat[done++] = now() - start[tail[i] * conns + i];
+		tail[i]++;
+		pos += 4 + mlen;
+	    }
+	    memmove(in[i], in[i] + pos, inlen[i] - pos);
+	    inlen[i] -= pos;
+	}
+    }
+    t1 = now();
+
+    qsort(lat, runs, sizeof(double), cmpdouble);
+    printf("%ld runs of \"%s\" over %d connections, window %d\n", runs, cmdline, conns, window);
+    printf("%.0f submissions/s, %d errors\n", runs / (t1 - t0), errors);
+    printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n", lat[runs / 2] * 1e3,
+	   lat[runs * 99 / 100] * 1e3, lat[runs - 1] * 1e3);
+    exit(errors != 0);
+}
@@ -0,0 +1,349 @@
+/*
+ * tshreplay.c - Replays a session recorded with tsh -R as a load test
+ *
+ * usage: tshreplay [-s shell] [-c sessions] [-x speed] log
+ * Runs sessions copies of the shell (default 1 of ./tsh) side by side,
+ * each on pipes as the driver does, and plays the recorded session to
+ * every one of them: its lines as input, and its SIGINTs and SIGTSTPs
+ * as signals to the shell. Events keep their recorded spacing divided
+ * by speed (default 1, 0 or "max" for none), but a command line waits
+ * for the prompt after the previous command, and a signal that went to
+ * a foreground job waits until the shell is in sigsuspend (waitfg) with
+ * one, as /proc/PID/syscall tells. It prints the commands per second
+ * over all sessions and the latency from a command's last line to the
+ * prompt that follows it.
+ */
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define MAXSESSIONS 256
+#define RECMAGIC "tshrec1\n"
+#define PROMPT "tsh> "
+
+struct event {
+    int kind;           /* 'L', 'C', 'I', 'T', 'i' or 't' (see record in tsh.c) */
+    double delay;       /* seconds since the previous event */
+    char *text;         /* a line's bytes */
+    size_t len;
+};
+
+struct session {
+    pid_t pid;
+    int in, out;        /* the shell's stdin, -1 once closed, and stdout */
+    int sysfd;          /* its /proc/PID/syscall */
+    int next;           /* next event to play */
+    double last;        /* when the previous event was played */
+    double sent;        /* when the command owed a prompt was sent, 0 if none */
+    int waiting;        /* a prompt is owed */
+    char tail[8];       /* end of the output so far, for prompts split by reads */
+    size_t tlen;
+};
+
+struct event *events = NULL;
+int nevents = 0;
+char *shell = "./tsh";
+double speed = 1;
+
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* varint - Decode a LEB128 number at *p, before end; -1 if cut short */
+long varint(unsigned char **p, unsigned char *end)
+{
+    long v = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 63) {
+	v |= (long)(**p & 0x7f) << shift;
+	if (!(*(*p)++ & 0x80))
+	    return v;
+	shift += 7;
+    }
+    return -1;
+}
+
+/* load - Read the events of a session log */
+void load(const char *path)
+{
+    unsigned char *buf, *p, *end;
+    long delay, len;
+    FILE *fp;
+    size_t size;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	perror(path);
+	exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    if ((buf = malloc(size + 1)) == NULL || fread(buf, 1, size, fp) != size) {
+	perror(path);
+	exit(1);
+    }
+    fclose(fp);
+    if (size < strlen(RECMAGIC) || memcmp(buf, RECMAGIC, strlen(RECMAGIC)) != 0) {
+	fprintf(stderr, "tshreplay: %s: not a session log\n", path);
+	exit(1);
+    }
+    events = malloc(size * sizeof(struct event)); // An event takes 2 bytes at least
+    end = buf + size;
+    for (p = buf + strlen(RECMAGIC); p < end; nevents++) {
+	struct event *e = &events[nevents];
+
+	e->kind = *p++;
+	if (strchr("LCITit", e->kind) == NULL || (delay = varint(&p, end)) < 0)
+	    break;
+	e->delay = delay / 1e6;
+	e->text = NULL;
+	e->len = 0;
+	if (e->kind == 'L' || e->kind == 'C') {
+	    if ((len = varint(&p, end)) < 0 || len > end - p)
+		break;
+	    e->text = (char *)p;
+	    e->len = len;
+	    p += len;
+	}
+    }
+    if (p < end) {
+	fprintf(stderr, "tshreplay: %s: bad event %d\n", path, nevents + 1);
+	exit(1);
+    }
+}
+
+/* start - Run a copy of the shell with its stdin and stdout on pipes */
+void start(struct session *s)
+{
+    int in[2], out[2];
+    char path[64];
+
+    if (pipe(in) < 0 || pipe(out) < 0) {
+	perror("pipe");
+	exit(1);
+    }
+    if ((s->pid = fork()) == 0) {
+	setpgid(0, 0);
+	dup2(in[0], STDIN_FILENO);
+	dup2(out[1], STDOUT_FILENO);
+	dup2(out[1], STDERR_FILENO);
+	close(in[0]);
+	close(in[1]);
+	close(out[0]);
+	close(out[1]);
+	execl(shell, shell, (char *)NULL);
+	perror(shell);
+	_exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    s->in = in[1];
+    s->out = out[0];
+    fcntl(s->in, F_SETFD, FD_CLOEXEC);
+    fcntl(s->out, F_SETFD, FD_CLOEXEC);
+    sprintf(path, "/proc/%d/syscall", (int)s->pid);
+    if ((s->sysfd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+	perror(path);
+	exit(1);
+    }
+    s->next = 0;
+    s->last = now();
+    s->sent = 0;
+    s->waiting = 1; // For the first prompt
+    s->tlen = 0;
+}
+
+/* insuspend - Is the shell waiting in sigsuspend, as waitfg does? */
+int insuspend(struct session *s)
+{
+    char buf[128];
+    ssize_t len;
+    long nr;
+
+    if ((len = pread(s->sysfd, buf, sizeof(buf) - 1, 0)) <= 0)
+	return 1;
+    buf[len] = '\0';
+    return sscanf(buf, "%ld", &nr) == 1 && nr == SYS_rt_sigsuspend;
+}
+
+/*
+ * play - Play the events of a session that are due; return how many
+ * seconds until the next one may be, or -1 if it waits for output.
+ */
+double play(struct session *s, double t)
+{
+    struct event *e;
+    double due;
+
+    while (s->next < nevents) {
+	e = &events[s->next];
+	if ((e->kind == 'L' || e->kind == 'C') && s->waiting)
+	    return -1;
+	due = s->last + (speed > 0 ? e->delay / speed : 0);
+	if (t < due)
+	    return due - t;
+	if ((e->kind == 'I' || e->kind == 'T') && !insuspend(s))
+	    return 0.001; // The job is not in the foreground yet
+	if (e->text != NULL) {
+	    if (write(s->in, e->text, e->len) != (ssize_t)e->len) {
+		perror("write");
+		exit(1);
+	    }
+	} else
+	    kill(s->pid, toupper(e->kind) == 'I' ? SIGINT : SIGTSTP);
+	s->last = t;
+	s->next++;
+	// The last line of a command is owed the next prompt
+	if (e->text != NULL && (s->next == nevents || events[s->next].kind != 'C')) {
+	    s->waiting = 1;
+	    s->sent = t;
+	}
+    }
+    if (!s->waiting && s->in >= 0) {
+	close(s->in); // End of the session: the shell exits
+	s->in = -1;
+    }
+    return -1;
+}
+
+/*
+ * output - Take output of a session; return 1 if it owed a prompt and
+ * this brought it, else 0.
+ */
+int output(struct session *s, char *buf, size_t n)
+{
+    char scan[sizeof(s->tail) + 4096];
+    size_t len = s->tlen + n;
+    int found;
+
+    memcpy(scan, s->tail, s->tlen);
+    memcpy(scan + s->tlen, buf, n);
+    scan[len] = '\0';
+    found = memmem(scan, len, PROMPT, strlen(PROMPT)) != NULL;
+    s->tlen = len < strlen(PROMPT) - 1 ? len : strlen(PROMPT) - 1;
+    memcpy(s->tail, scan + len - s->tlen, s->tlen);
+    if (!found || !s->waiting)
+	return 0;
+    s->waiting = 0;
+    return s->sent > 0;
+}
+
+int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    static struct session sess[MAXSESSIONS];
+    struct pollfd pfd[MAXSESSIONS];
+    int map[MAXSESSIONS];
+    int nsess = 1, live, c, i, k, cmds = 0, sigs = 0, errors = 0;
+    long ndone = 0, nlat;
+    double *lat, t0, t1, t, wait, next;
+    char buf[4096];
+    ssize_t n;
+
+    while ((c = getopt(argc, argv, "s:c:x:")) != EOF) {
+	switch (c) {
+	case 's':
+	    shell = optarg;
+	    break;
+	case 'c':
+	    nsess = atoi(optarg);
+	    break;
+	case 'x':
+	    speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+	    break;
+	default:
+	    nsess = 0;
+	}
+    }
+    if (optind != argc - 1 || nsess < 1 || nsess > MAXSESSIONS || speed < 0) {
+	fprintf(stderr, "Usage: %s [-s shell] [-c sessions] [-x speed] log\n", argv[0]);
+	exit(1);
+    }
+    load(argv[optind]);
+    for (i = 0; i < nevents; i++) {
+	if (events[i].text != NULL && (i + 1 == nevents || events[i + 1].kind != 'C'))
+	    cmds++;
+	sigs += events[i].text == NULL;
+    }
+    nlat = (long)cmds * nsess;
+    lat = malloc((nlat + 1) * sizeof(double));
+    signal(SIGPIPE, SIG_IGN);
+
+    t0 = now();
+    for (i = 0; i < nsess; i++)
+	start(&sess[i]);
+    for (live = nsess; live > 0;) {
+	t = now();
+	next = -1;
+	for (i = k = 0; i < nsess; i++) {
+	    if (sess[i].out < 0)
+		continue;
+	    if ((wait = play(&sess[i], t)) >= 0 && (next < 0 || wait < next))
+		next = wait;
+	    pfd[k].fd = sess[i].out;
+	    pfd[k].events = POLLIN;
+	    map[k++] = i;
+	}
+	if (poll(pfd, k, next < 0 ? -1 : (int)(next * 1e3) + 1) < 0) {
+	    perror("poll");
+	    exit(1);
+	}
+	t = now();
+	for (i = 0; i < k; i++) {
+	    struct session *s = &sess[map[i]];
+
+	    if (!(pfd[i].revents & (POLLIN | POLLHUP)))
+		continue;
+	    if ((n = read(s->out, buf, sizeof(buf))) > 0) {
+		if (output(s, buf, n) && ndone < nlat)
+		    lat[ndone++] = t - s->sent;
+		continue;
+	    }
+	    // The shell has exited, at the end of the session or not
+	    if (s->next < nevents)
+		errors++;
+	    close(s->out);
+	    s->out = -1;
+	    if (s->in >= 0)
+		close(s->in);
+	    close(s->sysfd);
+	    waitpid(s->pid, NULL, 0);
+	    live--;
+	}
+    }
+    t1 = now();
+
+    printf("%d sessions of %s (%d commands, %d signals) at ", nsess, argv[optind], cmds, sigs);
+    if (speed > 0)
+	printf("%gx\n", speed);
+    else
+	printf("max speed\n");
+    printf("%.0f commands/s over %.3f s, %d errors\n", ndone / (t1 - t0), t1 - t0, errors);
+    if (ndone > 0) {
+	qsort(lat, ndone, sizeof(double), cmpdouble);
+	printf("latency ms: p50 %.3f  p99 %.3f  max %.3f\n", lat[ndone / 2] * 1e3,
+	       lat[ndone * 99 / 100] * 1e3, lat[ndone - 1] * 1e3);
+    }
+    exit(errors != 0);
+}